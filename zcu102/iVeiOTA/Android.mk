@@ -10,6 +10,14 @@ LOCAL_SRC_FILES := \
 	src/socket_interface.cc \
 	src/uboot.cc \
 	src/support.cc \
+	src/chunk_scheduler.cc \
+	src/chunk_stream.cc \
+	src/written_regions.cc \
+	src/delta.cc \
+	src/hash.cc \
+	src/copy_engine.cc \
+	src/io_uring.cc \
+	src/ext_fs.cc \
 	src/debug.cc \
 	src/config.cc \
 
@@ -66,6 +74,14 @@ LOCAL_SRC_FILES := \
 	src/socket_interface.cc \
 	src/uboot.cc \
 	src/support.cc \
+	src/chunk_scheduler.cc \
+	src/chunk_stream.cc \
+	src/written_regions.cc \
+	src/delta.cc \
+	src/hash.cc \
+	src/copy_engine.cc \
+	src/io_uring.cc \
+	src/ext_fs.cc \
 	src/debug.cc \
 	src/config.cc \
 
@@ -111,6 +127,35 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_EXECUTABLE)
 
+##################################################
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	bench.cc \
+	src/message.cc \
+	src/socket_interface.cc \
+	src/hash.cc \
+	src/copy_engine.cc \
+	src/io_uring.cc \
+	src/debug.cc \
+
+LOCAL_CPP_EXTENSION := cc
+
+LOCAL_CPPFLAGS := \
+	-W \
+	-Wall \
+	-Wextra \
+	-Wunused \
+	-Werror \
+	-Wno-unused-parameter \
+	-fexceptions \
+	-I $(LOCAL_PATH)/src \
+
+LOCAL_MODULE := iVeiOTAbench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
 ## ##############copy config file##################
 ## include $(CLEAR_VARS)
 ## LOCAL_MODULE := iVeiOTA.conf
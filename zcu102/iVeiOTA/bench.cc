@@ -0,0 +1,285 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "copy_engine.hh"
+#include "io_uring.hh"
+#include "hash.hh"
+#include "message.hh"
+#include "socket_interface.hh"
+#include "debug.hh"
+
+using namespace iVeiOTA;
+
+// Measures the copy engine backends against each other on real files and devices, so we
+//  can pick the copy_* options for a board.  Loop devices stand in for partitions:
+//    losetup -f --show src.img ; losetup -f --show dest.img
+//    iVeiOTAbench copy /dev/loop0 /dev/loop1
+
+static void usage(const char *name) {
+  std::cerr << "Usage: " << name << " copy <src> <dest> [options]" << std::endl;
+  std::cerr << "       " << name << " read <src> [options]" << std::endl;
+  std::cerr << "       " << name << " hash <src> [options]" << std::endl;
+  std::cerr << "       " << name << " parse [options]" << std::endl;
+  std::cerr << "  src and dest can be regular files or block devices (loop devices work)" << std::endl;
+  std::cerr << "  parse feeds -s bytes (default 256M) of messages with -b byte payloads through the" << std::endl;
+  std::cerr << "   socket parser, in reads of up to 1M" << std::endl;
+  std::cerr << "  -m <list>  Comma separated copy methods to compare (default pipeline,io_uring)" << std::endl;
+  std::cerr << "  -s <size>  Bytes to move (default: the whole source).  K/M/G suffixes are allowed" << std::endl;
+  std::cerr << "  -b <size>  Buffer size (default 1M)" << std::endl;
+  std::cerr << "  -q <depth> Buffers in flight (default 4)" << std::endl;
+  std::cerr << "  -n <runs>  Runs of each method (default 3)" << std::endl;
+  std::cerr << "  -d         Use O_DIRECT" << std::endl;
+  std::cerr << "  -c         Drop the page cache before each run (needs root)" << std::endl;
+  std::cerr << "  -v         Print the copy engine debug output" << std::endl;
+}
+
+static uint64_t parseSize(const char *s) {
+  char *end = nullptr;
+  uint64_t val = strtoull(s, &end, 0);
+  switch(end ? *end : 0) {
+  case 'G': case 'g': val *= 1024;
+  case 'M': case 'm': val *= 1024;
+  case 'K': case 'k': val *= 1024;
+  }
+  return val;
+}
+
+static uint64_t deviceSize(int fd) {
+  struct stat ss;
+  if(fstat(fd, &ss) != 0) return 0;
+  if(!S_ISBLK(ss.st_mode)) return ss.st_size;
+  uint64_t size = 0;
+  if(ioctl(fd, BLKGETSIZE64, &size) != 0) return 0;
+  return size;
+}
+
+// How fast SocketInterface turns what it reads off the socket into messages
+static int parseBench(uint64_t size, uint64_t payloadSize, int runs) {
+  // One read's worth of back to back messages, with payloads that aren't all zeros
+  std::vector<uint8_t> payload(payloadSize);
+  for(size_t i = 0; i < payload.size(); i++) payload[i] = (uint8_t)(i * 131 + 7);
+  Message message(Message::OTAUpdate, Message::OTAUpdate.ProcessChunk, 0, 0, 0, 0, payload);
+  std::unique_ptr<uint8_t[]> header = message.header.ToByteArray();
+  size_t hLen = Message::Header::Size(message.header.rev);
+
+  const size_t readLen = 1024 * 1024;
+  std::vector<uint8_t> stream;
+  while(stream.size() < readLen || stream.size() < hLen + payloadSize) {
+    stream.insert(stream.end(), header.get(), header.get() + hLen);
+    stream.insert(stream.end(), payload.begin(), payload.end());
+  }
+  uint64_t perStream = stream.size() / (hLen + payloadSize);
+
+  std::cout << "parse " << size << " bytes, " << payloadSize << " byte payloads" << std::endl;
+  double total = 0;
+  uint64_t messages = 0, bytes = 0;
+  for(int run = 0; run < runs; run++) {
+    uint64_t got = 0;
+    SocketInterface intf([&got](const Message &m) { got++; }, false, "#iveiota_bench");
+    auto start = std::chrono::steady_clock::now();
+    uint64_t fed = 0;
+    while(fed < size) {
+      // Split the stream up like reads would, so messages straddle them
+      for(size_t at = 0; at < stream.size(); at += readLen) {
+        intf.ProcessData(stream.data() + at, std::min(readLen, stream.size() - at));
+      }
+      fed += stream.size();
+    }
+    total += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(got != (fed / stream.size()) * perStream) {
+      std::cerr << "Parsed " << got << " messages, expected " << (fed / stream.size()) * perStream << std::endl;
+    }
+    messages += got;
+    bytes += fed;
+  }
+
+  double avg = total / runs;
+  std::cout << std::fixed << std::setprecision(3) << avg << "s  " << std::setprecision(1) <<
+    ((total > 0) ? (bytes / total / (1024 * 1024)) : 0) << " MB/s  " << std::setprecision(0) <<
+    ((total > 0) ? (messages / total) : 0) << " messages/s" << std::endl;
+  return 0;
+}
+
+static void dropCaches() {
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if(fd < 0 || write(fd, "3", 1) != 1) {
+    std::cerr << "Could not drop caches: " << strerror(errno) << std::endl;
+  }
+  if(fd >= 0) close(fd);
+}
+
+int main(int argc, char ** argv) {
+  debug.SetThreshold(Debug::Mode::Warn);
+  debug.SetDefault(Debug::Mode::Debug);
+
+  if(argc < 2 || (argc < 3 && std::string(argv[1]) != "parse")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string mode = argv[1];
+  std::vector<std::string> paths;
+  std::string methodList = "pipeline,io_uring";
+  CopyOptions options;
+  uint64_t size = 0;
+  int runs = 3;
+  bool drop = false;
+
+  for(int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool hasVal = (i + 1 < argc);
+    if     (arg == "-m" && hasVal) methodList = argv[++i];
+    else if(arg == "-s" && hasVal) size = parseSize(argv[++i]);
+    else if(arg == "-b" && hasVal) options.blockSize = parseSize(argv[++i]);
+    else if(arg == "-q" && hasVal) options.depth = atoi(argv[++i]);
+    else if(arg == "-n" && hasVal) runs = atoi(argv[++i]);
+    else if(arg == "-d") options.direct = true;
+    else if(arg == "-c") drop = true;
+    else if(arg == "-v") debug.SetThreshold(Debug::Mode::Debug);
+    else if(arg[0] != '-') paths.push_back(arg);
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if(mode == "parse") {
+    if(!paths.empty()) {
+      usage(argv[0]);
+      return 1;
+    }
+    return parseBench(size ? size : 256 * 1024 * 1024, options.blockSize, runs);
+  }
+
+  bool copy = (mode == "copy");
+  bool hash = (mode == "hash");
+  if((copy && paths.size() != 2) || (!copy && ((mode != "read" && !hash) || paths.size() != 1))) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int srcFd = open(paths[0].c_str(), O_RDONLY);
+  if(srcFd < 0) {
+    std::cerr << "Could not open " << paths[0] << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  int destFd = -1;
+  if(copy) {
+    destFd = open(paths[1].c_str(), O_WRONLY | O_CREAT, 0644);
+    if(destFd < 0) {
+      std::cerr << "Could not open " << paths[1] << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+  if(size == 0) size = deviceSize(srcFd);
+
+  if(hash) {
+    // Every algorithm, with and without the CPU's SHA instructions
+    std::cout << "hash " << size << " bytes" << std::endl;
+    const HashAlgorithm algos[] = {HashAlgorithm::MD5, HashAlgorithm::SHA1, HashAlgorithm::SHA256, HashAlgorithm::SHA512};
+    for(HashAlgorithm algo : algos) {
+      for(int accel = 1; accel >= 0; accel--) {
+        Hasher hasher(algo, accel != 0);
+        if(!accel && hasher.Engine() == Hasher(algo, true).Engine()) continue;
+        double total = 0;
+        for(int run = 0; run < runs; run++) {
+          if(drop) dropCaches();
+          hasher.Reset();
+          auto start = std::chrono::steady_clock::now();
+          ReadData(srcFd, 0, size, [&hasher](const uint8_t *data, uint64_t len) {
+              hasher.Update(data, len);
+              return 0;
+            }, options);
+          hasher.Final();
+          total += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        double avg = total / runs;
+        std::cout << std::left << std::setw(8) << ToString(algo) << std::setw(14) << hasher.Engine() <<
+          std::fixed << std::setprecision(3) << avg << "s  " << std::setprecision(1) <<
+          ((avg > 0) ? (size / avg / (1024 * 1024)) : 0) << " MB/s" << std::endl;
+      }
+    }
+    // And the CRC32C used for message checksums
+    for(int accel = 1; accel >= 0; accel--) {
+      double total = 0;
+      for(int run = 0; run < runs; run++) {
+        if(drop) dropCaches();
+        uint32_t crc = 0;
+        auto start = std::chrono::steady_clock::now();
+        ReadData(srcFd, 0, size, [&crc, accel](const uint8_t *data, uint64_t len) {
+            crc = Crc32c(data, len, crc, accel != 0);
+            return 0;
+          }, options);
+        total += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      }
+      double avg = total / runs;
+      std::cout << std::left << std::setw(8) << "CRC32C" << std::setw(14) << (accel ? Crc32cEngine() : "portable") <<
+        std::fixed << std::setprecision(3) << avg << "s  " << std::setprecision(1) <<
+        ((avg > 0) ? (size / avg / (1024 * 1024)) : 0) << " MB/s" << std::endl;
+    }
+    close(srcFd);
+    return 0;
+  }
+
+  std::vector<CopyMethod> methods;
+  for(size_t start = 0; start <= methodList.size(); ) {
+    size_t comma = methodList.find(',', start);
+    if(comma == std::string::npos) comma = methodList.size();
+    std::string name = methodList.substr(start, comma - start);
+    CopyMethod m = GetCopyMethod(name);
+    if(m == CopyMethod::Unknown) {
+      std::cerr << "Unknown copy method " << name << std::endl;
+      return 1;
+    }
+    methods.push_back(m);
+    start = comma + 1;
+  }
+
+  std::cout << mode << " " << size << " bytes, " << options.depth << " x " << options.blockSize <<
+    " byte buffers" << (options.direct ? ", O_DIRECT" : "") << ", io_uring " <<
+    (IOUring::Available() ? "available" : "not available") << std::endl;
+
+  for(CopyMethod m : methods) {
+    options.method = m;
+    double total = 0;
+    CopyStats stats;
+    for(int run = 0; run < runs; run++) {
+      if(drop) dropCaches();
+      // Writes aren't done until they are on the device
+      auto start = std::chrono::steady_clock::now();
+      uint64_t done;
+      if(copy) {
+        done = CopyData(destFd, 0, srcFd, 0, size, options, nullptr, &stats);
+        fdatasync(destFd);
+      } else {
+        done = ReadData(srcFd, 0, size, [](const uint8_t *data, uint64_t len) { return 0; },
+                        options, nullptr, &stats);
+      }
+      if(done != size) {
+        std::cerr << ToString(m) << " moved " << done << " of " << size << " bytes" << std::endl;
+      }
+      total += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    double avg = total / runs;
+    std::cout << std::left << std::setw(16) << ToString(m) << " used " << std::setw(14) <<
+      ToString(stats.method) << std::fixed << std::setprecision(3) << avg << "s  " <<
+      std::setprecision(1) << ((avg > 0) ? (size / avg / (1024 * 1024)) : 0) << " MB/s" << std::endl;
+  }
+
+  close(srcFd);
+  if(destFd >= 0) close(destFd);
+  return 0;
+}
@@ -8,6 +8,8 @@
 #include <sys/un.h>
 #include <sys/select.h>
 #include <cstring>
+#include <fstream>
+#include <fcntl.h>
 
 #include "iveiota.hh"
 #include "socket_interface.hh"
@@ -42,14 +44,18 @@ int main(int argc, char ** argv) {
     } commands[] = {
         {"--init",     false, Message::Management,     Message::Management.Initialize},
 
+        {"--begin-fd", true,  Message::OTAUpdate,      Message::OTAUpdate.BeginUpdate},
         {"--begin",    true,  Message::OTAUpdate,      Message::OTAUpdate.BeginUpdate},
         {"--cancel",   false, Message::OTAUpdate,      Message::OTAUpdate.CancelUpdate},
         {"--continue", false, Message::OTAUpdate,      Message::OTAUpdate.ContinueUpdate},
+        {"--process-fd", true, Message::OTAUpdate,     Message::OTAUpdate.ProcessChunk},
         {"--process",  true,  Message::OTAUpdate,      Message::OTAUpdate.ProcessChunk},
+        {"--stream",   true,  Message::OTAUpdate,      Message::OTAUpdate.ProcessChunk},
         {"--finalize", false, Message::OTAUpdate,      Message::OTAUpdate.Finalize},
 
         {"--ostatus",  false, Message::OTAStatus,      Message::OTAStatus.UpdateStatus},
         {"--cstatus",  false, Message::OTAStatus,      Message::OTAStatus.ChunkStatus},
+        {"--subscribe", false, Message::OTAStatus,     Message::OTAStatus.Subscribe},
 
         {"--valid",    false, Message::BootManagement, Message::BootManagement.SetValidity},
         {"--usuccess", true, Message::BootManagement, Message::BootManagement.MarkUpdateSuccess},
@@ -60,6 +66,7 @@ int main(int argc, char ** argv) {
 
     vector<Message> messages;
     bool noCopy = false;
+    bool verify = false;
     for(int i = 1; i < argc; i++) {
         int j = 0;
         while(true) {
@@ -69,10 +76,15 @@ int main(int argc, char ** argv) {
               cout << IVEIOTA_TEST_CLIENT << "Doing a no copy" << endl;
               noCopy = true;
             }
+            if(strncmp(argv[i], "--verify", 8) == 0) {
+              // Have the server check all the chunk files next to the manifest first
+              verify = true;
+            }
 
             if(strncmp(commands[j].arg, argv[i], strlen(commands[j].arg)) == 0) {
                 uint32_t i1=0, i2=0, i3=0, i4=0;
                 vector<uint8_t> payload;
+                shared_ptr<Message::PassedFd> passFd;
 
                 if(commands[j].more) {
                     // Command requires more processing
@@ -86,12 +98,40 @@ int main(int argc, char ** argv) {
                     // This needs a path to the manifest file
                     i1 = 1; // Manifest on filesystem
                     if(noCopy) i4 = 42; // no copy for convenience sake
+                    if(verify) i2 = 1;  // chunk files are in the manifest's directory
                     for(int q = 0; q < (int)strlen(argv[i]); q++) {
                       payload.push_back(argv[i][q]);
                     }
                     payload.push_back('\0');
                   } // end begin
 
+                  else if(strcmp(commands[j].arg, "--begin-fd") == 0) {
+                    i++;
+                    if(i >= argc) {
+                      cerr << "Need a manifest file to begin update" << endl;
+                      break;
+                    }
+
+                    // Pass the open manifest file instead of its path
+                    int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+                    if(fd < 0) {
+                      cerr << "Could not open " << argv[i] << endl;
+                      break;
+                    }
+                    i1 = 2; // Manifest in the passed file
+                    if(noCopy) i4 = 42;
+                    if(verify) {
+                      // The server can't tell where the file was, so tell it
+                      string dir(argv[i]);
+                      dir = (dir.rfind('/') == string::npos) ? "." : dir.substr(0, dir.rfind('/'));
+                      char cwd[4096];
+                      if(dir[0] != '/' && getcwd(cwd, sizeof(cwd))) dir = string(cwd) + "/" + dir;
+                      i2 = 1;
+                      payload.assign(dir.begin(), dir.end());
+                    }
+                    passFd = make_shared<Message::PassedFd>(fd);
+                  } // end begin-fd
+
                   else if(strcmp(commands[j].arg, "--usuccess") == 0 ||
                           strcmp(commands[j].arg, "--bsuccess") == 0) {
                     i1 = 1; // current container
@@ -118,6 +158,63 @@ int main(int argc, char ** argv) {
 
                   } // end process
 
+                  else if(strcmp(commands[j].arg, "--process-fd") == 0) {
+                    i += 2;
+                    if(i >= argc) {
+                      cerr << "Need a chunk file and identifier to process a chunk" << endl;
+                      break;
+                    }
+
+                    // Pass the open chunk file.  "-" passes our stdin, which can be a pipe
+                    int fd = (strcmp(argv[i], "-") == 0) ? dup(0) : open(argv[i], O_RDONLY | O_CLOEXEC);
+                    if(fd < 0) {
+                      cerr << "Could not open " << argv[i] << endl;
+                      break;
+                    }
+                    i1 = 2; // Chunk data in the passed file
+                    payload.assign(argv[i-1], argv[i-1] + strlen(argv[i-1]));
+                    payload.push_back('\0');
+                    passFd = make_shared<Message::PassedFd>(fd);
+                  } // end process-fd
+
+                  else if(strcmp(commands[j].arg, "--stream") == 0) {
+                    i += 2;
+                    if(i >= argc) {
+                      cerr << "Need a chunk file and identifier to stream a chunk" << endl;
+                      break;
+                    }
+
+                    // Send the chunk file in 1M pieces.  All but the last are pushed here
+                    ifstream chunkFile(argv[i], ios::binary);
+                    vector<char> piece(1024 * 1024);
+                    uint64_t at = 0;
+                    while(true) {
+                      chunkFile.read(piece.data(), piece.size());
+                      streamsize got = chunkFile.gcount();
+
+                      payload.assign(argv[i-1], argv[i-1] + strlen(argv[i-1]));
+                      payload.push_back('\0');
+                      payload.insert(payload.end(), piece.begin(), piece.begin() + got);
+                      i1 = 0; // Data in the payload
+                      i3 = at & 0xFFFFFFFF;
+                      i4 = at >> 32;
+                      at += got;
+                      if(!chunkFile || chunkFile.peek() == EOF) break;
+                      messages.push_back(Message(commands[j].cmd, commands[j].subCmd, i1, i2, i3, i4, payload));
+                    }
+                  } // end stream
+
+                }
+
+                // Offer the newest protocol revision we know, and ask for everything checksummed
+                if(strcmp(commands[j].arg, "--init") == 0) {
+                  i2 = Message::MaxRev;
+                  i3 = Message::ChecksumHeader | Message::ChecksumPayload;
+                }
+                // Hear about everything, at the server's rate
+                if(strcmp(commands[j].arg, "--subscribe") == 0) {
+                  i1 = Message::OTAStatus.EventState | Message::OTAStatus.EventChunk | Message::OTAStatus.EventProgress |
+                    Message::OTAStatus.EventVerify;
                 }
 
                 cout << IVEIOTA_TEST_CLIENT << "pushing message: " << (int)commands[j].cmd << ":" << (int)commands[j].subCmd <<
@@ -126,6 +223,7 @@ int main(int argc, char ** argv) {
                 messages.push_back(Message(commands[j].cmd, commands[j].subCmd,
                                            i1, i2, i3, i4,
                                            payload));
+                messages.back().fd = passFd;
             }
 
             j++;
@@ -133,6 +231,7 @@ int main(int argc, char ** argv) {
     }
 
     cout << IVEIOTA_TEST_CLIENT << "Connecting to server." << endl;
+    // Ask for a packet socket.  If the server only takes streams we get one of those
     SocketInterface intf(
       [](const Message &message) {
         cout << IVEIOTA_TEST_CLIENT << "Received message: " << (int)message.header.type << ":" << (int)message.header.subType << endl;
@@ -143,11 +242,13 @@ int main(int argc, char ** argv) {
           if(((i + 1) % 10) == 0) printf(" -- \n");
         }
         if(message.payload.size() > 0) cout << endl;
-    });
+    }, false, IVEIOTA_DEFAULT_SOCK_NAME, SOCK_SEQPACKET);
 
     // Sending all messages
     for(auto m : messages) {
       cout << IVEIOTA_TEST_CLIENT << "Sending message: " << (int)m.header.type << ":" << (int)m.header.subType << endl;
+      // Passing a file needs protocol revision 2.  The server reads that from any client
+      if(m.fd) intf.SetRevision(Message::MaxRev);
       intf.Send(m);
     }
 
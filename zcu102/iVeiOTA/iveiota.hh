@@ -19,6 +19,9 @@
 //  the @ gets replaced by \0 for abstract namespace required by Android
 #define IVEIOTA_DEFAULT_SOCK_NAME "@/tmp/iVeiOTA.server" 
 
+// The kind of socket (SOCK_STREAM or SOCK_SEQPACKET) used when the config file doesn't say
+#define IVEIOTA_DEFAULT_SOCK_TYPE SOCK_STREAM
+
 // Default configuration file for OTA management
 #define IVEIOTA_DEFAULT_CONFIG    "/etc/iVeiOTA.conf"
 
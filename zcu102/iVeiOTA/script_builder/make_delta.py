@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#
+# Make a delta chunk that rebuilds new.img from old.img, which has to be the image at the
+#  same place in the container the device is running.  The format is described in
+#  src/delta.hh.  Blocks of the new image are copied from wherever the same data is in
+#  the old one, zeroed, or sent in the delta if they are new
+#
+# usage: make_delta.py [-b block_size] [--ident name] [--partition part] [--offset n]
+#                      old.img new.img out.delta
+#
+# Prints the manifest line for the delta
+
+import argparse
+import hashlib
+import mmap
+import os
+import struct
+import sys
+
+MAGIC = b"iVeiDLT1"
+MAX_INSERT = 16 * 1024 * 1024  # Inserts are flushed at this size to keep memory down
+
+
+class DeltaWriter:
+    def __init__(self, out):
+        self.out = out
+        self.op = None
+        self.src = 0
+        self.length = 0
+        self.data = bytearray()
+        self.counts = {b"C": 0, b"I": 0, b"Z": 0}
+
+    def add(self, op, length, src=0, data=None):
+        # Runs of the same op are merged, copies only if they read on from the last one
+        if op != self.op or (op == b"C" and src != self.src + self.length) or \
+           (op == b"I" and len(self.data) >= MAX_INSERT):
+            self.flush()
+            self.op = op
+            self.src = src
+        self.length += length
+        if data is not None:
+            self.data += data
+
+    def flush(self):
+        if self.op == b"C":
+            self.out.write(b"C" + struct.pack(">QQ", self.src, self.length))
+        elif self.op == b"Z":
+            self.out.write(b"Z" + struct.pack(">Q", self.length))
+        elif self.op == b"I":
+            self.out.write(b"I" + struct.pack(">Q", self.length))
+            self.out.write(self.data)
+        if self.op is not None:
+            self.counts[self.op] += self.length
+        self.op = None
+        self.length = 0
+        self.data = bytearray()
+
+    def end(self):
+        self.flush()
+        self.out.write(b"E")
+
+
+def mapped(f):
+    size = os.fstat(f.fileno()).st_size
+    if size == 0:
+        return b""
+    return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Make an iVeiOTA delta chunk")
+    parser.add_argument("-b", "--block-size", type=int, default=4096)
+    parser.add_argument("--ident", default="delta")
+    parser.add_argument("--partition", default="system")
+    parser.add_argument("--offset", type=int, default=0)
+    parser.add_argument("old")
+    parser.add_argument("new")
+    parser.add_argument("delta")
+    args = parser.parse_args()
+    bs = args.block_size
+
+    with open(args.old, "rb") as oldf, open(args.new, "rb") as newf, open(args.delta, "wb") as out:
+        old = mapped(oldf)
+        new = mapped(newf)
+
+        # Where each block of the old image is, by its contents
+        index = {}
+        for off in range(0, len(old) - bs + 1, bs):
+            index.setdefault(hashlib.md5(old[off:off + bs]).digest(), off)
+
+        out.write(MAGIC + struct.pack(">Q", len(new)) + hashlib.sha256(new).digest())
+        writer = DeltaWriter(out)
+        zero = bytes(bs)
+        for off in range(0, len(new), bs):
+            block = new[off:off + bs]
+            if old[off:off + len(block)] == block:
+                writer.add(b"C", len(block), off)
+                continue
+            if block == zero[:len(block)]:
+                writer.add(b"Z", len(block))
+                continue
+            src = index.get(hashlib.md5(block).digest()) if len(block) == bs else None
+            if src is not None and old[src:src + bs] == block:
+                writer.add(b"C", len(block), src)
+            else:
+                writer.add(b"I", len(block), data=block)
+        writer.end()
+
+    with open(args.delta, "rb") as f:
+        md5 = hashlib.md5()
+        for piece in iter(lambda: f.read(1024 * 1024), b""):
+            md5.update(piece)
+
+    sys.stderr.write("%d bytes: %d copied, %d zeroed, %d in the delta (%d bytes)\n" %
+                     (len(new), writer.counts[b"C"], writer.counts[b"Z"], writer.counts[b"I"],
+                      os.path.getsize(args.delta)))
+    print("%s:delta:%s:0:%d:0:%d:md5:%s" % (args.ident, args.partition, args.offset, len(new), md5.hexdigest()))
+
+
+if __name__ == "__main__":
+    main()
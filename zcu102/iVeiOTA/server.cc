@@ -71,23 +71,41 @@ int main(int argc, char ** argv) {
   debug << Debug::Mode::Warn  << "Warn  statements visible" << std::endl;
   debug << Debug::Mode::Err   << "Error statements visible" << std::endl;
 
-  // Create our listening socket
+  // Create our listening socket, of the kind the config file asks for
+  int socketType = IVEIOTA_DEFAULT_SOCK_TYPE;
+  std::string socketTypeName = config.GetOption("socket_type");
+  if(!socketTypeName.empty()) socketType = SocketInterface::SocketType(socketTypeName);
   SocketInterface server([&uboot, &manager, &server, &initialized](const Message &message) {
     debug << "Message received: " << message.header.toString() << std::endl;
     std::vector<std::unique_ptr<Message>> resp;
+    uint16_t protocolRev = 0;
+    uint32_t checksums = 0;
+
+    // Only chunk data can be taken a fragment at a time.  Anything else that is too large to
+    //  put back together gets one NACK, on its last fragment
+    bool fragment = !message.header.Whole();
+    bool more = (message.header.flags & Message::Header::FlagMore) != 0;
+    if(fragment && !(message.header.type == Message::OTAUpdate &&
+                     message.header.subType == Message::OTAUpdate.ProcessChunk)) {
+      if(!more) server.Send(*Message::MakeNACK(message, 0, "Message too large"), message.connection);
+      return;
+    }
 
     // We handle management messages here ourselves
     if(message.header.type == Message::Management &&
        message.header.subType == Message::Management.Initialize) {
-      // Initialize has been called - send back our state and our revision
+      // Initialize has been called - send back our state and our revision, and the
+      //  protocol revision we will use from now on: the highest we both know
       initialized = true;
       uint32_t updated = uboot.GetUpdated(Container::Active) ? 1 : 0;
       uint32_t rev =
         ((IVEIOTA_MAJOR << 16) & 0x00FF0000) |
         ((IVEIOTA_MINOR <<  8) & 0x0000FF00) |
         ((IVEIOTA_PATCH <<  0) & 0x000000FF);
+      protocolRev = std::max<uint32_t>(1, std::min<uint32_t>(message.header.imm[1], Message::MaxRev));
+      checksums = message.header.imm[2] & Message::Checksums(protocolRev);
       resp.push_back(std::unique_ptr<Message>(new Message(Message::Management, Message::Management.Initialize,
-                                                          updated, 0, 0, rev)));
+                                                          updated, protocolRev, checksums, rev)));
     } else if(!initialized) {
       // If we haven't been initialized yet, we can't continue
       resp.push_back(Message::MakeNACK(message, 0, "Not yet initialized"));
@@ -114,7 +132,9 @@ int main(int argc, char ** argv) {
     } // end if(!initialized)
     
     debug << "Sending " << resp.size() << " messages as a response" << std::endl;
-    if(resp.size() < 1) {
+    if(resp.size() < 1 && fragment && more) {
+      // Fragments that went fine aren't answered, only the message as a whole
+    } else if(resp.size() < 1) {
       // We got a message but don't have a response for it
       debug << Debug::Mode::Err << "No response to " << (int)message.header.type << ":" << (int)message.header.subType << std::endl;
       resp.push_back(Message::MakeNACK(message, 0, "Internal Error: No response to this message"));
@@ -124,9 +144,35 @@ int main(int argc, char ** argv) {
       debug << Debug::Mode::Warn << "More than one response to the message " << (int)message.header.type << ":" << (int)message.header.subType << std::endl;
     }
     for(unsigned int i = 0; i < resp.size(); i++) {
-      server.Send(*resp[i]);
+      server.Send(*resp[i], message.connection);
+    }
+
+    // The Initialize response goes out in the old revision, everything after in the new one
+    if(protocolRev != 0) {
+      debug << Debug::Mode::Info << "Using protocol revision " << protocolRev << ", checksums " << checksums << std::endl;
+      server.SetRevision(protocolRev, message.connection);
+      server.SetChecksums(checksums, message.connection);
     }
-  }, true);
+  }, true, IVEIOTA_DEFAULT_SOCK_NAME, socketType);
+
+  // Large chunk data goes straight to the chunk's stream as it arrives, instead of being
+  //  collected in memory first
+  server.SetPayloadSink(Message::OTAUpdate, Message::OTAUpdate.ProcessChunk, [&manager, &initialized](const Message &message) {
+    if(!initialized || !config.Valid()) return std::shared_ptr<Message::PayloadSink>();
+    return manager.MakeChunkSink(message);
+  });
+
+  // Events go straight back out to the clients that subscribed to them
+  manager.OnEvent([&server](uint32_t connection, const Message &event) { return server.Send(event, connection); });
+
+  // A client sending a chunk faster than it can be written is held back by not reading it
+  manager.OnPause([&server](uint32_t connection, bool paused) { server.PauseReading(connection, paused); });
+
+  // The manager wakes us up when its workers finish something, so we don't have to poll it
+  if(!server.Watch(manager.WakeFd(), [&manager]() { manager.Process(); })) {
+    debug << Debug::Mode::Err << "Could not watch the OTA manager, falling back to polling" << std::endl;
+  }
+  int timeout = (manager.WakeFd() >= 0) ? -1 : 1000;
 
   // Our event loop
   bool done = false;
@@ -139,14 +185,15 @@ int main(int argc, char ** argv) {
       done = true;
     }
 
-    // If the client disconnected, we have to close the client connection
+    // Sends to a client that went away fail without a SIGPIPE, and the socket interface
+    //  closes that client itself.  Anything else that raises one we can ignore
     if(brokenPipe) {
-      server.CloseConnection();
       brokenPipe = false;
     }
     
     // Process any data we need to from the server
-    if(!server.Process()) {
+    //  This sleeps until a client sends something, a worker finishes, or a signal arrives
+    if(!server.Process(timeout)) {
       break;
     }
 
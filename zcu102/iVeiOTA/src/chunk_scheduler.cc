@@ -0,0 +1,136 @@
+#include <algorithm>
+
+#include "chunk_scheduler.hh"
+#include "debug.hh"
+
+namespace iVeiOTA {
+  void* ChunkWorkerFunction(void *data) {
+    ChunkScheduler *scheduler = (ChunkScheduler*)data;
+    scheduler->work();
+    return nullptr;
+  }
+
+  ChunkScheduler::ChunkScheduler(unsigned workers) :
+    workers(std::max(workers, 1U)), running(0), exclusiveRunning(false), stop(false) {
+  }
+
+  ChunkScheduler::~ChunkScheduler() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      pending.clear();
+      stop = true;
+    }
+    changed.notify_all();
+    for(pthread_t thread : threads) pthread_join(thread, NULL);
+  }
+
+  // The workers are only started the first time there is something for them to do
+  bool ChunkScheduler::start() {
+    if(!threads.empty()) return true;
+
+    // Chunk processing needs the larger stack.  See the comment in OTAManager::prepareForUpdate
+    size_t stacksize;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &stacksize);
+    pthread_attr_setstacksize(&attr, stacksize * 4);
+
+    for(unsigned i = 0; i < workers; i++) {
+      pthread_t thread;
+      if(pthread_create(&thread, &attr, &ChunkWorkerFunction, (void*)this) != 0) {
+        debug << Debug::Mode::Failure << "Could not create chunk worker " << i << std::endl;
+        break;
+      }
+      threads.push_back(thread);
+    }
+    pthread_attr_destroy(&attr);
+
+    debug << "Started " << threads.size() << " chunk workers" << std::endl;
+    return !threads.empty();
+  }
+
+  bool ChunkScheduler::Submit(const std::set<std::string> &keys, bool exclusive, const Job &job) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if(!start()) return false;
+      pending.push_back(Entry{keys, exclusive, job});
+    }
+    changed.notify_all();
+    return true;
+  }
+
+  bool ChunkScheduler::Idle() {
+    std::lock_guard<std::mutex> guard(lock);
+    return pending.empty() && running == 0;
+  }
+
+  size_t ChunkScheduler::Clear() {
+    size_t dropped;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      dropped = pending.size();
+      pending.clear();
+    }
+    changed.notify_all();
+    return dropped;
+  }
+
+  void ChunkScheduler::Wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this]() { return pending.empty() && running == 0; });
+  }
+
+  std::list<ChunkScheduler::Entry>::iterator ChunkScheduler::runnable() {
+    if(exclusiveRunning) return pending.end();
+
+    // Keys wanted by jobs ahead of the one we are looking at.  A job can't jump ahead
+    //  of an earlier one on the same device
+    std::set<std::string> ahead;
+    for(auto it = pending.begin(); it != pending.end(); ++it) {
+      if(it->exclusive) {
+        // Only once everything before it has finished, and nothing after it may pass it
+        if(it == pending.begin() && running == 0) return it;
+        break;
+      }
+
+      bool blocked = false;
+      for(const std::string &key : it->keys) {
+        if(busy.count(key) > 0 || ahead.count(key) > 0) blocked = true;
+        ahead.insert(key);
+      }
+      if(!blocked) return it;
+    }
+    return pending.end();
+  }
+
+  void ChunkScheduler::work() {
+    std::unique_lock<std::mutex> guard(lock);
+    while(true) {
+      std::list<Entry>::iterator it;
+      changed.wait(guard, [this, &it]() { return stop || (it = runnable()) != pending.end(); });
+      if(stop) break;
+
+      Entry entry = *it;
+      pending.erase(it);
+      for(const std::string &key : entry.keys) busy.insert(key);
+      if(entry.exclusive) exclusiveRunning = true;
+      running++;
+
+      guard.unlock();
+      entry.job();
+      guard.lock();
+
+      for(const std::string &key : entry.keys) busy.erase(busy.find(key));
+      if(entry.exclusive) exclusiveRunning = false;
+      running--;
+
+      // Finishing may let other jobs run, and lets Wait() return
+      changed.notify_all();
+      if(finished) {
+        guard.unlock();
+        finished();
+        guard.lock();
+      }
+    }
+  }
+};
@@ -0,0 +1,74 @@
+#ifndef __IVEIOTA_CHUNK_SCHEDULER_HH
+#define __IVEIOTA_CHUNK_SCHEDULER_HH
+
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+
+namespace iVeiOTA {
+  // A fixed pool of worker threads that runs jobs as soon as nothing they depend on is busy.
+  //  Each job names the resources it uses (for chunks, the physical device it writes).
+  //  Jobs that share a resource run one at a time in the order they were submitted, and
+  //  jobs with nothing in common run at the same time.  An exclusive job waits for every
+  //  job submitted before it, and nothing submitted after it starts until it is done
+  class ChunkScheduler {
+  public:
+    typedef std::function<void()> Job;
+
+    explicit ChunkScheduler(unsigned workers);
+    ~ChunkScheduler();
+
+    // Queue a job.  Returns false if the workers could not be started
+    bool Submit(const std::set<std::string> &keys, bool exclusive, const Job &job);
+
+    // True if nothing is queued or running
+    bool Idle();
+
+    // Drop the jobs that haven't started yet.  Returns how many were dropped
+    size_t Clear();
+
+    // Block until nothing is queued or running
+    void Wait();
+
+    unsigned Workers() const { return workers; }
+
+    // Called by a worker after every job, once the job no longer counts as running (so
+    //  Idle() can already be true).  Set it before submitting anything
+    void OnFinished(const Job &notify) { finished = notify; }
+
+  private:
+    ChunkScheduler(const ChunkScheduler&) = delete;
+    ChunkScheduler &operator=(const ChunkScheduler&) = delete;
+
+    struct Entry {
+      std::set<std::string> keys;
+      bool exclusive;
+      Job job;
+    };
+
+    bool start();
+    void work();
+    // The first queued job that is allowed to run now, or pending.end().  Needs lock
+    std::list<Entry>::iterator runnable();
+    friend void* ChunkWorkerFunction(void *data);
+
+    unsigned workers;
+    std::vector<pthread_t> threads;
+    Job finished;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::list<Entry> pending;          // Submitted but not started, oldest first
+    std::multiset<std::string> busy;   // Keys held by running jobs
+    unsigned running;                  // Jobs running now
+    bool exclusiveRunning;
+    bool stop;
+  };
+};
+
+#endif
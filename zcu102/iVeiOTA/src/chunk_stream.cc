@@ -0,0 +1,158 @@
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "chunk_stream.hh"
+#include "config.hh"
+#include "debug.hh"
+
+namespace iVeiOTA {
+  ChunkStream::ChunkStream(const std::string &dest, uint64_t offset, uint64_t size,
+                           HashAlgorithm algo, const std::string &expected, uint64_t maxBuffered) :
+    dest(dest), offset(offset), size(size), expected(expected), maxBuffered(maxBuffered),
+    hasher(algo, config.GetOption("hash_engine", "native") != "portable"),
+    start(0), received(0), buffered(0), aborted(false), failed(false), done(false) {
+  }
+
+  bool ChunkStream::Resume(const CopyCheckpoint &from) {
+    if(received != 0 || from.offset >= size || !hasher.RestoreState(from.hashState)) return false;
+    start = received = from.offset;
+    return true;
+  }
+
+  bool ChunkStream::Push(std::vector<uint8_t> &&data) {
+    if(data.size() > size - received) return false;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if(aborted || failed || done) return false;
+
+    received += data.size();
+    buffered += data.size();
+    pieces.push_back(std::move(data));
+    changed.notify_all();
+    return true;
+  }
+
+  bool ChunkStream::Full() {
+    std::lock_guard<std::mutex> guard(lock);
+    return !(aborted || failed || done) && buffered >= maxBuffered;
+  }
+
+  bool ChunkStream::WaitForRoom(unsigned ms) {
+    std::unique_lock<std::mutex> guard(lock);
+    return changed.wait_for(guard, std::chrono::milliseconds(ms), [this]() {
+        return aborted || failed || done || buffered < maxBuffered;
+      });
+  }
+
+  void ChunkStream::Abort() {
+    std::lock_guard<std::mutex> guard(lock);
+    aborted = true;
+    changed.notify_all();
+  }
+
+  bool ChunkStream::Done() {
+    std::lock_guard<std::mutex> guard(lock);
+    return done;
+  }
+
+  bool ChunkStream::Run(volatile bool *cancel, uint64_t interval, unsigned timeout,
+                        const std::function<void(const CopyCheckpoint&)> &checkpoint,
+                        const std::function<void(uint64_t done)> &progress) {
+    int fd = open(dest.c_str(), O_WRONLY);
+    if(fd < 0) {
+      debug << Debug::Mode::Err << "Could not open " << dest << " for a chunk stream: " << strerror(errno) << std::endl;
+    }
+
+    uint64_t written = start;
+    uint64_t nextCheckpoint = (interval > 0) ? written - (written % interval) + interval : size;
+    bool good = (fd >= 0);
+    auto lastData = std::chrono::steady_clock::now();
+
+    while(good && written < size) {
+      std::vector<uint8_t> piece;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        // Wake up now and then to see if we've been canceled or the client went away
+        changed.wait_for(guard, std::chrono::seconds(1), [this]() { return aborted || !pieces.empty(); });
+        if(aborted || (cancel && *cancel)) {
+          good = false;
+          break;
+        }
+        if(pieces.empty()) {
+          if(std::chrono::steady_clock::now() - lastData > std::chrono::seconds(timeout)) {
+            debug << Debug::Mode::Warn << "No data for " << timeout << "s, giving up on the stream to " << dest << std::endl;
+            good = false;
+          }
+          continue;
+        }
+        piece = std::move(pieces.front());
+        pieces.pop_front();
+      }
+      lastData = std::chrono::steady_clock::now();
+
+      hasher.Update(piece.data(), piece.size());
+      for(uint64_t at = 0; at < piece.size(); ) {
+        ssize_t ret = pwrite(fd, piece.data() + at, piece.size() - at, offset + written + at);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) {
+          debug << Debug::Mode::Err << "Stream write to " << dest << " failed: " << strerror(errno) << std::endl;
+          good = false;
+          break;
+        }
+        at += ret;
+      }
+      if(!good) break;
+      written += piece.size();
+      if(progress) progress(written);
+
+      bool room;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        room = (buffered >= maxBuffered && buffered - piece.size() < maxBuffered);
+        buffered -= piece.size();
+        changed.notify_all();
+      }
+      if(room && roomCallback) roomCallback();
+
+      // Only checkpoint what is really on the device
+      if(written >= nextCheckpoint && written < size) {
+        nextCheckpoint += interval;
+        if(fdatasync(fd) == 0 && checkpoint) {
+          CopyCheckpoint point;
+          point.offset    = written;
+          point.hashState = hasher.SaveState();
+          checkpoint(point);
+        }
+      }
+    }
+
+    std::string hashValue;
+    if(good) {
+      hashValue = hasher.Final();
+      good = (hashValue == expected) && fdatasync(fd) == 0;
+    }
+    if(!good && fd >= 0) {
+      // Whatever we wrote can't be trusted, so make sure nothing mistakes it for the image
+      debug << Debug::Mode::Warn << "Chunk stream to " << dest << " failed (" << hashValue << "::" << expected <<
+        ", wrote " << written << " of " << size << ").  Invalidating it at " << offset << std::endl;
+      if(!InvalidateRange(fd, offset, written)) {
+        debug << Debug::Mode::Err << "Could not invalidate " << dest << ": " << strerror(errno) << std::endl;
+      }
+    }
+    if(fd >= 0) close(fd);
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      failed = !good;
+      done = true;
+      pieces.clear();
+      buffered = 0;
+      changed.notify_all();
+    }
+    if(roomCallback) roomCallback();
+    return good;
+  }
+};
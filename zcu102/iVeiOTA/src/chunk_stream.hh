@@ -0,0 +1,88 @@
+#ifndef __IVEIOTA_CHUNK_STREAM_HH
+#define __IVEIOTA_CHUNK_STREAM_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+#include "support.hh"
+#include "hash.hh"
+
+namespace iVeiOTA {
+  // An image chunk that arrives over the socket a piece at a time instead of as a file.
+  //  The socket side Push()es the pieces in order and a worker Run()s the stream, hashing
+  //  and writing each piece straight to the destination.  Push never waits, since the
+  //  socket side is the main loop.  Once maxBuffered bytes are waiting the stream is Full()
+  //  and the socket side stops reading until the writer makes room, so the socket is only
+  //  read as fast as the device can be written
+  class ChunkStream {
+  public:
+    ChunkStream(const std::string &dest, uint64_t offset, uint64_t size,
+                HashAlgorithm algo, const std::string &expected, uint64_t maxBuffered);
+
+    // Start from a checkpoint of an earlier stream of this chunk instead of from 0.  Only
+    //  before anything is pushed.  Returns false if the checkpoint can't be used
+    bool Resume(const CopyCheckpoint &from);
+
+    // Where the next piece has to start, and where the stream ends
+    uint64_t Received() const { return received; }
+    uint64_t Size() const { return size; }
+    bool Complete() const { return received == size; }
+
+    // Queue the next piece.  Returns false if the stream has failed (or been aborted), or
+    //  the piece would run past the end
+    bool Push(std::vector<uint8_t> &&data);
+
+    // True while maxBuffered bytes or more are waiting to be written.  A stream that is
+    //  finished one way or another is never full
+    bool Full();
+    // Wait up to ms milliseconds for the stream to not be Full().  Returns false if it still is
+    bool WaitForRoom(unsigned ms);
+    // Called from the writer when it makes room in a stream that was full, and when it is
+    //  done.  Only before the stream is Run
+    void OnRoom(const std::function<void()> &callback) { roomCallback = callback; }
+
+    // Give up on the stream.  A waiting Run returns
+    void Abort();
+
+    // True once Run has returned
+    bool Done();
+
+    // Write the stream out.  Every interval bytes (if not 0) the destination is synced and
+    //  checkpoint is called.  progress, if set, is told how much is written after each
+    //  piece.  If no data arrives for timeout seconds the stream fails.
+    //  Returns true if everything was written, synced, and matched the expected hash.
+    //  Otherwise what was written is invalidated
+    bool Run(volatile bool *cancel, uint64_t interval, unsigned timeout,
+             const std::function<void(const CopyCheckpoint&)> &checkpoint,
+             const std::function<void(uint64_t done)> &progress = nullptr);
+
+  private:
+    ChunkStream(const ChunkStream&) = delete;
+    ChunkStream &operator=(const ChunkStream&) = delete;
+
+    std::string dest;
+    uint64_t    offset;      // Where on dest the chunk starts
+    uint64_t    size;
+    std::string expected;
+    uint64_t    maxBuffered;
+    Hasher      hasher;
+    uint64_t    start;       // Where this stream started (a resume point or 0)
+    uint64_t    received;    // Only used by the pushing side
+    std::function<void()> roomCallback;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> pieces;
+    uint64_t buffered;       // Bytes in pieces
+    bool aborted;
+    bool failed;
+    bool done;
+  };
+};
+
+#endif
@@ -153,6 +153,14 @@ namespace iVeiOTA {
               hashAlgorithms[algo] = path;
             }
           } // end if(toks[0] == "hash_prog")
+
+          // option:name:value
+          //  Tuning knobs for the OTA process.  See the sample config for what exists
+          else if(toks[0] == "option") {
+            if(toks.size() < 3) continue; // Invalid
+            debug << Debug::Mode::Info << "Option: " << toks[1] << ":" << toks[2] << std::endl;
+            options[toks[1]] = toks[2];
+          } // end if(toks[0] == "option")
           
         }
       }      
@@ -220,6 +228,29 @@ namespace iVeiOTA {
     }
   }
 
+  std::string GlobalConfig::GetOption(const std::string &name, const std::string &def) {
+    auto it = options.find(name);
+    if(it != options.end()) return it->second;
+    else                    return def;
+  }
+
+  int64_t GlobalConfig::GetOptionInt(const std::string &name, int64_t def) {
+    auto it = options.find(name);
+    if(it == options.end()) return def;
+
+    // Allow the options to be given in K/M/G for convenience
+    char *end = nullptr;
+    int64_t val = strtoll(it->second.c_str(), &end, 0);
+    if(end == it->second.c_str()) {
+      debug << Debug::Mode::Warn << "Option " << name << " is not a number: " << it->second << std::endl;
+      return def;
+    }
+    if(*end == 'k' || *end == 'K') val *= 1024;
+    if(*end == 'm' || *end == 'M') val *= 1024 * 1024;
+    if(*end == 'g' || *end == 'G') val *= 1024 * 1024 * 1024;
+    return val;
+  }
+
   std::string GlobalConfig::GetFilesystemType(std::string dev) {
     if(deviceTypes.find(dev) != deviceTypes.end()) {      
       return deviceTypes[dev];
@@ -20,6 +20,10 @@ namespace iVeiOTA {
     std::string GetHashAlgorithmProgram(HashAlgorithm algo);
     std::string GetFilesystemType(std::string dev);
 
+    // Get a tuning option from the config file, or def if it isn't set
+    std::string GetOption(const std::string &name, const std::string &def = "");
+    int64_t     GetOptionInt(const std::string &name, int64_t def);
+
     bool Valid() const;
   protected:
     std::string configPath;  // Path to our configuration file
@@ -33,6 +37,9 @@ namespace iVeiOTA {
 
     // Mapping from physical device to filsystem type
     std::map<std::string, std::string> deviceTypes;
+
+    // Mapping from option names to their values
+    std::map<std::string, std::string> options;
     
     std::string active;    // Name of the active container
     std::string alternate; // Name of the alternate container
@@ -0,0 +1,891 @@
+#include <map>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#include "copy_engine.hh"
+#include "io_uring.hh"
+#include "debug.hh"
+
+namespace iVeiOTA {
+  // How much we ask the kernel to move per call.  Keeping this bounded lets us check
+  //  the cancel flag and print progress while copying multi-GB partitions
+  static const uint64_t KernelStep   = 8 * 1024 * 1024;
+  static const uint64_t BufferedStep = 1024 * 1024;
+
+  // Compare copies read large windows of both sides, then look for differences one
+  //  block at a time so only the blocks that changed are written
+  static const uint64_t CompareWindow = 4 * 1024 * 1024;
+  static const uint64_t CompareBlock  = 4096;
+
+  // Alignment O_DIRECT needs for buffers, offsets and lengths.  4K covers devices with
+  //  either 512 byte or 4K logical blocks
+  static const uint64_t DirectAlign = 4096;
+
+  // io_uring requests carry a 32 bit length
+  static const uint64_t URingMaxBlock = 64 * 1024 * 1024;
+
+  CopyMethod GetCopyMethod(const std::string &name) {
+    if(name == "auto")            return CopyMethod::Auto;
+    if(name == "copy_file_range") return CopyMethod::CopyFileRange;
+    if(name == "sendfile")        return CopyMethod::SendFile;
+    if(name == "splice")          return CopyMethod::Splice;
+    if(name == "io_uring")        return CopyMethod::IOUring;
+    if(name == "pipeline")        return CopyMethod::Pipeline;
+    if(name == "buffered")        return CopyMethod::Buffered;
+    if(name == "compare")         return CopyMethod::Compare;
+
+    else                          return CopyMethod::Unknown;
+  }
+
+  // The order we try the methods in when using Auto.  In-kernel first, then the ones
+  //  that bounce through user space
+  static const CopyMethod autoOrder[] = {
+    CopyMethod::CopyFileRange,
+    CopyMethod::SendFile,
+    CopyMethod::Splice,
+    CopyMethod::IOUring,
+    CopyMethod::Pipeline,
+    CopyMethod::Buffered,
+  };
+
+  // Remember which method worked for a pair of devices so we don't keep probing
+  //  methods that we already know will fail.  Copies can run on several threads
+  typedef std::pair<dev_t, dev_t> DevicePair;
+  static std::map<DevicePair, CopyMethod> knownMethods;
+  static std::mutex knownMethodsLock;
+
+  // Identify what backs a descriptor. Block devices are themselves the device,
+  //  regular files live on a filesystem device
+  static dev_t backingDevice(int fd) {
+    struct stat ss;
+    if(fstat(fd, &ss) != 0) return 0;
+    return S_ISBLK(ss.st_mode) ? ss.st_rdev : ss.st_dev;
+  }
+
+  static bool canceled(volatile bool *cancel) {
+    return cancel != nullptr && *cancel;
+  }
+
+  // CopyData wraps CopyOptions::tap in one of these, which also gets the offset (from
+  //  the start of the copy) of the data so nothing is tapped twice
+  typedef std::function<int (uint64_t at, const uint8_t *data, uint64_t len)> TapFn;
+
+  // Move data with one of the in-kernel methods.  done is updated with how many bytes
+  //  were written.  Returns 0 on success (copied everything or hit the end of the
+  //  source) or the errno that stopped us
+  static int kernelCopy(CopyMethod method, int destFd, uint64_t destOff, int srcFd, uint64_t srcOff,
+                        uint64_t len, volatile bool *cancel, uint64_t &done) {
+    bool copyAll = (len == 0);
+    int pipeFds[2] = {-1, -1};
+    int err = 0;
+
+    if(method == CopyMethod::CopyFileRange) {
+#ifndef __NR_copy_file_range
+      return ENOSYS;
+#endif
+    } else if(method == CopyMethod::SendFile) {
+      // sendfile writes at the file position of the destination
+      if(lseek(destFd, destOff + done, SEEK_SET) < 0) return errno;
+    } else if(method == CopyMethod::Splice) {
+      if(pipe(pipeFds) != 0) return errno;
+      // A bigger pipe means fewer trips through the kernel.  Failing is fine
+      fcntl(pipeFds[1], F_SETPIPE_SZ, 1024 * 1024);
+    } else {
+      return EINVAL;
+    }
+
+    int printCount = 0;
+    while((copyAll || done < len) && !canceled(cancel)) {
+      uint64_t toCopy = KernelStep;
+      if(!copyAll) toCopy = std::min(toCopy, len - done);
+
+      ssize_t moved = -1;
+      if(method == CopyMethod::CopyFileRange) {
+#ifdef __NR_copy_file_range
+        loff_t in  = srcOff + done;
+        loff_t out = destOff + done;
+        moved = syscall(__NR_copy_file_range, srcFd, &in, destFd, &out, (size_t)toCopy, 0);
+#endif
+      } else if(method == CopyMethod::SendFile) {
+        off_t in = srcOff + done;
+        moved = sendfile(destFd, srcFd, &in, toCopy);
+      } else {
+        loff_t in = srcOff + done;
+        moved = splice(srcFd, &in, pipeFds[1], NULL, toCopy, SPLICE_F_MOVE);
+
+        // Everything that went into the pipe has to come out before we go on.  If
+        //  the drain fails part way the next method restarts from what was written
+        ssize_t pending = moved;
+        while(pending > 0) {
+          loff_t out = destOff + done;
+          ssize_t wrote = splice(pipeFds[0], NULL, destFd, &out, pending, SPLICE_F_MOVE);
+          if(wrote < 0 && errno == EINTR) continue;
+          if(wrote <= 0) {
+            moved = -1;
+            if(wrote == 0) errno = EIO;
+            break;
+          }
+          pending -= wrote;
+          done += wrote;
+        }
+        if(moved > 0) moved = 0; // Already accounted for in the drain loop
+        else if(moved == 0) break;
+      }
+
+      if(moved < 0) {
+        if(errno == EINTR || errno == EAGAIN) continue;
+        err = errno;
+        break;
+      }
+
+      if(method != CopyMethod::Splice) {
+        if(moved == 0) break; // End of the source
+        done += moved;
+      }
+
+      if((printCount++ % 100) == 0) {
+        debug << "Copying " << done << std::endl;
+        printCount = 1;
+      }
+    }
+
+    if(pipeFds[0] >= 0) close(pipeFds[0]);
+    if(pipeFds[1] >= 0) close(pipeFds[1]);
+    return err;
+  }
+
+  // Copy data through a user space buffer.  This always works if the descriptors can be
+  //  read and written at all, so it is the last resort
+  static int bufferedCopy(int destFd, uint64_t destOff, int srcFd, uint64_t srcOff, uint64_t len,
+                          volatile bool *cancel, const TapFn &tap, uint64_t &done, uint64_t &readBytes) {
+    bool copyAll = (len == 0);
+
+    // This used to live on the stack, which overflowed the default pthread stack
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[BufferedStep]);
+
+    int printCount = 0;
+    while((copyAll || done < len) && !canceled(cancel)) {
+      uint64_t toRead = BufferedStep;
+      if(!copyAll) toRead = std::min(toRead, len - done);
+
+      ssize_t bread = pread(srcFd, buf.get(), toRead, srcOff + done);
+      if(bread < 0 && errno == EINTR) continue;
+      if(bread < 0) return errno;
+      if(bread == 0) break; // End of the source
+      readBytes += bread;
+      if(tap) {
+        int err = tap(done, buf.get(), bread);
+        if(err != 0) return err;
+      }
+
+      // Writes to block devices and files can come back short, so keep going until
+      //  everything we read is out
+      ssize_t wrote = 0;
+      while(wrote < bread) {
+        ssize_t w = pwrite(destFd, buf.get() + wrote, bread - wrote, destOff + done + wrote);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) {
+          debug << "Wrote different value than read" << std::endl;
+          done += wrote;
+          return (w < 0) ? errno : EIO;
+        }
+        wrote += w;
+      }
+      done += bread;
+
+      if((printCount++ % 100) == 0) {
+        debug << "Copying " << done << std::endl;
+        printCount = 1;
+      }
+    }
+    return 0;
+  }
+
+  // Fill len bytes of buf from fd at off.  Returns how many bytes were read, which is
+  //  less than len at the end of the file, or -1 on error
+  static ssize_t readFull(int fd, uint8_t *buf, uint64_t len, uint64_t off) {
+    uint64_t got = 0;
+    while(got < len) {
+      ssize_t r = pread(fd, buf + got, len - got, off + got);
+      if(r < 0 && errno == EINTR) continue;
+      if(r < 0) return -1;
+      if(r == 0) break;
+      got += r;
+    }
+    return got;
+  }
+
+  // Write len bytes from buf to fd at off, handling short writes
+  static bool writeFull(int fd, const uint8_t *buf, uint64_t len, uint64_t off) {
+    uint64_t wrote = 0;
+    while(wrote < len) {
+      ssize_t w = pwrite(fd, buf + wrote, len - wrote, off + wrote);
+      if(w < 0 && errno == EINTR) continue;
+      if(w <= 0) {
+        if(w == 0) errno = EIO;
+        return false;
+      }
+      wrote += w;
+    }
+    return true;
+  }
+
+  // Read the source and the destination and only write the blocks that differ.  Reads
+  //  are much cheaper than writes on eMMC, and the destination usually holds an older
+  //  copy of the same data
+  static int compareCopy(int destFd, uint64_t destOff, int srcFd, uint64_t srcOff, uint64_t len,
+                         volatile bool *cancel, const TapFn &tap, uint64_t &done, uint64_t &readBytes,
+                         uint64_t &compared, uint64_t &written) {
+    bool copyAll = (len == 0);
+
+    // Page aligned buffers keep the reads on the fast path of the block layer
+    void *srcMem = nullptr, *destMem = nullptr;
+    if(posix_memalign(&srcMem, CompareBlock, CompareWindow) != 0) return ENOMEM;
+    std::unique_ptr<uint8_t, decltype(&free)> srcBuf((uint8_t*)srcMem, free);
+    if(posix_memalign(&destMem, CompareBlock, CompareWindow) != 0) return ENOMEM;
+    std::unique_ptr<uint8_t, decltype(&free)> destBuf((uint8_t*)destMem, free);
+
+    int printCount = 0;
+    while((copyAll || done < len) && !canceled(cancel)) {
+      uint64_t toRead = CompareWindow;
+      if(!copyAll) toRead = std::min(toRead, len - done);
+
+      ssize_t sread = readFull(srcFd, srcBuf.get(), toRead, srcOff + done);
+      if(sread < 0) return errno;
+      if(sread == 0) break; // End of the source
+      readBytes += sread;
+      if(tap) {
+        int err = tap(done, srcBuf.get(), sread);
+        if(err != 0) return err;
+      }
+
+      // Whatever is past the end of the destination counts as different
+      ssize_t dread = readFull(destFd, destBuf.get(), sread, destOff + done);
+      if(dread < 0) return errno;
+      compared += dread;
+
+      // Most windows are identical, so check the whole window in one go first.  memcmp
+      //  is vectorized by the C library so this runs at memory speed
+      if(dread != sread || memcmp(srcBuf.get(), destBuf.get(), sread) != 0) {
+        // Find the runs of differing blocks and write each run with one call
+        uint64_t runStart = 0;
+        bool inRun = false;
+        for(uint64_t at = 0; at < (uint64_t)sread; at += CompareBlock) {
+          uint64_t blockLen = std::min(CompareBlock, sread - at);
+          bool differs = (at + blockLen > (uint64_t)dread) ||
+            memcmp(srcBuf.get() + at, destBuf.get() + at, blockLen) != 0;
+          if(differs && !inRun) {
+            runStart = at;
+            inRun = true;
+          } else if(!differs && inRun) {
+            if(!writeFull(destFd, srcBuf.get() + runStart, at - runStart, destOff + done + runStart)) return errno;
+            written += at - runStart;
+            inRun = false;
+          }
+        }
+        if(inRun) {
+          if(!writeFull(destFd, srcBuf.get() + runStart, sread - runStart, destOff + done + runStart)) return errno;
+          written += sread - runStart;
+        }
+      }
+      done += sread;
+
+      if((printCount++ % 100) == 0) {
+        debug << "Compared " << done << " wrote " << written << std::endl;
+        printCount = 1;
+      }
+    }
+    return 0;
+  }
+
+  // Turn O_DIRECT on or off for a descriptor
+  static bool setDirect(int fd, bool on) {
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0) return false;
+    flags = on ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    return fcntl(fd, F_SETFL, flags) == 0;
+  }
+
+  // Like readFull, but O_DIRECT reads have to stay aligned, so a short read means we
+  //  hit the end of the source
+  static ssize_t readDirect(int fd, uint8_t *buf, uint64_t len, uint64_t off) {
+    uint64_t got = 0;
+    while(got < len) {
+      ssize_t r = pread(fd, buf + got, len - got, off + got);
+      if(r < 0 && errno == EINTR) continue;
+      if(r < 0) return -1;
+      if(r == 0) break;
+      got += r;
+      if((r % DirectAlign) != 0) break;
+    }
+    return got;
+  }
+
+  // One buffer in the pipeline ring
+  struct PipelineSlot {
+    uint8_t *data;   // Aligned buffer of blockSize bytes
+    uint64_t length; // How much of the buffer the reader filled
+    bool     full;   // Filled by the reader and waiting for the writer
+    bool     last;   // The reader reached the end of what it has to copy
+  };
+
+  // Read with a reader thread that fills a ring of buffers, and hand each buffer to sink
+  //  on this thread in order.  The source is being read while the sink works, so on
+  //  devices with similar read and write speeds neither sits idle.  done is advanced by
+  //  what sink accepted
+  static int pipelineRun(int srcFd, uint64_t srcOff, uint64_t len, const CopyOptions &options,
+                         volatile bool *cancel, const DataSink &sink, uint64_t &done, uint64_t &readBytes) {
+    bool copyAll = (len == 0);
+    if(!copyAll && done >= len) return 0;
+
+    unsigned depth = std::max(2u, options.depth);
+    uint64_t blockSize = std::max(DirectAlign, options.blockSize / DirectAlign * DirectAlign);
+
+    void *mem = nullptr;
+    if(posix_memalign(&mem, DirectAlign, blockSize * depth) != 0) return ENOMEM;
+    std::unique_ptr<uint8_t, decltype(&free)> memory((uint8_t*)mem, free);
+    std::vector<PipelineSlot> ring(depth);
+    for(unsigned i = 0; i < depth; i++) {
+      ring[i].data   = memory.get() + i * blockSize;
+      ring[i].length = 0;
+      ring[i].full   = false;
+      ring[i].last   = false;
+    }
+
+    // O_DIRECT only works if the offsets line up with the device blocks
+    bool srcDirect  = options.direct && ((srcOff + done) % DirectAlign) == 0 && setDirect(srcFd, true);
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool stop = false;  // Set when either side gives up
+    int readErr = 0;
+    uint64_t start = done;
+
+    std::thread reader([&]() {
+      uint64_t at = start;
+      for(unsigned i = 0; ; i = (i + 1) % depth) {
+        PipelineSlot &slot = ring[i];
+        {
+          std::unique_lock<std::mutex> l(lock);
+          cond.wait(l, [&]() { return stop || !slot.full; });
+          if(stop) return;
+        }
+        if(canceled(cancel)) break;
+
+        uint64_t want = blockSize;
+        if(!copyAll) want = std::min(want, len - at);
+
+        ssize_t got;
+        if(srcDirect) {
+          // Whole blocks only, we just ignore anything past what we want
+          got = readDirect(srcFd, slot.data, (want + DirectAlign - 1) / DirectAlign * DirectAlign, srcOff + at);
+          if(got < 0 && errno == EINVAL && at == start) {
+            // Not every device takes O_DIRECT, so go through the page cache instead
+            srcDirect = !setDirect(srcFd, false);
+            got = readFull(srcFd, slot.data, want, srcOff + at);
+          }
+          if(got > (ssize_t)want) got = want;
+        } else {
+          got = readFull(srcFd, slot.data, want, srcOff + at);
+        }
+        if(got < 0) {
+          readErr = errno;
+          break;
+        }
+        at += got;
+        readBytes += got;
+
+        std::lock_guard<std::mutex> l(lock);
+        slot.length = got;
+        slot.last   = ((uint64_t)got < want) || (!copyAll && at >= len);
+        slot.full   = true;
+        cond.notify_all();
+        if(slot.last) return;
+      }
+
+      // Canceled or failed, so let the writer know there is nothing more coming
+      std::lock_guard<std::mutex> l(lock);
+      stop = true;
+      cond.notify_all();
+    });
+
+    int writeErr = 0;
+    int printCount = 0;
+    for(unsigned i = 0; ; i = (i + 1) % depth) {
+      PipelineSlot &slot = ring[i];
+      {
+        std::unique_lock<std::mutex> l(lock);
+        cond.wait(l, [&]() { return stop || slot.full; });
+        if(!slot.full) break; // The reader stopped
+      }
+      if(canceled(cancel)) break;
+
+      if(slot.length > 0) {
+        writeErr = sink(slot.data, slot.length);
+        if(writeErr != 0) break;
+        done += slot.length;
+      }
+
+      bool last = slot.last;
+      {
+        std::lock_guard<std::mutex> l(lock);
+        slot.full = false;
+        cond.notify_all();
+      }
+      if(last) break;
+
+      if((printCount++ % 100) == 0) {
+        debug << "Pipeline at " << done << std::endl;
+        printCount = 1;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> l(lock);
+      stop = true;
+      cond.notify_all();
+    }
+    reader.join();
+
+    if(srcDirect) setDirect(srcFd, false);
+    return writeErr ? writeErr : readErr;
+  }
+
+  // One buffer being moved through io_uring
+  struct URingSlot {
+    enum class State {Free, Reading, Filled, Writing};
+
+    uint8_t *data;    // Aligned buffer of blockSize bytes
+    uint64_t offset;  // Where this buffer goes, relative to the start of the copy
+    uint32_t want;    // How much we asked to read
+    uint32_t have;    // How much has been read so far
+    uint32_t written; // How much of that has been written
+    State    state;
+  };
+
+  // io_uring file indexes
+  static const unsigned URingSrc  = 0;
+  static const unsigned URingDest = 1;
+
+  // Move data through io_uring with up to depth buffers in flight at once.  If destFd
+  //  is valid, each buffer is written as soon as its read completes, so reads and
+  //  writes to different offsets overlap.  Otherwise the buffers are handed to sink in
+  //  order, while the reads after them are already in flight.  done is only advanced
+  //  over data that is completely written (or consumed) with nothing missing before it.
+  // Returns ENOSYS (or whatever the kernel said) if io_uring can't be used, so the
+  //  caller can go back to pread/pwrite
+  static int uringRun(int destFd, uint64_t destOff, int srcFd, uint64_t srcOff, uint64_t len,
+                      const CopyOptions &options, volatile bool *cancel, const DataSink *sink,
+                      uint64_t &done, uint64_t &readBytes) {
+    bool copyAll = (len == 0);
+    if(!copyAll && done >= len) return 0;
+    if(!IOUring::Available()) return ENOSYS;
+
+    unsigned depth = std::max(2u, options.depth);
+    uint64_t blockSize = std::max(DirectAlign, options.blockSize / DirectAlign * DirectAlign);
+    blockSize = std::min(blockSize, URingMaxBlock);
+
+    // The buffers are declared before the ring so they outlive it, and anything still
+    //  in flight when it is torn down
+    void *mem = nullptr;
+    if(posix_memalign(&mem, DirectAlign, blockSize * depth) != 0) return ENOMEM;
+    std::unique_ptr<uint8_t, decltype(&free)> memory((uint8_t*)mem, free);
+
+    IOUring ring(depth);
+    if(!ring.Valid()) return ring.Error();
+
+    // Registered buffers save the kernel mapping the pages on every request, but they
+    //  count against RLIMIT_MEMLOCK, which is small on older kernels
+    struct iovec whole = {memory.get(), blockSize * depth};
+    int bufIndex = ring.RegisterBuffers({whole}) ? 0 : -1;
+    std::vector<int> files = {srcFd};
+    if(destFd >= 0) files.push_back(destFd);
+    if(!ring.RegisterFiles(files)) return ring.Error();
+
+    std::vector<URingSlot> slots(depth);
+    for(unsigned i = 0; i < depth; i++) {
+      slots[i].data  = memory.get() + i * blockSize;
+      slots[i].state = URingSlot::State::Free;
+    }
+
+    bool srcDirect  = options.direct && ((srcOff + done) % DirectAlign) == 0 && setDirect(srcFd, true);
+    bool destDirect = destFd >= 0 && options.direct && ((destOff + done) % DirectAlign) == 0 && setDirect(destFd, true);
+
+    // Writes finish out of order, so remember the ones past done until the gap closes
+    std::map<uint64_t, uint64_t> finished;
+    uint64_t next  = done;    // Where the next read starts
+    bool eof       = false;
+    int tail       = -1;      // An O_DIRECT destination can't take a partial block
+    unsigned inFlight = 0;
+    int err = 0;
+    int printCount = 0;
+
+    auto queueRead = [&](unsigned i) -> bool {
+      URingSlot &s = slots[i];
+      uint32_t ask = s.want - s.have;
+      if(srcDirect) ask = (ask + DirectAlign - 1) / DirectAlign * DirectAlign;
+      if(!ring.QueueRead(URingSrc, bufIndex, s.data + s.have, ask, srcOff + s.offset + s.have, i)) return false;
+      inFlight++;
+      return true;
+    };
+    auto queueWrite = [&](unsigned i) -> bool {
+      URingSlot &s = slots[i];
+      if(!ring.QueueWrite(URingDest, bufIndex, s.data + s.written, s.have - s.written,
+                          destOff + s.offset + s.written, i)) return false;
+      inFlight++;
+      return true;
+    };
+
+    for(;;) {
+      // Keep every free buffer busy reading ahead, and hand finished reads to the sink
+      //  in order, which frees more buffers
+      for(bool consumed = true; consumed; ) {
+        consumed = false;
+        for(unsigned i = 0; i < depth && err == 0 && !canceled(cancel) && !eof && (copyAll || next < len); i++) {
+          URingSlot &s = slots[i];
+          if(s.state != URingSlot::State::Free) continue;
+          s.offset  = next;
+          s.want    = copyAll ? blockSize : std::min(blockSize, len - next);
+          s.have    = 0;
+          s.written = 0;
+          s.state   = URingSlot::State::Reading;
+          if(!queueRead(i)) { s.state = URingSlot::State::Free; err = EBUSY; break; }
+          next += s.want;
+        }
+
+        if(sink == nullptr) break;
+        for(URingSlot &s : slots) {
+          if(s.state != URingSlot::State::Filled || s.offset != done) continue;
+          if(err == 0 && !canceled(cancel)) {
+            err = (*sink)(s.data, s.have);
+            if(err == 0) done += s.have;
+          }
+          s.state  = URingSlot::State::Free;
+          consumed = true;
+        }
+      }
+
+      if(inFlight == 0) break;
+      int e = ring.Submit(1);
+      if(e != 0) {
+        // Nothing we queued can be trusted now
+        err = e;
+        break;
+      }
+
+      uint64_t userData;
+      int32_t res;
+      while(ring.Reap(userData, res)) {
+        inFlight--;
+        unsigned i = (unsigned)userData;
+        URingSlot &s = slots[i];
+        bool quit = (err != 0) || canceled(cancel);
+
+        if(s.state == URingSlot::State::Reading) {
+          if(res < 0) {
+            if(err == 0) err = -res;
+            s.state = URingSlot::State::Free;
+            continue;
+          }
+          readBytes += std::min((uint32_t)res, s.want - s.have);
+          s.have = std::min(s.want, s.have + (uint32_t)res);
+          // A short read means the end of the source, unless the kernel just split it
+          bool short_ = (s.have < s.want);
+          if(short_ && res > 0 && !quit && (!srcDirect || (res % DirectAlign) == 0)) {
+            if(queueRead(i)) continue;
+            err = EBUSY;
+          }
+          if(short_) {
+            eof  = true;
+            s.want = s.have;
+          }
+          if(s.have == 0 || quit) {
+            s.state = URingSlot::State::Free;
+            continue;
+          }
+          s.state = URingSlot::State::Filled;
+          if(sink != nullptr) continue;
+
+          // Written straight away, except a partial block that O_DIRECT can't take
+          if(destDirect && (s.have % DirectAlign) != 0) {
+            tail = i;
+            continue;
+          }
+          s.state = URingSlot::State::Writing;
+          if(!queueWrite(i)) {
+            err = EBUSY;
+            s.state = URingSlot::State::Free;
+          }
+        } else if(s.state == URingSlot::State::Writing) {
+          if(res <= 0) {
+            if(err == 0) err = (res < 0) ? -res : EIO;
+            s.state = URingSlot::State::Free;
+            continue;
+          }
+          s.written += res;
+          if(s.written < s.have && !quit) {
+            if(queueWrite(i)) continue;
+            err = EBUSY;
+          }
+          if(s.written >= s.have) {
+            finished[s.offset] = s.have;
+            while(!finished.empty() && finished.begin()->first == done) {
+              done += finished.begin()->second;
+              finished.erase(finished.begin());
+            }
+          }
+          s.state = URingSlot::State::Free;
+        }
+      }
+
+      if((printCount++ % 100) == 0) {
+        debug << "io_uring at " << done << std::endl;
+        printCount = 1;
+      }
+    }
+
+    // A failed submit leaves reads and writes in flight.  Wait for every one of them, so
+    //  none lands on the destination after the caller has moved on to another method
+    for(int tries = 0; inFlight > 0; ) {
+      uint64_t userData;
+      int32_t res;
+      while(ring.Reap(userData, res)) inFlight--;
+      if(inFlight == 0) break;
+      int e = ring.Submit(1);
+      if(e == 0) continue;
+      if((e == EAGAIN || e == EBUSY) && ++tries < 1000) {
+        usleep(1000);
+        continue;
+      }
+      // The kernel may still be using the buffers, so they can never be given back
+      debug << Debug::Mode::Err << "Could not wait for " << inFlight << " io_uring operations: " << e << std::endl;
+      memory.release();
+      break;
+    }
+
+    // The partial block at the end goes through the page cache
+    if(tail >= 0 && err == 0 && !canceled(cancel) && slots[tail].offset == done) {
+      destDirect = !setDirect(destFd, false);
+      if(!writeFull(destFd, slots[tail].data, slots[tail].have, destOff + done)) err = errno;
+      else done += slots[tail].have;
+    }
+
+    if(srcDirect)  setDirect(srcFd, false);
+    if(destDirect) setDirect(destFd, false);
+    return err;
+  }
+
+  // Copy by streaming the source through the pipeline or io_uring reader and writing each
+  //  piece in order from this thread.  This is the Pipeline method, and IOUring when the
+  //  data has to be tapped in order
+  static int streamCopy(bool uring, int destFd, uint64_t destOff, int srcFd, uint64_t srcOff, uint64_t len,
+                        const CopyOptions &options, volatile bool *cancel, const TapFn &tap,
+                        uint64_t &done, uint64_t &readBytes) {
+    uint64_t start = done;
+    bool destDirect = options.direct && ((destOff + done) % DirectAlign) == 0 && setDirect(destFd, true);
+    if(options.direct) debug << "Stream O_DIRECT write " << destDirect << std::endl;
+
+    DataSink write = [&](const uint8_t *data, uint64_t length) -> int {
+      if(tap) {
+        int err = tap(done, data, length);
+        if(err != 0) return err;
+      }
+
+      // O_DIRECT writes have to be whole blocks too, so a short tail goes through
+      //  the page cache
+      if(destDirect && (length % DirectAlign) != 0) destDirect = !setDirect(destFd, false);
+      if(writeFull(destFd, data, length, destOff + done)) return 0;
+      if(errno == EINVAL && destDirect && done == start) {
+        destDirect = !setDirect(destFd, false);
+        if(writeFull(destFd, data, length, destOff + done)) return 0;
+      }
+      return errno ? errno : EIO;
+    };
+
+    int err;
+    if(uring) err = uringRun(-1, 0, srcFd, srcOff, len, options, cancel, &write, done, readBytes);
+    else      err = pipelineRun(srcFd, srcOff, len, options, cancel, write, done, readBytes);
+
+    if(destDirect) setDirect(destFd, false);
+    return err;
+  }
+
+  uint64_t CopyData(int destFd, uint64_t destOff, int srcFd, uint64_t srcOff, uint64_t len,
+                    const CopyOptions &options, volatile bool *cancel, CopyStats *stats) {
+    CopyMethod method = options.method;
+    auto start = std::chrono::steady_clock::now();
+    DevicePair devices(backingDevice(srcFd), backingDevice(destFd));
+    CopyMethod used = CopyMethod::None;
+    uint64_t done = 0;
+    uint64_t readBytes = 0;
+    uint64_t compared = 0;
+    uint64_t written = 0;
+
+    // Figure out which methods we are going to try
+    std::vector<CopyMethod> methods;
+    bool autoSelect = (method == CopyMethod::Auto || method == CopyMethod::Unknown || method == CopyMethod::Compare);
+    if(method == CopyMethod::Compare) methods.push_back(CopyMethod::Compare);
+    if(options.direct && method != CopyMethod::Compare) {
+      if(method != CopyMethod::Pipeline) methods.push_back(CopyMethod::IOUring);
+      methods.push_back(CopyMethod::Pipeline);
+      methods.push_back(CopyMethod::Buffered);
+      autoSelect = false;
+    } else if(autoSelect) {
+      CopyMethod known = CopyMethod::Unknown;
+      {
+        std::lock_guard<std::mutex> lock(knownMethodsLock);
+        auto it = knownMethods.find(devices);
+        if(it != knownMethods.end()) known = it->second;
+      }
+      bool skip = (known != CopyMethod::Unknown);
+      for(CopyMethod m : autoOrder) {
+        if(m == known) skip = false;
+        if(!skip) methods.push_back(m);
+      }
+    } else {
+      methods.push_back(method);
+      if(method == CopyMethod::IOUring)  methods.push_back(CopyMethod::Pipeline);
+      if(method != CopyMethod::Buffered) methods.push_back(CopyMethod::Buffered);
+    }
+
+    // The in-kernel methods never show us the data, so they can't be tapped
+    if(options.tap) {
+      methods.erase(std::remove_if(methods.begin(), methods.end(), [](CopyMethod m) {
+            return m == CopyMethod::CopyFileRange || m == CopyMethod::SendFile || m == CopyMethod::Splice;
+          }), methods.end());
+      if(methods.empty()) methods.push_back(CopyMethod::Buffered);
+      autoSelect = false;
+    }
+
+    // The tap has to see every byte once and in order, even when a method fails part way
+    //  and the next one goes back over data the tap has already seen
+    uint64_t tapped = 0;
+    int tapErr = 0;
+    TapFn tap;
+    if(options.tap) {
+      tap = [&](uint64_t at, const uint8_t *data, uint64_t length) -> int {
+        if(at > tapped) return tapErr = EIO; // Would leave a hole
+        uint64_t skip = tapped - at;
+        if(skip >= length) return 0;
+        tapErr = options.tap(data + skip, length - skip);
+        if(tapErr == 0) tapped = at + length;
+        return tapErr;
+      };
+    }
+
+    for(CopyMethod m : methods) {
+      uint64_t before = done;
+      int err = 0;
+      if(m == CopyMethod::Compare) {
+        err = compareCopy(destFd, destOff, srcFd, srcOff, len, cancel, tap, done, readBytes, compared, written);
+      } else if(m == CopyMethod::IOUring) {
+        if(tap) err = streamCopy(true, destFd, destOff, srcFd, srcOff, len, options, cancel, tap, done, readBytes);
+        else    err = uringRun(destFd, destOff, srcFd, srcOff, len, options, cancel, nullptr, done, readBytes);
+        written += done - before;
+      } else if(m == CopyMethod::Pipeline) {
+        err = streamCopy(false, destFd, destOff, srcFd, srcOff, len, options, cancel, tap, done, readBytes);
+        written += done - before;
+      } else if(m == CopyMethod::Buffered) {
+        err = bufferedCopy(destFd, destOff, srcFd, srcOff, len, cancel, tap, done, readBytes);
+        written += done - before;
+      } else {
+        err = kernelCopy(m, destFd, destOff, srcFd, srcOff, len, cancel, done);
+        readBytes += done - before;
+        written += done - before;
+      }
+
+      if(done > before || err == 0) used = m;
+      if(err == 0) {
+        // This method works for this device pair, so start with it next time
+        if(autoSelect && m != CopyMethod::Compare) {
+          std::lock_guard<std::mutex> lock(knownMethodsLock);
+          knownMethods[devices] = m;
+        }
+        break;
+      }
+      if(tapErr != 0) {
+        // The tap asked us to stop, another method won't change its mind
+        debug << Debug::Mode::Info << "Copy stopped by its tap after " << done << " bytes: " <<
+          strerror(tapErr) << std::endl;
+        break;
+      }
+      debug << Debug::Mode::Info << ToString(m) << " stopped after " << done << " bytes: " <<
+        strerror(err) << ".  Falling back" << std::endl;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    debug << Debug::Mode::Info << "Copied " << done << " bytes using " << ToString(used) << " in " <<
+      seconds << "s (" << ((seconds > 0) ? (done / seconds / (1024 * 1024)) : 0) << " MB/s)" << std::endl;
+    if(compared > 0) {
+      debug << Debug::Mode::Info << "Compared " << compared << " bytes and wrote " << written << std::endl;
+    }
+
+    if(stats != nullptr) {
+      stats->method        = used;
+      stats->bytesRead     = readBytes;
+      stats->bytesWritten  = written;
+      stats->bytesCompared = compared;
+      stats->seconds       = seconds;
+    }
+    return done;
+  }
+
+  uint64_t ReadData(int fd, uint64_t off, uint64_t len, const DataSink &sink,
+                    const CopyOptions &options, volatile bool *cancel, CopyStats *stats) {
+    auto start = std::chrono::steady_clock::now();
+    CopyMethod used = CopyMethod::None;
+    uint64_t done = 0;
+    uint64_t readBytes = 0;
+
+    std::vector<CopyMethod> methods;
+    if(options.method == CopyMethod::Auto || options.method == CopyMethod::IOUring) {
+      methods.push_back(CopyMethod::IOUring);
+    }
+    methods.push_back(CopyMethod::Pipeline);
+
+    // Only a read failure is worth another method, not the sink telling us to stop
+    int sinkErr = 0;
+    DataSink checked = [&](const uint8_t *data, uint64_t length) -> int {
+      sinkErr = sink(data, length);
+      return sinkErr;
+    };
+
+    for(CopyMethod m : methods) {
+      uint64_t before = done;
+      int err;
+      if(m == CopyMethod::IOUring) err = uringRun(-1, 0, fd, off, len, options, cancel, &checked, done, readBytes);
+      else                         err = pipelineRun(fd, off, len, options, cancel, checked, done, readBytes);
+
+      if(done > before || err == 0) used = m;
+      if(err == 0 || sinkErr != 0) break;
+      debug << Debug::Mode::Info << ToString(m) << " read stopped after " << done << " bytes: " <<
+        strerror(err) << std::endl;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    debug << Debug::Mode::Debug << "Read " << done << " bytes using " << ToString(used) << " in " <<
+      seconds << "s" << std::endl;
+
+    if(stats != nullptr) {
+      stats->method       = used;
+      stats->bytesRead    = readBytes;
+      stats->bytesWritten = done;
+      stats->seconds      = seconds;
+    }
+    return done;
+  }
+};
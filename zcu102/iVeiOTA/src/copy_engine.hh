@@ -0,0 +1,96 @@
+#ifndef __IVEIOTA_COPY_ENGINE_HH
+#define __IVEIOTA_COPY_ENGINE_HH
+
+#include <cstdint>
+#include <string>
+#include <functional>
+
+namespace iVeiOTA {
+  // The ways the copy engine knows how to move data from one file/device to another
+  enum class CopyMethod {
+    Auto,          // Try the in-kernel methods in order, then fall back to Buffered
+    CopyFileRange, // copy_file_range(2) - in-kernel, may be offloaded by the filesystem
+    SendFile,      // sendfile(2) - in-kernel, straight from the source page cache
+    Splice,        // splice(2) through an intermediate pipe - in-kernel
+    IOUring,       // io_uring with several reads and writes in flight at once
+    Pipeline,      // A reader thread and a writer thread sharing a ring of buffers
+    Buffered,      // read(2)/write(2) through a user space buffer
+    Compare,       // Read both sides and only write the blocks that differ
+
+    None,          // Nothing was copied
+
+    Unknown,
+  };
+  CopyMethod GetCopyMethod(const std::string &name);
+  inline std::string ToString(CopyMethod method) {
+    switch(method) {
+    case CopyMethod::Auto          : return "Auto";
+    case CopyMethod::CopyFileRange : return "CopyFileRange";
+    case CopyMethod::SendFile      : return "SendFile";
+    case CopyMethod::Splice        : return "Splice";
+    case CopyMethod::IOUring       : return "IOUring";
+    case CopyMethod::Pipeline      : return "Pipeline";
+    case CopyMethod::Buffered      : return "Buffered";
+    case CopyMethod::Compare       : return "Compare";
+    case CopyMethod::None          : return "None";
+    case CopyMethod::Unknown       : return "Unknown";
+    default: return "<<Error>>";
+    }
+  }
+
+  // Information about how a single copy went, so callers can report/measure it
+  struct CopyStats {
+    CopyMethod method;       // The method that moved the last of the data
+    uint64_t   bytesRead;    // Bytes read from the source
+    uint64_t   bytesWritten; // Bytes written to the destination
+    uint64_t   bytesSkipped; // Bytes that didn't need to be copied at all
+    uint64_t   bytesCompared;// Bytes compared against the destination before writing
+    double     seconds;      // Wall clock time of the copy
+
+    CopyStats() : method(CopyMethod::None), bytesRead(0), bytesWritten(0), bytesSkipped(0),
+                  bytesCompared(0), seconds(0) {}
+  };
+
+  // Gets each piece of data ReadData reads (or CopyData copies), in order.  Returns 0 to keep going or an
+  //  errno to stop
+  typedef std::function<int (const uint8_t *data, uint64_t len)> DataSink;
+
+  // How a copy should be done
+  struct CopyOptions {
+    CopyMethod method;    // Which method to use (or Auto)
+    unsigned   depth;     // Pipeline/IOUring: how many buffers can be in flight at once
+    uint64_t   blockSize; // Pipeline/IOUring: the size of each buffer
+    bool       direct;    // Pipeline/IOUring: bypass the page cache with O_DIRECT where alignment allows
+    DataSink   tap;       // If set, sees every byte of the source once, in order, before it is
+                          //  written.  The in-kernel methods are skipped since they never
+                          //  bring the data into user space.  Returning an errno stops the copy
+
+    CopyOptions(CopyMethod method = CopyMethod::Auto) :
+      method(method), depth(4), blockSize(1024 * 1024), direct(false) {}
+  };
+
+  // Copy len bytes from srcFd at srcOff to destFd at destOff.  If len is 0 everything
+  //  up to the end of the source is copied.  The file positions of the descriptors
+  //  are not used.
+  // If the method is Auto, the in-kernel methods are tried first and the first one that
+  //  works for this pair of devices is remembered.  A method that fails part way through
+  //  hands off to the next one at the offset it reached.
+  // Asking for O_DIRECT always uses IOUring or the Pipeline, since the other methods go
+  //  through the page cache.  IOUring falls back to the Pipeline when the kernel doesn't
+  //  have io_uring or won't let us use it.  Compare needs destFd to be readable too, and falls back to the Auto
+  //  methods if it isn't.
+  // Returns the number of bytes of the destination that now hold the source data.  This
+  //  is more than what was actually written if Compare found identical blocks
+  uint64_t CopyData(int destFd, uint64_t destOff, int srcFd, uint64_t srcOff, uint64_t len,
+                    const CopyOptions &options, volatile bool *cancel = 0, CopyStats *stats = 0);
+
+  // Read len bytes (everything to the end if len is 0) from fd at off and pass them to
+  //  sink, with reads kept in flight ahead of it so reading and whatever sink does
+  //  overlap.  Uses io_uring when it can (options.method Auto or IOUring) and a reader
+  //  thread otherwise.  stats->bytesWritten is what sink accepted.
+  // Returns the number of bytes sink accepted
+  uint64_t ReadData(int fd, uint64_t off, uint64_t len, const DataSink &sink,
+                    const CopyOptions &options, volatile bool *cancel = 0, CopyStats *stats = 0);
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "delta.hh"
+#include "hash.hh"
+#include "support.hh"
+#include "config.hh"
+#include "debug.hh"
+
+namespace iVeiOTA {
+  static const uint8_t  DeltaMagic[8]   = {'i', 'V', 'e', 'i', 'D', 'L', 'T', '1'};
+  static const uint32_t DeltaHeaderSize = 48;
+
+  static uint64_t get64(const uint8_t *p) {
+    uint64_t v = 0;
+    for(int i = 0; i < 8; i++) v = (v << 8) | p[i];
+    return v;
+  }
+
+  // Read exactly len bytes from the current position
+  static bool readAll(int fd, uint8_t *buf, uint64_t len) {
+    while(len > 0) {
+      ssize_t got = read(fd, buf, len);
+      if(got < 0 && errno == EINTR) continue;
+      if(got <= 0) return false;
+      buf += got;
+      len -= got;
+    }
+    return true;
+  }
+
+  static bool preadAll(int fd, uint8_t *buf, uint64_t len, uint64_t off) {
+    while(len > 0) {
+      ssize_t got = pread(fd, buf, len, off);
+      if(got < 0 && errno == EINTR) continue;
+      if(got <= 0) return false;
+      buf += got;
+      off += got;
+      len -= got;
+    }
+    return true;
+  }
+
+  static bool pwriteAll(int fd, const uint8_t *buf, uint64_t len, uint64_t off) {
+    while(len > 0) {
+      ssize_t put = pwrite(fd, buf, len, off);
+      if(put < 0 && errno == EINTR) continue;
+      if(put <= 0) return false;
+      buf += put;
+      off += put;
+      len -= put;
+    }
+    return true;
+  }
+
+  // Read the header from the start of a delta, giving the target size and its SHA256 in hex
+  static bool readHeader(int delta, uint64_t &size, std::string &target) {
+    uint8_t header[DeltaHeaderSize];
+    if(!readAll(delta, header, DeltaHeaderSize) || memcmp(header, DeltaMagic, sizeof(DeltaMagic)) != 0) {
+      debug << Debug::Mode::Err << "Not a delta file" << std::endl;
+      return false;
+    }
+    size = get64(header + 8);
+    target.clear();
+    for(unsigned i = 16; i < DeltaHeaderSize; i++) {
+      char hex[3];
+      snprintf(hex, sizeof(hex), "%02x", header[i]);
+      target += hex;
+    }
+    return true;
+  }
+
+  // Write piece to out at at, but only the blocks that don't already hold it.  existing is
+  //  somewhere to read them into.  Adds what didn't need writing to skipped
+  static bool writeChanged(int out, const uint8_t *piece, uint64_t len, uint64_t at,
+                           std::vector<uint8_t> &existing, uint64_t &skipped) {
+    const uint64_t blockSize = 64 * 1024;
+    existing.resize(len);
+    if(!preadAll(out, existing.data(), len, at)) return pwriteAll(out, piece, len, at);
+
+    for(uint64_t pos = 0; pos < len; pos += blockSize) {
+      uint64_t block = std::min(blockSize, len - pos);
+      if(memcmp(existing.data() + pos, piece + pos, block) == 0) {
+        skipped += block;
+      } else if(!pwriteAll(out, piece + pos, block, at + pos)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Does the work of ApplyDelta, returning how much of the target was written even if it
+  //  failed part way, so the caller knows what to invalidate
+  static bool applyDelta(int out, uint64_t off, int in, int delta, uint64_t size, uint64_t &done,
+                         volatile bool *cancel, const std::function<void(uint64_t done)> &progress) {
+    uint64_t targetSize;
+    std::string expected;
+    if(!readHeader(delta, targetSize, expected)) return false;
+    if(targetSize != size) {
+      debug << Debug::Mode::Err << "Delta is for " << targetSize << " bytes, not " << size << std::endl;
+      return false;
+    }
+
+    // Most of a delta is usually copies of the source from where the target goes.  The
+    //  alternate container often still has those blocks from an earlier release, so they
+    //  are compared first and only written if they differ, as clone_compare does for clones
+    bool compare = config.GetOptionInt("clone_compare", 0) != 0;
+    uint64_t skipped = 0;
+
+    // One buffer (two when comparing), so memory stays the same however large the image is
+    const uint64_t bufferSize = 1024 * 1024;
+    std::vector<uint8_t> buffer(bufferSize);
+    std::vector<uint8_t> existing;
+    Hasher hasher(HashAlgorithm::SHA256);
+    uint64_t lastProgress = 0;
+    while(true) {
+      if(cancel && *cancel) return false;
+
+      uint8_t op;
+      uint8_t args[16];
+      if(!readAll(delta, &op, 1)) {
+        debug << Debug::Mode::Err << "Delta ended without an end op" << std::endl;
+        return false;
+      }
+      if(op == 'E') break;
+
+      uint64_t srcOff = 0, len = 0;
+      if(op == 'C') {
+        if(!readAll(delta, args, 16)) return false;
+        srcOff = get64(args);
+        len    = get64(args + 8);
+      } else if(op == 'I' || op == 'Z') {
+        if(!readAll(delta, args, 8)) return false;
+        len = get64(args);
+      } else {
+        debug << Debug::Mode::Err << "Unknown delta op " << (int)op << " at " << done << std::endl;
+        return false;
+      }
+      if(len > size - done) {
+        debug << Debug::Mode::Err << "Delta runs past the end of the image" << std::endl;
+        return false;
+      }
+
+      if(op == 'Z') std::fill(buffer.begin(), buffer.end(), 0);
+      while(len > 0) {
+        if(cancel && *cancel) return false;
+        uint64_t piece = std::min(len, bufferSize);
+        if(op == 'C' && !preadAll(in, buffer.data(), piece, off + srcOff)) {
+          debug << Debug::Mode::Err << "Could not read the source at " << srcOff << std::endl;
+          return false;
+        }
+        if(op == 'I' && !readAll(delta, buffer.data(), piece)) {
+          debug << Debug::Mode::Err << "Delta is cut short" << std::endl;
+          return false;
+        }
+        hasher.Update(buffer.data(), piece);
+        bool same = (op == 'C' && srcOff == done);
+        if(!((compare && same) ? writeChanged(out, buffer.data(), piece, off + done, existing, skipped) :
+             pwriteAll(out, buffer.data(), piece, off + done))) {
+          debug << Debug::Mode::Err << "Could not write the image at " << off + done << std::endl;
+          return false;
+        }
+        srcOff += piece;
+        done   += piece;
+        len    -= piece;
+
+        if(progress && done - lastProgress >= 16 * 1024 * 1024) {
+          progress(done);
+          lastProgress = done;
+        }
+      }
+    }
+
+    if(done != size) {
+      debug << Debug::Mode::Err << "Delta only rebuilt " << done << " of " << size << " bytes" << std::endl;
+      return false;
+    }
+    std::string hash = hasher.Final();
+    if(hash != expected) {
+      debug << Debug::Mode::Err << "Rebuilt image hashed to " << hash << ", expected " << expected << std::endl;
+      return false;
+    }
+    if(fdatasync(out) != 0) {
+      debug << Debug::Mode::Err << "Could not sync the rebuilt image" << std::endl;
+      return false;
+    }
+    if(progress) progress(done);
+    if(compare) debug << Debug::Mode::Info << skipped << " bytes of the delta were already there" << std::endl;
+    return true;
+  }
+
+  std::string DeltaTarget(const std::string &path) {
+    int delta = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(delta < 0) return "";
+    uint64_t size;
+    std::string target;
+    if(!readHeader(delta, size, target)) target.clear();
+    close(delta);
+    return target;
+  }
+
+  uint64_t ApplyDelta(const std::string &dest, uint64_t off, const std::string &src,
+                      const std::string &path, uint64_t size, volatile bool *cancel,
+                      const std::function<void(uint64_t done)> &progress) {
+    debug << Debug::Mode::Debug << "Applying delta " << path << " from " << src << " to " << dest << std::endl;
+    int in    = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    int delta = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    int out   = open(dest.c_str(), O_RDWR | O_CLOEXEC);
+
+    uint64_t done = 0;
+    bool good = false;
+    if(in >= 0 && delta >= 0 && out >= 0) {
+      good = applyDelta(out, off, in, delta, size, done, cancel, progress);
+    } else {
+      debug << Debug::Mode::Err << "Could not open " << ((in < 0) ? src : (delta < 0) ? path : dest) << std::endl;
+    }
+
+    // Half an image, or the wrong one, must not look like it might be good
+    if(!good && out >= 0 && done > 0 && !InvalidateRange(out, off, done)) {
+      debug << Debug::Mode::Warn << "Could not invalidate the failed delta on " << dest << std::endl;
+    }
+    if(in >= 0)    close(in);
+    if(delta >= 0) close(delta);
+    if(out >= 0)   close(out);
+
+    if(good) debug << Debug::Mode::Info << "Rebuilt " << size << " bytes from delta " << path << std::endl;
+    return good ? size : 0;
+  }
+};
@@ -0,0 +1,38 @@
+#ifndef __IVEIOTA_DELTA_HH
+#define __IVEIOTA_DELTA_HH
+
+#include <cstdint>
+#include <string>
+#include <functional>
+
+namespace iVeiOTA {
+  // A delta rebuilds an image from one that is already on the device (the same partition
+  //  in the active container) and the bytes that changed.  script_builder/make_delta.py
+  //  makes them.  All numbers are big endian:
+  //   "iVeiDLT1"          8 bytes
+  //   target size         8 bytes
+  //   target SHA256      32 bytes
+  //  then ops, each rebuilding the next part of the target, until the end op:
+  //   'C' offset length   copy length bytes of the source image from offset.  The source
+  //                       image is where the target goes, but on the source device.  With
+  //                       clone_compare, a copy from where it goes in the target is only
+  //                       written where the destination doesn't already hold it
+  //   'I' length data     insert length bytes of data from the delta
+  //   'Z' length          length bytes of zeros
+  //   'E'                 the end.  Everything up to target size must have been rebuilt
+
+  // Rebuild the target of the delta file at path from src, writing it to dest at off.
+  //  Only the piece being worked on is kept in memory.  size is the target size the
+  //  manifest expects.  progress, if set, is told how much is written every so often.
+  // The target is only good if the delta is well formed, every byte was written, it
+  //  matches the SHA256 in the delta, and it is synced.  Otherwise the region written is
+  //  invalidated and 0 is returned.  Returns the bytes written
+  uint64_t ApplyDelta(const std::string &dest, uint64_t off, const std::string &src,
+                      const std::string &path, uint64_t size, volatile bool *cancel = 0,
+                      const std::function<void(uint64_t done)> &progress = nullptr);
+
+  // The SHA256 (in hex) of the image the delta file at path rebuilds, or "" if it isn't one
+  std::string DeltaTarget(const std::string &path);
+};
+
+#endif
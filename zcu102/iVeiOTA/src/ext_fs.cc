@@ -0,0 +1,195 @@
+#include <memory>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+
+#include "ext_fs.hh"
+#include "debug.hh"
+
+namespace iVeiOTA {
+  // On-disk layout values we need from the ext2/3/4 superblock and group descriptors.
+  //  Everything on disk is little endian
+  static const uint64_t SuperblockOffset = 1024;
+  static const uint16_t ExtMagic         = 0xEF53;
+
+  static const uint32_t CompatSparseSuper2  = 0x0200;
+  static const uint32_t IncompatMetaBG      = 0x0010;
+  static const uint32_t Incompat64Bit       = 0x0080;
+  static const uint32_t RoCompatSparseSuper = 0x0001;
+  static const uint32_t RoCompatGdtCsum     = 0x0010;
+  static const uint32_t RoCompatMetaCsum    = 0x0400;
+
+  static const uint16_t GroupBlockUninit = 0x0002;
+
+  static uint16_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+  static uint32_t le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  static bool readAt(int fd, uint8_t *buf, size_t len, uint64_t off) {
+    size_t got = 0;
+    while(got < len) {
+      ssize_t r = pread(fd, buf + got, len - got, off + got);
+      if(r < 0 && errno == EINTR) continue;
+      if(r <= 0) return false;
+      got += r;
+    }
+    return true;
+  }
+
+  // Does this group carry a copy of the superblock and group descriptors
+  static bool isPowerOf(uint64_t n, uint64_t base) {
+    while(n > 1 && (n % base) == 0) n /= base;
+    return n == 1;
+  }
+  static bool groupHasSuper(uint64_t group, uint32_t compat, uint32_t roCompat, const uint32_t backups[2]) {
+    if(group == 0) return true;
+    if(compat & CompatSparseSuper2) return group == backups[0] || group == backups[1];
+    if(!(roCompat & RoCompatSparseSuper)) return true;
+    return group == 1 || isPowerOf(group, 3) || isPowerOf(group, 5) || isPowerOf(group, 7);
+  }
+
+  // Add blocks [start, start + count) to a list of extents, growing the last extent
+  //  if this range is adjacent to it
+  static void addBlocks(std::vector<Extent> &list, uint64_t start, uint64_t count, uint64_t blockSize) {
+    if(count == 0) return;
+    uint64_t off = start * blockSize;
+    uint64_t len = count * blockSize;
+    if(!list.empty() && list.back().End() == off) list.back().length += len;
+    else                                          list.push_back(Extent(off, len));
+  }
+
+  bool GetExtAllocatedExtents(int fd, std::vector<Extent> &extents, uint64_t &fsBytes, uint64_t mergeGap) {
+    extents.clear();
+    fsBytes = 0;
+
+    uint8_t sb[1024];
+    if(!readAt(fd, sb, sizeof(sb), SuperblockOffset)) {
+      debug << Debug::Mode::Warn << "Could not read ext superblock" << std::endl;
+      return false;
+    }
+    if(le16(sb + 0x38) != ExtMagic) {
+      debug << Debug::Mode::Info << "No ext superblock found" << std::endl;
+      return false;
+    }
+
+    uint32_t compat   = le32(sb + 0x5C);
+    uint32_t incompat = le32(sb + 0x60);
+    uint32_t roCompat = le32(sb + 0x64);
+
+    uint64_t blockCount     = le32(sb + 0x04);
+    uint32_t firstDataBlock = le32(sb + 0x14);
+    uint32_t logBlockSize   = le32(sb + 0x18);
+    uint32_t blocksPerGroup = le32(sb + 0x20);
+    uint32_t inodesPerGroup = le32(sb + 0x28);
+    uint32_t revLevel       = le32(sb + 0x4C);
+    uint16_t inodeSize      = (revLevel == 0) ? 128 : le16(sb + 0x58);
+    uint16_t reservedGdt    = le16(sb + 0xCE);
+    uint16_t descSize       = 32;
+    uint32_t backups[2]     = {le32(sb + 0x24C), le32(sb + 0x250)};
+    if(incompat & Incompat64Bit) {
+      descSize = le16(sb + 0xFE);
+      blockCount |= (uint64_t)le32(sb + 0x150) << 32;
+    }
+
+    // Descriptors scattered through the filesystem are rare on our boards, so we just
+    //  don't try to be clever with them
+    if(incompat & IncompatMetaBG) {
+      debug << Debug::Mode::Info << "ext meta_bg layout not supported for sparse copies" << std::endl;
+      return false;
+    }
+    if(logBlockSize > 6 || blocksPerGroup == 0 || blockCount == 0 || descSize < 32 || inodeSize == 0) {
+      debug << Debug::Mode::Warn << "ext superblock looks corrupt" << std::endl;
+      return false;
+    }
+
+    uint64_t blockSize = 1024ULL << logBlockSize;
+    uint64_t groups    = (blockCount - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+    uint64_t gdtBlocks = (groups * descSize + blockSize - 1) / blockSize;
+    uint64_t itBlocks  = ((uint64_t)inodesPerGroup * inodeSize + blockSize - 1) / blockSize;
+
+    // The group descriptors live in the block after the superblock
+    std::unique_ptr<uint8_t[]> gdt(new uint8_t[gdtBlocks * blockSize]);
+    if(!readAt(fd, gdt.get(), gdtBlocks * blockSize, (firstDataBlock + 1) * blockSize)) {
+      debug << Debug::Mode::Warn << "Could not read ext group descriptors" << std::endl;
+      return false;
+    }
+
+    // Uninitialized block bitmaps only exist with group descriptor checksums
+    bool uninitValid = (roCompat & (RoCompatGdtCsum | RoCompatMetaCsum)) != 0;
+
+    // Two lists: what the bitmaps say is in use, and the metadata we know has to be
+    //  there.  The kernel builds the bitmap of an uninitialized group from the
+    //  metadata, so the union of the two lists covers everything
+    std::vector<Extent> used, meta;
+
+    // The boot block and superblock are always needed
+    addBlocks(meta, 0, firstDataBlock + 1, blockSize);
+
+    std::unique_ptr<uint8_t[]> bitmap(new uint8_t[blockSize]);
+    for(uint64_t g = 0; g < groups; g++) {
+      const uint8_t *desc = gdt.get() + g * descSize;
+      uint64_t blockBitmap = le32(desc + 0x00);
+      uint64_t inodeBitmap = le32(desc + 0x04);
+      uint64_t inodeTable  = le32(desc + 0x08);
+      uint16_t flags       = le16(desc + 0x12);
+      if(descSize >= 64) {
+        blockBitmap |= (uint64_t)le32(desc + 0x20) << 32;
+        inodeBitmap |= (uint64_t)le32(desc + 0x24) << 32;
+        inodeTable  |= (uint64_t)le32(desc + 0x28) << 32;
+      }
+
+      uint64_t groupStart = firstDataBlock + g * blocksPerGroup;
+      uint64_t groupLen   = std::min((uint64_t)blocksPerGroup, blockCount - groupStart);
+
+      if(groupHasSuper(g, compat, roCompat, backups)) {
+        addBlocks(meta, groupStart, std::min(groupLen, 1 + gdtBlocks + reservedGdt), blockSize);
+      }
+
+      // Metadata may live in a different group with flex_bg, so these go in their own
+      //  list that gets sorted later
+      meta.push_back(Extent(blockBitmap * blockSize, blockSize));
+      meta.push_back(Extent(inodeBitmap * blockSize, blockSize));
+      meta.push_back(Extent(inodeTable * blockSize, itBlocks * blockSize));
+
+      if(uninitValid && (flags & GroupBlockUninit)) continue;
+
+      if(blockBitmap >= blockCount || !readAt(fd, bitmap.get(), blockSize, blockBitmap * blockSize)) {
+        debug << Debug::Mode::Warn << "Could not read block bitmap for group " << g << std::endl;
+        return false;
+      }
+
+      // Walk the bitmap and turn runs of set bits into extents
+      uint64_t runStart = 0;
+      bool inRun = false;
+      for(uint64_t b = 0; b < groupLen; b++) {
+        bool set = (bitmap[b >> 3] >> (b & 7)) & 1;
+        if(set && !inRun)      { runStart = b; inRun = true; }
+        else if(!set && inRun) { addBlocks(used, groupStart + runStart, b - runStart, blockSize); inRun = false; }
+      }
+      if(inRun) addBlocks(used, groupStart + runStart, groupLen - runStart, blockSize);
+    }
+
+    // Merge the two lists into one sorted, non-overlapping list
+    used.insert(used.end(), meta.begin(), meta.end());
+    std::sort(used.begin(), used.end(), [](const Extent &a, const Extent &b) { return a.offset < b.offset; });
+
+    fsBytes = blockCount * blockSize;
+    for(const Extent &e : used) {
+      if(e.length == 0 || e.offset >= fsBytes) continue;
+      uint64_t end = std::min(e.End(), fsBytes);
+      if(!extents.empty() && e.offset <= extents.back().End() + mergeGap) {
+        if(end > extents.back().End()) extents.back().length = end - extents.back().offset;
+      } else {
+        extents.push_back(Extent(e.offset, end - e.offset));
+      }
+    }
+
+    uint64_t inUse = 0;
+    for(const Extent &e : extents) inUse += e.length;
+    debug << Debug::Mode::Info << "ext filesystem: " << groups << " groups of " << blocksPerGroup <<
+      " x " << blockSize << " byte blocks, " << inUse << " of " << fsBytes << " bytes in use in " <<
+      extents.size() << " extents" << std::endl;
+    return true;
+  }
+};
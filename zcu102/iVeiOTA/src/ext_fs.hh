@@ -0,0 +1,28 @@
+#ifndef __IVEIOTA_EXT_FS_HH
+#define __IVEIOTA_EXT_FS_HH
+
+#include <cstdint>
+#include <vector>
+
+namespace iVeiOTA {
+  // A contiguous range of bytes on a device
+  struct Extent {
+    uint64_t offset;
+    uint64_t length;
+
+    Extent(uint64_t offset = 0, uint64_t length = 0) : offset(offset), length(length) {}
+    uint64_t End() const { return offset + length; }
+  };
+
+  // Read the superblock, group descriptors and block bitmaps of the ext2/3/4 filesystem
+  //  on fd and build the list of byte ranges that hold anything the filesystem needs.
+  //  The extents are sorted, don't overlap, and gaps smaller than mergeGap are merged
+  //  away to keep the number of copies down.
+  // fsBytes is set to the size of the filesystem, which may be less than the device.
+  // Returns false if this doesn't look like a filesystem we understand, in which case
+  //  the whole device should be treated as in use
+  bool GetExtAllocatedExtents(int fd, std::vector<Extent> &extents, uint64_t &fsBytes,
+                              uint64_t mergeGap = 0);
+};
+
+#endif
@@ -0,0 +1,732 @@
+#include <cstring>
+#include <mutex>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HASH_X86 1
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define HASH_ARM 1
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+// The crypto instructions only get enabled for the functions that use them, so the
+//  rest of the program still runs on cores without them
+#if defined(__clang__)
+#define ARM_CRYPTO __attribute__((target("crypto")))
+#define ARM_CRC    __attribute__((target("crc")))
+#else
+#define ARM_CRYPTO __attribute__((target("+crypto")))
+#define ARM_CRC    __attribute__((target("+crc")))
+#endif
+#endif
+
+#include "hash.hh"
+#include "debug.hh"
+
+namespace iVeiOTA {
+  static inline uint32_t rotl32(uint32_t x, unsigned n) { return (x << n) | (x >> (32 - n)); }
+  static inline uint32_t rotr32(uint32_t x, unsigned n) { return (x >> n) | (x << (32 - n)); }
+  static inline uint64_t rotr64(uint64_t x, unsigned n) { return (x >> n) | (x << (64 - n)); }
+  static inline uint32_t le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+  static inline uint32_t be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+  }
+  static inline uint64_t be64(const uint8_t *p) { return ((uint64_t)be32(p) << 32) | be32(p + 4); }
+
+  // Block functions process whole 64 or 128 byte blocks into the state
+  typedef void (*Blocks32)(uint32_t *state, const uint8_t *data, uint64_t count);
+  typedef void (*Blocks64)(uint64_t *state, const uint8_t *data, uint64_t count);
+
+  ////////////////////////////////////////////////////////////////////////////
+  // Portable implementations
+
+  static const uint32_t md5K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+  };
+  static const uint8_t md5R[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+  };
+
+  static void md5Blocks(uint32_t *state, const uint8_t *data, uint64_t count) {
+    for(; count > 0; count--, data += 64) {
+      uint32_t w[16];
+      for(int i = 0; i < 16; i++) w[i] = le32(data + i * 4);
+
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+      for(int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if(i < 16)      { f = (b & c) | (~b & d); g = i; }
+        else if(i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) & 15; }
+        else if(i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) & 15; }
+        else            { f = c ^ (b | ~d);       g = (7 * i) & 15; }
+        uint32_t t = d;
+        d = c;
+        c = b;
+        b = b + rotl32(a + f + md5K[i] + w[g], md5R[i]);
+        a = t;
+      }
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    }
+  }
+
+  static const uint32_t sha1K[4] = {0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6};
+
+  static void sha1Blocks(uint32_t *state, const uint8_t *data, uint64_t count) {
+    for(; count > 0; count--, data += 64) {
+      uint32_t w[80];
+      for(int i = 0; i < 16; i++) w[i] = be32(data + i * 4);
+      for(int i = 16; i < 80; i++) w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+      for(int i = 0; i < 80; i++) {
+        uint32_t f;
+        if(i < 20)      f = (b & c) | (~b & d);
+        else if(i < 40) f = b ^ c ^ d;
+        else if(i < 60) f = (b & c) | (b & d) | (c & d);
+        else            f = b ^ c ^ d;
+        uint32_t t = rotl32(a, 5) + f + e + sha1K[i / 20] + w[i];
+        e = d;
+        d = c;
+        c = rotl32(b, 30);
+        b = a;
+        a = t;
+      }
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+    }
+  }
+
+  static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+  };
+
+  static void sha256Blocks(uint32_t *state, const uint8_t *data, uint64_t count) {
+    for(; count > 0; count--, data += 64) {
+      uint32_t w[64];
+      for(int i = 0; i < 16; i++) w[i] = be32(data + i * 4);
+      for(int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+      uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+      for(int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+      }
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+      state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+  }
+
+  static const uint64_t sha512K[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+  };
+
+  static void sha512Blocks(uint64_t *state, const uint8_t *data, uint64_t count) {
+    for(; count > 0; count--, data += 128) {
+      uint64_t w[80];
+      for(int i = 0; i < 16; i++) w[i] = be64(data + i * 8);
+      for(int i = 16; i < 80; i++) {
+        uint64_t s0 = rotr64(w[i - 15], 1) ^ rotr64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+        uint64_t s1 = rotr64(w[i - 2], 19) ^ rotr64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+
+      uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+      uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+      for(int i = 0; i < 80; i++) {
+        uint64_t t1 = h + (rotr64(e, 14) ^ rotr64(e, 18) ^ rotr64(e, 41)) + ((e & f) ^ (~e & g)) + sha512K[i] + w[i];
+        uint64_t t2 = (rotr64(a, 28) ^ rotr64(a, 34) ^ rotr64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+      }
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+      state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  // x86 SHA-NI
+
+#ifdef HASH_X86
+  __attribute__((target("sha,sse4.1,ssse3")))
+  static __m128i sha1Rounds(__m128i abcd, __m128i e, int group) {
+    // The round function has to be an immediate
+    switch(group / 5) {
+    case 0:  return _mm_sha1rnds4_epu32(abcd, e, 0);
+    case 1:  return _mm_sha1rnds4_epu32(abcd, e, 1);
+    case 2:  return _mm_sha1rnds4_epu32(abcd, e, 2);
+    default: return _mm_sha1rnds4_epu32(abcd, e, 3);
+    }
+  }
+
+  __attribute__((target("sha,sse4.1,ssse3")))
+  static void sha1BlocksX86(uint32_t *state, const uint8_t *data, uint64_t count) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+    __m128i e0   = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for(; count > 0; count--, data += 64) {
+      __m128i abcdSave = abcd, e0Save = e0;
+      __m128i msg[4], e = e0, eSave = e0;
+
+      // 20 groups of 4 rounds.  Each group's message words come from the 4 before it
+      for(int g = 0; g < 20; g++) {
+        if(g < 4) {
+          msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + g * 16)), mask);
+        } else {
+          msg[g & 3] = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(msg[g & 3], msg[(g + 1) & 3]),
+                                                        msg[(g + 2) & 3]), msg[(g + 3) & 3]);
+        }
+        e = (g == 0) ? _mm_add_epi32(e0, msg[0]) : _mm_sha1nexte_epu32(eSave, msg[g & 3]);
+        eSave = abcd;
+        abcd  = sha1Rounds(abcd, e, g);
+      }
+
+      e0   = _mm_sha1nexte_epu32(eSave, e0Save);
+      abcd = _mm_add_epi32(abcd, abcdSave);
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+  }
+
+  __attribute__((target("sha,sse4.1,ssse3")))
+  static void sha256BlocksX86(uint32_t *state, const uint8_t *data, uint64_t count) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions want the state as ABEF and CDGH
+    __m128i tmp    = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for(; count > 0; count--, data += 64) {
+      __m128i save0 = state0, save1 = state1;
+      __m128i msg[4];
+
+      for(int g = 0; g < 16; g++) {
+        if(g < 4) {
+          msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + g * 16)), mask);
+        } else {
+          __m128i w = _mm_add_epi32(_mm_sha256msg1_epu32(msg[g & 3], msg[(g + 1) & 3]),
+                                    _mm_alignr_epi8(msg[(g + 3) & 3], msg[(g + 2) & 3], 4));
+          msg[g & 3] = _mm_sha256msg2_epu32(w, msg[(g + 3) & 3]);
+        }
+        __m128i wk = _mm_add_epi32(msg[g & 3], _mm_loadu_si128((const __m128i*)&sha256K[g * 4]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+      }
+
+      state0 = _mm_add_epi32(state0, save0);
+      state1 = _mm_add_epi32(state1, save1);
+    }
+
+    tmp    = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+  }
+
+  static bool x86HasSha() {
+    unsigned eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    bool ssse3 = (ecx & (1 << 9)) != 0;
+    bool sse41 = (ecx & (1 << 19)) != 0;
+    if(__get_cpuid_max(0, nullptr) < 7) return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return ssse3 && sse41 && (ebx & (1 << 29)) != 0;
+  }
+#endif
+
+  ////////////////////////////////////////////////////////////////////////////
+  // ARMv8 crypto extensions
+
+#ifdef HASH_ARM
+  ARM_CRYPTO
+  static void sha1BlocksArm(uint32_t *state, const uint8_t *data, uint64_t count) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t   e0   = state[4];
+
+    for(; count > 0; count--, data += 64) {
+      uint32x4_t abcdSave = abcd;
+      uint32_t   e = e0;
+      uint32x4_t msg[4];
+
+      for(int g = 0; g < 20; g++) {
+        if(g < 4) {
+          msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + g * 16)));
+        } else {
+          msg[g & 3] = vsha1su1q_u32(vsha1su0q_u32(msg[g & 3], msg[(g + 1) & 3], msg[(g + 2) & 3]),
+                                     msg[(g + 3) & 3]);
+        }
+        uint32x4_t wk = vaddq_u32(msg[g & 3], vdupq_n_u32(sha1K[g / 5]));
+        uint32_t next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+        switch(g / 5) {
+        case 0:  abcd = vsha1cq_u32(abcd, e, wk); break;
+        case 2:  abcd = vsha1mq_u32(abcd, e, wk); break;
+        default: abcd = vsha1pq_u32(abcd, e, wk); break;
+        }
+        e = next;
+      }
+
+      e0  += e;
+      abcd = vaddq_u32(abcd, abcdSave);
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+  }
+
+  ARM_CRYPTO
+  static void sha256BlocksArm(uint32_t *state, const uint8_t *data, uint64_t count) {
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+
+    for(; count > 0; count--, data += 64) {
+      uint32x4_t save0 = state0, save1 = state1;
+      uint32x4_t msg[4];
+
+      for(int g = 0; g < 16; g++) {
+        if(g < 4) {
+          msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + g * 16)));
+        } else {
+          msg[g & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[g & 3], msg[(g + 1) & 3]),
+                                       msg[(g + 2) & 3], msg[(g + 3) & 3]);
+        }
+        uint32x4_t wk  = vaddq_u32(msg[g & 3], vld1q_u32(&sha256K[g * 4]));
+        uint32x4_t abcd = state0;
+        state0 = vsha256hq_u32(state0, state1, wk);
+        state1 = vsha256h2q_u32(state1, abcd, wk);
+      }
+
+      state0 = vaddq_u32(state0, save0);
+      state1 = vaddq_u32(state1, save1);
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+  }
+#endif
+
+  ////////////////////////////////////////////////////////////////////////////
+
+  // What the CPU can do, worked out the first time anyone hashes anything
+  struct HashEngines {
+    Blocks32    sha1;
+    Blocks32    sha256;
+    std::string name;
+  };
+  static const HashEngines &accelerated() {
+    static HashEngines engines = {sha1Blocks, sha256Blocks, "portable"};
+    static std::once_flag probed;
+    std::call_once(probed, []() {
+#ifdef HASH_X86
+      if(x86HasSha()) engines = {sha1BlocksX86, sha256BlocksX86, "SHA-NI"};
+#endif
+#ifdef HASH_ARM
+      unsigned long hwcap = getauxval(AT_HWCAP);
+      if(hwcap & HWCAP_SHA1) engines.sha1   = sha1BlocksArm;
+      if(hwcap & HWCAP_SHA2) engines.sha256 = sha256BlocksArm;
+      if(hwcap & (HWCAP_SHA1 | HWCAP_SHA2)) engines.name = "ARMv8 crypto";
+#endif
+      debug << Debug::Mode::Info << "Using " << engines.name << " SHA1/SHA256" << std::endl;
+    });
+    return engines;
+  }
+
+  Hasher::Hasher(HashAlgorithm algo, bool accelerated) : algo(algo), accelerated(accelerated) {
+    Reset();
+  }
+
+  void Hasher::Reset() {
+    length = 0;
+    used   = 0;
+    switch(algo) {
+    case HashAlgorithm::MD5:
+    {
+      const uint32_t init[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+      memcpy(state32, init, sizeof(init));
+      blockSize = 64;
+      break;
+    }
+    case HashAlgorithm::SHA1:
+    {
+      const uint32_t init[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+      memcpy(state32, init, sizeof(init));
+      blockSize = 64;
+      break;
+    }
+    case HashAlgorithm::SHA256:
+    {
+      const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+      memcpy(state32, init, sizeof(init));
+      blockSize = 64;
+      break;
+    }
+    case HashAlgorithm::SHA512:
+    {
+      const uint64_t init[8] = {0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL,
+                                0xa54ff53a5f1d36f1ULL, 0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+                                0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL};
+      memcpy(state64, init, sizeof(init));
+      blockSize = 128;
+      break;
+    }
+    default:
+      blockSize = 0;
+      break;
+    }
+  }
+
+  std::string Hasher::Engine() const {
+    if((algo == HashAlgorithm::SHA1 || algo == HashAlgorithm::SHA256) && accelerated) {
+      return iVeiOTA::accelerated().name;
+    }
+    return "portable";
+  }
+
+  // How many words of state32 or state64 the algorithm uses
+  unsigned Hasher::stateWords() const {
+    switch(algo) {
+    case HashAlgorithm::MD5:    return 4;
+    case HashAlgorithm::SHA1:   return 5;
+    case HashAlgorithm::SHA256: return 8;
+    case HashAlgorithm::SHA512: return 8;
+    default:                    return 0;
+    }
+  }
+
+  static void putHex(std::string &out, uint64_t val, unsigned digits) {
+    static const char hex[] = "0123456789abcdef";
+    for(unsigned i = digits; i > 0; i--) out += hex[(val >> (4 * (i - 1))) & 15];
+  }
+
+  static bool getHex(const std::string &in, size_t &pos, unsigned digits, uint64_t &val) {
+    if(pos + digits > in.length()) return false;
+    val = 0;
+    for(unsigned i = 0; i < digits; i++) {
+      char c = in[pos++];
+      val <<= 4;
+      if(c >= '0' && c <= '9')      val |= c - '0';
+      else if(c >= 'a' && c <= 'f') val |= c - 'a' + 10;
+      else return false;
+    }
+    return true;
+  }
+
+  // The state is the length, the chaining values, then whatever is waiting for a full block
+  std::string Hasher::SaveState() const {
+    std::string ret;
+    if(blockSize == 0) return ret;
+    putHex(ret, length, 16);
+    for(unsigned i = 0; i < stateWords(); i++) {
+      if(algo == HashAlgorithm::SHA512) putHex(ret, state64[i], 16);
+      else                              putHex(ret, state32[i], 8);
+    }
+    for(unsigned i = 0; i < used; i++) putHex(ret, buffer[i], 2);
+    return ret;
+  }
+
+  bool Hasher::RestoreState(const std::string &state) {
+    if(blockSize == 0) return false;
+    unsigned wordDigits = (algo == HashAlgorithm::SHA512) ? 16 : 8;
+    size_t pos = 0;
+    uint64_t val, newLength;
+    if(!getHex(state, pos, 16, newLength)) return false;
+    unsigned newUsed = newLength % blockSize;
+    if(state.length() != 16 + stateWords() * wordDigits + newUsed * 2) return false;
+
+    uint32_t new32[8];
+    uint64_t new64[8];
+    uint8_t newBuffer[128];
+    for(unsigned i = 0; i < stateWords(); i++) {
+      if(!getHex(state, pos, wordDigits, val)) return false;
+      new32[i] = val;
+      new64[i] = val;
+    }
+    for(unsigned i = 0; i < newUsed; i++) {
+      if(!getHex(state, pos, 2, val)) return false;
+      newBuffer[i] = val;
+    }
+
+    length = newLength;
+    used   = newUsed;
+    if(algo == HashAlgorithm::SHA512) memcpy(state64, new64, stateWords() * sizeof(uint64_t));
+    else                              memcpy(state32, new32, stateWords() * sizeof(uint32_t));
+    memcpy(buffer, newBuffer, used);
+    return true;
+  }
+
+  void Hasher::blocks(const uint8_t *data, uint64_t count) {
+    switch(algo) {
+    case HashAlgorithm::MD5:
+      md5Blocks(state32, data, count);
+      break;
+    case HashAlgorithm::SHA1:
+      (accelerated ? iVeiOTA::accelerated().sha1 : sha1Blocks)(state32, data, count);
+      break;
+    case HashAlgorithm::SHA256:
+      (accelerated ? iVeiOTA::accelerated().sha256 : sha256Blocks)(state32, data, count);
+      break;
+    case HashAlgorithm::SHA512:
+      sha512Blocks(state64, data, count);
+      break;
+    default:
+      break;
+    }
+  }
+
+  void Hasher::Update(const uint8_t *data, uint64_t len) {
+    if(blockSize == 0) return;
+    length += len;
+
+    // Finish off a partial block first
+    if(used > 0) {
+      unsigned take = std::min((uint64_t)(blockSize - used), len);
+      memcpy(buffer + used, data, take);
+      used += take;
+      data += take;
+      len  -= take;
+      if(used < blockSize) return;
+      blocks(buffer, 1);
+      used = 0;
+    }
+
+    // Whole blocks straight from the caller's buffer
+    uint64_t count = len / blockSize;
+    if(count > 0) {
+      blocks(data, count);
+      data += count * blockSize;
+      len  -= count * blockSize;
+    }
+
+    memcpy(buffer, data, len);
+    used = len;
+  }
+
+  std::string Hasher::Final() {
+    if(blockSize == 0) return "";
+
+    // Pad with 0x80, zeros, then the length in bits in the last 8 (or 16) bytes
+    unsigned lenBytes = (blockSize == 128) ? 16 : 8;
+    uint64_t bits = length * 8;
+    uint8_t pad[256];
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    unsigned padLen = blockSize - ((used + lenBytes) % blockSize);
+    for(unsigned i = 0; i < 8; i++) {
+      if(algo == HashAlgorithm::MD5) pad[padLen + i] = bits >> (8 * i);
+      else                           pad[padLen + lenBytes - 1 - i] = bits >> (8 * i);
+    }
+    if(lenBytes == 16) pad[padLen + 7] = length >> 61;
+    uint64_t saved = length;
+    Update(pad, padLen + lenBytes);
+    length = saved;
+
+    uint8_t digest[64];
+    unsigned digestLen = 0;
+    switch(algo) {
+    case HashAlgorithm::MD5:
+      for(unsigned i = 0; i < 16; i++) digest[i] = state32[i / 4] >> (8 * (i % 4));
+      digestLen = 16;
+      break;
+    case HashAlgorithm::SHA1:
+    case HashAlgorithm::SHA256:
+      digestLen = (algo == HashAlgorithm::SHA1) ? 20 : 32;
+      for(unsigned i = 0; i < digestLen; i++) digest[i] = state32[i / 4] >> (24 - 8 * (i % 4));
+      break;
+    case HashAlgorithm::SHA512:
+      for(unsigned i = 0; i < 64; i++) digest[i] = state64[i / 8] >> (56 - 8 * (i % 8));
+      digestLen = 64;
+      break;
+    default:
+      break;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    std::string ret;
+    ret.reserve(digestLen * 2);
+    for(unsigned i = 0; i < digestLen; i++) {
+      ret += hex[digest[i] >> 4];
+      ret += hex[digest[i] & 15];
+    }
+    return ret;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  // CRC32C (Castagnoli).  SSE4.2 and the ARMv8 CRC32 extension both have instructions for
+  //  this polynomial, otherwise it is done 8 bytes at a time from tables
+
+  typedef uint32_t (*CrcFunction)(uint32_t crc, const uint8_t *data, size_t len);
+
+  static uint32_t crcTable[8][256];
+
+  static uint32_t crc32cTable(uint32_t crc, const uint8_t *data, size_t len) {
+    while(len >= 8) {
+      uint32_t lo = crc ^ le32(data);
+      uint32_t hi = le32(data + 4);
+      crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^
+            crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+            crcTable[3][hi & 0xFF] ^ crcTable[2][(hi >> 8) & 0xFF] ^
+            crcTable[1][(hi >> 16) & 0xFF] ^ crcTable[0][hi >> 24];
+      data += 8;
+      len  -= 8;
+    }
+    while(len-- > 0) crc = crcTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return crc;
+  }
+
+#ifdef HASH_X86
+  __attribute__((target("sse4.2")))
+  static uint32_t crc32cX86(uint32_t crc, const uint8_t *data, size_t len) {
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for(; len >= 8; data += 8, len -= 8) {
+      uint64_t word;
+      memcpy(&word, data, 8);
+      crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+#endif
+    for(; len >= 4; data += 4, len -= 4) {
+      uint32_t word;
+      memcpy(&word, data, 4);
+      crc = _mm_crc32_u32(crc, word);
+    }
+    while(len-- > 0) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+  }
+
+  static bool x86HasCrc() {
+    unsigned eax, ebx, ecx, edx;
+    if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return (ecx & (1 << 20)) != 0; // SSE4.2
+  }
+#endif
+
+#ifdef HASH_ARM
+  ARM_CRC
+  static uint32_t crc32cArm(uint32_t crc, const uint8_t *data, size_t len) {
+    for(; len >= 8; data += 8, len -= 8) {
+      uint64_t word;
+      memcpy(&word, data, 8);
+      crc = __crc32cd(crc, word);
+    }
+    while(len-- > 0) crc = __crc32cb(crc, *data++);
+    return crc;
+  }
+#endif
+
+  struct CrcEngine {
+    CrcFunction function;
+    std::string name;
+  };
+  static const CrcEngine &crcEngine() {
+    static CrcEngine engine = {crc32cTable, "portable"};
+    static std::once_flag probed;
+    std::call_once(probed, []() {
+      // The tables are needed whatever the CPU, for Crc32c(..., false)
+      for(uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+        crcTable[0][i] = crc;
+      }
+      for(uint32_t i = 0; i < 256; i++) {
+        for(int t = 1; t < 8; t++) {
+          crcTable[t][i] = (crcTable[t - 1][i] >> 8) ^ crcTable[0][crcTable[t - 1][i] & 0xFF];
+        }
+      }
+#ifdef HASH_X86
+      if(x86HasCrc()) engine = {crc32cX86, "SSE4.2"};
+#endif
+#ifdef HASH_ARM
+      if(getauxval(AT_HWCAP) & HWCAP_CRC32) engine = {crc32cArm, "ARMv8 CRC32"};
+#endif
+      debug << Debug::Mode::Info << "Using " << engine.name << " CRC32C" << std::endl;
+    });
+    return engine;
+  }
+
+  uint32_t Crc32c(const uint8_t *data, size_t len, uint32_t crc, bool accelerated) {
+    const CrcEngine &engine = crcEngine();
+    CrcFunction function = accelerated ? engine.function : crc32cTable;
+    return ~function(~crc, data, len);
+  }
+
+  std::string Crc32cEngine() {
+    return crcEngine().name;
+  }
+};
@@ -0,0 +1,57 @@
+#ifndef __IVEIOTA_HASH_HH
+#define __IVEIOTA_HASH_HH
+
+#include <cstdint>
+#include <string>
+
+#include "support.hh"
+
+namespace iVeiOTA {
+  // A streaming hash for the algorithms in HashAlgorithm.  Feed it data with Update and
+  //  get the digest with Final as lower case hex, the same as md5sum/sha*sum print.
+  // SHA1 and SHA256 use the ARMv8 crypto extensions or x86 SHA-NI when the CPU has them
+  //  (checked at run time), and portable C++ otherwise
+  class Hasher {
+  public:
+    explicit Hasher(HashAlgorithm algo, bool accelerated = true);
+
+    bool Valid() const { return blockSize != 0; }
+    HashAlgorithm Algorithm() const { return algo; }
+
+    // Start over without changing the algorithm
+    void Reset();
+    void Update(const uint8_t *data, uint64_t len);
+    // The digest of everything given to Update.  The hasher has to be Reset to be used again
+    std::string Final();
+
+    // Which implementation this hasher is using, for logging
+    std::string Engine() const;
+
+    // The hash of the data so far as a string of hex (no ':'), and back.  This lets a long
+    //  hash be picked up again after a restart.  Restore fails (and leaves the hasher alone)
+    //  if the state is malformed or from a different algorithm
+    std::string SaveState() const;
+    bool RestoreState(const std::string &state);
+
+  private:
+    void blocks(const uint8_t *data, uint64_t count);
+    unsigned stateWords() const;
+
+    HashAlgorithm algo;
+    bool     accelerated;
+    unsigned blockSize;   // 64 or 128, 0 if the algorithm isn't one we know
+    uint64_t length;      // Bytes given to Update so far
+    unsigned used;        // Bytes waiting in buffer for a full block
+    uint8_t  buffer[128];
+    uint32_t state32[8];  // MD5, SHA1, SHA256
+    uint64_t state64[8];  // SHA512
+  };
+
+  // CRC32C of len bytes of data.  To CRC data in pieces, pass the CRC of the pieces so far
+  //  as crc.  Uses the SSE4.2 or ARMv8 CRC32 instructions when the CPU has them
+  uint32_t Crc32c(const uint8_t *data, size_t len, uint32_t crc = 0, bool accelerated = true);
+  // Which implementation Crc32c is using, for logging
+  std::string Crc32cEngine();
+};
+
+#endif
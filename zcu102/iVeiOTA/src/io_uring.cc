@@ -0,0 +1,215 @@
+#include <cstring>
+#include <mutex>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "io_uring.hh"
+#include "debug.hh"
+
+// Older kernel headers don't have io_uring at all, in which case every ring is invalid
+//  and the copy engine uses the pread/pwrite path
+#if defined(IORING_OFF_SQ_RING) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+namespace iVeiOTA {
+#ifdef HAVE_IO_URING
+  static inline unsigned loadAcquire(const unsigned *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+  static inline void storeRelease(unsigned *p, unsigned v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+  static inline unsigned *ringField(void *ring, uint32_t off) { return (unsigned*)((uint8_t*)ring + off); }
+#endif
+
+  IOUring::IOUring(unsigned entries) :
+    ringFd(-1), error(ENOSYS), toSubmit(0),
+    sqRing(MAP_FAILED), sqRingSize(0), cqRing(MAP_FAILED), cqRingSize(0), sqes(MAP_FAILED), sqesSize(0),
+    sqHead(nullptr), sqTail(nullptr), sqMask(nullptr), sqEntries(nullptr), sqArray(nullptr),
+    cqHead(nullptr), cqTail(nullptr), cqMask(nullptr), cqes(nullptr) {
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd < 0) {
+      // ENOSYS on old kernels, EPERM when seccomp or io_uring_disabled blocks it
+      error = errno;
+      return;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sqRing != MAP_FAILED) {
+      if(single) cqRing = sqRing;
+      else       cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    if(cqRing != MAP_FAILED) {
+      sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+      sqes = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+    if(sqes == MAP_FAILED) {
+      error = errno;
+      debug << Debug::Mode::Warn << "Failed to map io_uring: " << strerror(error) << std::endl;
+      close(fd);
+      return;
+    }
+
+    sqHead    = ringField(sqRing, params.sq_off.head);
+    sqTail    = ringField(sqRing, params.sq_off.tail);
+    sqMask    = ringField(sqRing, params.sq_off.ring_mask);
+    sqEntries = ringField(sqRing, params.sq_off.ring_entries);
+    sqArray   = ringField(sqRing, params.sq_off.array);
+    cqHead    = ringField(cqRing, params.cq_off.head);
+    cqTail    = ringField(cqRing, params.cq_off.tail);
+    cqMask    = ringField(cqRing, params.cq_off.ring_mask);
+    cqes      = (uint8_t*)cqRing + params.cq_off.cqes;
+
+    ringFd = fd;
+    error  = 0;
+#else
+    (void)entries;
+#endif
+  }
+
+  IOUring::~IOUring() {
+    if(sqes != MAP_FAILED) munmap(sqes, sqesSize);
+    if(cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if(sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if(ringFd >= 0) close(ringFd);
+  }
+
+  bool IOUring::RegisterBuffers(const std::vector<struct iovec> &buffers) {
+#ifdef HAVE_IO_URING
+    if(ringFd < 0) return false;
+    if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) != 0) {
+      error = errno;
+      return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool IOUring::RegisterFiles(const std::vector<int> &fds) {
+#ifdef HAVE_IO_URING
+    if(ringFd < 0) return false;
+    if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, fds.data(), fds.size()) != 0) {
+      error = errno;
+      return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool IOUring::queue(uint8_t opcode, unsigned fileIndex, int bufIndex, const void *buf,
+                      uint32_t len, uint64_t off, uint64_t userData) {
+#ifdef HAVE_IO_URING
+    if(ringFd < 0) return false;
+
+    // We are the only ones moving the tail, the kernel moves the head
+    unsigned tail = *sqTail;
+    if(tail - loadAcquire(sqHead) >= *sqEntries) return false;
+
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*)sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->flags     = IOSQE_FIXED_FILE;
+    sqe->fd        = fileIndex;
+    sqe->off       = off;
+    sqe->addr      = (uint64_t)(uintptr_t)buf;
+    sqe->len       = len;
+    sqe->buf_index = (bufIndex < 0) ? 0 : bufIndex;
+    sqe->user_data = userData;
+
+    sqArray[index] = index;
+    storeRelease(sqTail, tail + 1);
+    toSubmit++;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool IOUring::QueueRead(unsigned fileIndex, int bufIndex, void *buf, uint32_t len,
+                          uint64_t off, uint64_t userData) {
+#ifdef HAVE_IO_URING
+    uint8_t opcode = (bufIndex < 0) ? IORING_OP_READ : IORING_OP_READ_FIXED;
+    return queue(opcode, fileIndex, bufIndex, buf, len, off, userData);
+#else
+    return false;
+#endif
+  }
+
+  bool IOUring::QueueWrite(unsigned fileIndex, int bufIndex, const void *buf, uint32_t len,
+                           uint64_t off, uint64_t userData) {
+#ifdef HAVE_IO_URING
+    uint8_t opcode = (bufIndex < 0) ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED;
+    return queue(opcode, fileIndex, bufIndex, buf, len, off, userData);
+#else
+    return false;
+#endif
+  }
+
+  int IOUring::Submit(unsigned waitFor) {
+#ifdef HAVE_IO_URING
+    if(ringFd < 0) return error;
+    unsigned flags = (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0;
+    while(toSubmit > 0 || waitFor > 0) {
+      int r = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor, flags, nullptr, 0);
+      if(r < 0) {
+        if(errno == EINTR) continue;
+        return errno;
+      }
+      toSubmit -= std::min((unsigned)r, toSubmit);
+      // The wait is satisfied once everything was submitted
+      if(toSubmit == 0) break;
+    }
+    return 0;
+#else
+    return ENOSYS;
+#endif
+  }
+
+  bool IOUring::Reap(uint64_t &userData, int32_t &res) {
+#ifdef HAVE_IO_URING
+    if(ringFd < 0) return false;
+    unsigned head = *cqHead;
+    if(head == loadAcquire(cqTail)) return false;
+
+    const struct io_uring_cqe *cqe = (const struct io_uring_cqe*)cqes + (head & *cqMask);
+    userData = cqe->user_data;
+    res      = cqe->res;
+    storeRelease(cqHead, head + 1);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  bool IOUring::Available() {
+    static std::once_flag probed;
+    static bool available = false;
+    std::call_once(probed, []() {
+      IOUring ring(2);
+      available = ring.Valid();
+      if(!available) {
+        debug << Debug::Mode::Info << "io_uring not available: " << strerror(ring.Error()) << std::endl;
+      }
+    });
+    return available;
+  }
+};
@@ -0,0 +1,72 @@
+#ifndef __IVEIOTA_IO_URING_HH
+#define __IVEIOTA_IO_URING_HH
+
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+
+namespace iVeiOTA {
+  // A small wrapper around an io_uring submission/completion ring, done with the raw
+  //  system calls so we don't need liburing in the Android tree.  Only what the copy
+  //  engine needs is here: fixed buffers, fixed files, and reads and writes at offsets.
+  // If the kernel (or the headers we were built against) doesn't have io_uring, Valid()
+  //  is false and Error() says why, so callers can go back to pread/pwrite
+  class IOUring {
+  public:
+    explicit IOUring(unsigned entries);
+    ~IOUring();
+
+    bool Valid() const { return ringFd >= 0; }
+    int  Error() const { return error; }
+
+    // Register the buffers and files that the Queue calls refer to by index.  Both can
+    //  only be done once per ring.  Return false and set Error() on failure
+    bool RegisterBuffers(const std::vector<struct iovec> &buffers);
+    bool RegisterFiles(const std::vector<int> &fds);
+
+    // Queue a read or write of len bytes at off on registered file fileIndex, using
+    //  memory in registered buffer bufIndex.  A negative bufIndex means buf is ordinary
+    //  memory, for when the buffers could not be registered.  userData comes back with
+    //  the completion.  Returns false if the submission queue is full
+    bool QueueRead(unsigned fileIndex, int bufIndex, void *buf, uint32_t len,
+                   uint64_t off, uint64_t userData);
+    bool QueueWrite(unsigned fileIndex, int bufIndex, const void *buf, uint32_t len,
+                    uint64_t off, uint64_t userData);
+
+    // Hand everything queued to the kernel and wait until at least waitFor operations
+    //  have completed.  Returns 0 or an errno
+    int Submit(unsigned waitFor = 0);
+
+    // Take one completion off the ring.  res is the syscall style result: bytes moved
+    //  or -errno.  Returns false if there is nothing to take
+    bool Reap(uint64_t &userData, int32_t &res);
+
+    // Does this kernel let us create a ring at all.  Checked once and remembered
+    static bool Available();
+
+  private:
+    IOUring(const IOUring&) = delete;
+    IOUring &operator=(const IOUring&) = delete;
+
+    bool queue(uint8_t opcode, unsigned fileIndex, int bufIndex, const void *buf,
+               uint32_t len, uint64_t off, uint64_t userData);
+
+    int ringFd;
+    int error;
+    unsigned toSubmit;
+
+    // The mapped rings
+    void    *sqRing;
+    size_t   sqRingSize;
+    void    *cqRing;
+    size_t   cqRingSize;
+    void    *sqes;
+    size_t   sqesSize;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqEntries, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    void     *cqes;
+  };
+};
+
+#endif
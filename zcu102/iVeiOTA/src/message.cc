@@ -1,4 +1,8 @@
+#include <cstring>
+#include <unistd.h>
+
 #include "message.hh"
+#include "hash.hh"
 
 namespace iVeiOTA {
 
@@ -27,11 +31,20 @@ namespace iVeiOTA {
                           uint32_t pLen) :
     sync1(Message::sync1), sync2(Message::sync2), 
     rev(Message::DefaultRev), type(type), subType(subType),
-    imm{imm1, imm2, imm3, imm4}, pLen(pLen) {
+    imm{imm1, imm2, imm3, imm4}, pLen(pLen),
+    totalLen(pLen), requestId(0), offset(0), flags(0), payloadCrc(0) {
       // TODO: Calculate checksum
       checksum = 0;
     }
   
+  // CRC32C of a serialized header, taking its checksum field as 0
+  static uint32_t headerCrc(const uint8_t *buf, uint32_t len, uint32_t checksumAt) {
+    static const uint8_t zero[4] = {0, 0, 0, 0};
+    uint32_t crc = Crc32c(buf, checksumAt);
+    crc = Crc32c(zero, 4, crc);
+    return Crc32c(buf + checksumAt + 4, len - checksumAt - 4, crc);
+  }
+
   // Construct a header from a sequence of bytes
   // It is assumed that buffer holds an entire header if sync is true, 
   //  else buf holds an entire header minus the two sync bytes
@@ -50,7 +63,7 @@ namespace iVeiOTA {
     
     // Sanity check
     if(sync1 != Message::sync1 || sync2 != Message::sync2) throw "Invalid Message Sync";
-    if(rev   != Message::DefaultRev)                       throw "Invalid Message Revision";
+    if(rev < 1 || rev > Message::MaxRev)                   throw "Invalid Message Revision";
     
     // Sanity check passed, so parse stuff out
     type     = buf[i++];
@@ -60,39 +73,96 @@ namespace iVeiOTA {
     imm[2]   = ntohl(*(uint32_t*)(buf + i)); i+=4;
     imm[3]   = ntohl(*(uint32_t*)(buf + i)); i+=4;
     pLen     = ntohl(*(uint32_t*)(buf + i)); i+=4;
-    checksum = ntohl(*(uint32_t*)(buf + i)); i+=4;
+    payloadCrc = 0;
+    if(rev == 1) {
+      checksum  = ntohl(*(uint32_t*)(buf + i)); i+=4;
+      totalLen  = pLen;
+      requestId = 0;
+      offset    = 0;
+      flags     = 0;
+    } else {
+      checksum  = 0;
+      totalLen  = (uint64_t)ntohl(*(uint32_t*)(buf + i)) << 32; i+=4;
+      totalLen |= ntohl(*(uint32_t*)(buf + i));                 i+=4;
+      requestId = ntohl(*(uint32_t*)(buf + i));                 i+=4;
+      offset    = ntohl(*(uint32_t*)(buf + i));                 i+=4;
+      offset   |= (uint64_t)ntohs(*(uint16_t*)(buf + i)) << 32; i+=2;
+      flags     = ntohs(*(uint16_t*)(buf + i));                 i+=2;
+      if(offset + pLen > totalLen) throw "Fragment past the end of the payload";
+    }
+    if(rev >= 3) {
+      checksum   = ntohl(*(uint32_t*)(buf + i)); i+=4;
+      payloadCrc = ntohl(*(uint32_t*)(buf + i)); i+=4;
+    }
     
     // More sanity checks
     if(pLen > Message::MaxPayload) throw "Payload too large";
+    if(checksum != 0) {
+      // The checksum covers the sync too, which the parser may have already taken off
+      uint8_t whole[MaxSize];
+      uint32_t len = Size();
+      if(sync) {
+        memcpy(whole, buf, len);
+      } else {
+        memcpy(whole, Message::sync, SyncLength);
+        memcpy(whole + SyncLength, buf, len - SyncLength);
+      }
+      if(headerCrc(whole, len, ChecksumAt(rev)) != checksum) throw "Invalid header checksum";
+    }
   }
 
   // Convert this header to an array of bytes
   std::unique_ptr<uint8_t[]> Message::Header::ToByteArray() const {
+    uint8_t buf[MaxSize];
+    uint32_t headerLen = Serialize(buf);
+    if(headerLen == 0) return std::unique_ptr<uint8_t[]>(nullptr);
+    std::unique_ptr<uint8_t[]> ret(new uint8_t[headerLen]);
+    memcpy(ret.get(), buf, headerLen);
+    return ret;
+  }
+
+  uint32_t Message::Header::Serialize(uint8_t *_ret, bool withChecksum) const {
     // Make sure this is a header we can send
     // TODO: Should I check for all valid types here?  Then we have to keep it in
     //       sync every time we add/remove a message
-    if(type == 0 || subType == 0) return std::unique_ptr<uint8_t[]>(nullptr);
+    if(type == 0 || subType == 0) return 0;
 
-    // TODO: I cast this to a uint32_t*, so it has to be 4-byte aligned.
-    //       This has never been an issue, but it should be checked
-    int headerLen = Size(Message::DefaultRev);
-    std::unique_ptr<uint8_t[]> ret(new uint8_t[headerLen]);
-    uint8_t *_ret = ret.get();
+    uint32_t headerLen = Size();
+    if(headerLen == 0) return 0;
     
-    // Now to push everything into the buffer
+    // Now to push everything into the buffer.  memcpy, since buf doesn't have to be aligned
     int i = 0;
-    *(uint32_t*)(_ret + i) = htonl(sync1); i+= 4;
-    *(uint32_t*)(_ret + i) = htonl(sync2); i+= 4;
-    *(uint16_t*)(_ret + i) = htons(rev);   i+= 2;
-    ret[i++] = type;
-    ret[i++] = subType;
-    for(int j = 0; j < 4; j++) {
-      *(uint32_t*)(_ret + i) = htonl(imm[j]); i+= 4;
+    auto put32 = [&](uint32_t v) { v = htonl(v); memcpy(_ret + i, &v, 4); i += 4; };
+    auto put16 = [&](uint16_t v) { v = htons(v); memcpy(_ret + i, &v, 2); i += 2; };
+    put32(sync1);
+    put32(sync2);
+    put16(rev);
+    _ret[i++] = type;
+    _ret[i++] = subType;
+    for(int j = 0; j < 4; j++) put32(imm[j]);
+    put32(pLen);
+    if(rev == 1) {
+      put32(checksum);
+    } else {
+      put32(totalLen >> 32);
+      put32(totalLen & 0xFFFFFFFF);
+      put32(requestId);
+      put32(offset & 0xFFFFFFFF);
+      put16(offset >> 32);
+      put16(flags);
+    }
+    if(rev >= 3) {
+      put32(checksum);
+      put32(payloadCrc);
+    }
+
+    uint32_t checksumAt = ChecksumAt(rev);
+    if(withChecksum && checksumAt != 0) {
+      i = checksumAt;
+      put32(headerCrc(_ret, headerLen, checksumAt));
     }
-    *(uint32_t*)(_ret + i) = htonl(pLen);     i+= 4;
-    *(uint32_t*)(_ret + i) = htonl(checksum); i+= 4;
     
-    return ret;
+    return headerLen;
   }
   
   std::string Message::Header::toString() const {
@@ -107,6 +177,8 @@ namespace iVeiOTA {
     
     // Add in the immediate parameters
     ss << " (" << imm[0] << ")(" << imm[1] << ")(" << imm[2] << ")(" << imm[3] << ") : " << pLen;
+    if(flags & FlagFd) ss << " +fd";
+    if(!Whole()) ss << " [" << requestId << " @" << offset << " of " << totalLen << ((flags & FlagMore) ? " +]" : "]");
     
     // Extract and return the string
     return ss.str();
@@ -128,12 +200,21 @@ namespace iVeiOTA {
                    const std::vector<uint8_t> &payload) : 
     header(type, subType, i1, i2, i3, i4, payload.size()), payload(payload) {}
   
+  Message::PassedFd::~PassedFd() {
+    if(fd >= 0) close(fd);
+  }
+
+  std::string Message::PassedFd::Path() const {
+    return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+  }
+
   // Add len bytes from data to the payload
   void Message::AddPayload(uint8_t *data, int len) {
     for(int i = 0; i < len; i++) {
       payload.push_back(data[i]);
     }
     header.pLen = payload.size();
+    header.totalLen = header.pLen;
   }
 
   // Convert this message to a string
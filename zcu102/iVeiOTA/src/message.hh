@@ -20,6 +20,17 @@ namespace iVeiOTA {
       //! Management message type
       constexpr operator uint8_t() const {return  0x01;}
       //! Initialize the OTA system.  Currently this is done on boot and this command does nothing
+      /*!
+        imm[1] : The highest message protocol revision the client understands.  0 means 1
+        imm[2] : The checksums the server should add to what it sends (ChecksumHeader,
+                 ChecksumPayload).  Checksums that arrive are always checked
+
+        On receive:
+        imm[0] - 1 if the system was updated, 0 otherwise
+        imm[1] - The protocol revision the server will send from now on
+        imm[2] - The checksums the server will add, of those asked for that the revision has
+        imm[3] - The server version
+      */
       constexpr static uint8_t Initialize        = 0x01;
       //! Gets the boot status of the active (current) container
       /*!
@@ -64,8 +75,17 @@ namespace iVeiOTA {
       constexpr operator uint8_t() const {return  0x02;}
       //! Begin an update
       /*!
-        imm[0] : Where the manifest is stored.  0 - In the payload.  1 - On the filesystem
-        Payload: Either the manifest or a filesystem path based on imm[0]
+        imm[0] : Where the manifest is stored.  0 - In the payload.  1 - On the filesystem.
+                 2 - In the file passed with the message (a memfd works)
+        imm[1] : 1 to hash every chunk file before anything is changed.  The chunk files are
+                 <dir>/<ident>.  The ACK comes once the manifest is read, and the files
+                 are hashed while the state is 2 (initing), with an EventVerify for each.
+                 Chunks whose file isn't there are skipped, but if any file is bad, or no
+                 file is there at all, the update goes back to idle without anything
+                 changed, and UpdateStatus says why
+        Payload: Either the manifest or a filesystem path based on imm[0].  Nothing for 2
+        For imm[1] = 1 dir follows, after a null.  It defaults to the directory the
+        manifest is in for 1
       */
       constexpr static uint8_t BeginUpdate       = 0x01;
       //! Continue an interrupted update
@@ -74,11 +94,26 @@ namespace iVeiOTA {
       constexpr static uint8_t CancelUpdate      = 0x10;
       //! Process an update chunk
       /*!
-        imm[0] : Where the chunk data is stored.  0 - In the payload.  1 - On the filesystem
+        imm[0] : Where the chunk data is stored.  0 - In the payload.  1 - On the filesystem.
+                 2 - In the file passed with the message
         imm[1] : If imm[0] is 1, the offset in the payload where the data starts
-        imm[2] : If imm[0] is 1, the offset into the chunk where the data starts
+        imm[2] : If imm[0] is 0, the low 32 bits of the offset into the chunk where this data goes
+        imm[3] : If imm[0] is 0, the high 32 bits of that offset
         Payload: The chunk identifier as null-terminated string, followed by either
-        chunk data or the path to the chunk file
+        chunk data or the path to the chunk file.  Nothing follows the identifier for 2
+        A passed file is read from its start.  It can also be a pipe, for an image chunk that
+        is still being downloaded.  That is written as it is read, like streamed data
+        Only image chunks can have their data in the payload.  The data is sent as a series
+        of these messages, in order, and is written to the device as it arrives.  The chunk
+        is queued with the first piece and is done once all chunk size bytes have been sent.
+        Only one chunk can be streamed at a time.  A stream can start at 0, or at the last
+        checkpoint of an interrupted stream (the NACK for a wrong start says where that is)
+        The server stops reading the connection while the chunk's writer is behind, so
+        other clients are still answered.  A server that can't do that NACKs the data with
+        "Chunk stream busy" instead, and the same data should be sent again
+        The ACK means the chunk was queued.  Chunks can be sent without waiting for the
+        previous one to finish, up to the server's queue depth.  Past that the chunk is
+        NACKed with "Chunk queue full" and should be sent again once one has started
       */
       constexpr static uint8_t ProcessChunk      = 0x20;
       //! Finalize an update.  After this is called a reboot will booth into the updated container
@@ -116,28 +151,73 @@ namespace iVeiOTA {
         2 - Update is being initialized
         3 - Update is being prepared (containers being copied)
         4 - Update is ready
-        5 - Update is processing a chunk
+        5 - Update is processing chunks
         6 - All chunks have been processed
         imm[1] - 1 if all chunks passed successfully, 0 otherwise
-        Payload: The chunk that is currently being processed, if status == 5
+        imm[2] - 1 if the last update was dropped because its chunk files didn't verify
+        Payload: If status == 5, the identifiers of the chunks being processed or waiting
+                 to be, each null-terminated
+                 If imm[2] == 1, one null-terminated ident:result entry per chunk checked,
+                 with result as for EventVerify
       */
       constexpr static uint8_t UpdateStatus      = 0x10;
       //! Get status on the processing of the current chunk
       /*!
         imm[0] - The number of chunks needed for this update
 
-        Payload: 
+        Payload: One null-terminated entry per chunk, ident:status:order[:exit_code],
+                 followed by a final null.  status is
+                 0 - Not processed
+                 1 - Being processed
+                 2 - Processed successfully
+                 3 - Processing failed
+                 4 - Queued, waiting for a worker or for its device to be free
+                 order is 1 if the chunk has to be processed in order.  exit_code is
+                 only there for script chunks
       */
       constexpr static uint8_t ChunkStatus       = 0x20;
 
       //! Get the status of a single chunk
       constexpr static uint8_t SingleChunkStatus = 0x22;
+      //! Have the server push events to this connection instead of polling for status
+      /*!
+        imm[0] - Which events to send, 0 to stop.  A mask of the Event* values below
+        imm[1] - The least time between progress events for this connection, in ms.  0
+                 for the server's rate (option progress_interval)
+        Events stop when the connection closes
+      */
+      constexpr static uint8_t Subscribe         = 0x30;
+      //! An event pushed by the server to a subscribed connection.  Not sent by clients
+      /*!
+        imm[0] - Which event this is
+        EventState    : imm[1] - The new state, as imm[0] of UpdateStatus
+                        imm[2] - 1 if all chunks passed successfully, 0 otherwise
+        EventChunk    : imm[1] - 1 if the chunk was processed successfully, 0 otherwise
+                        imm[2] - The exit code, for script chunks
+        EventProgress : imm[1] - The low 32 bits of how many bytes of the chunk are written
+                        imm[2] - The high 32 bits of that
+                        imm[3] - How fast it is being written, in K per second
+        EventVerify   : imm[1] - How the chunk's file checked out (BeginUpdate imm[1])
+                                 0 - Verified
+                                 1 - Hash mismatch
+                                 2 - Could not be read
+                                 3 - Not there
+        Payload: The null-terminated chunk identifier for chunk, progress and verify events
+      */
+      constexpr static uint8_t Event             = 0x34;
+
+      constexpr static uint32_t EventState    = 0x01; // The update moved to another state
+      constexpr static uint32_t EventChunk    = 0x02; // A chunk has been processed
+      constexpr static uint32_t EventProgress = 0x04; // How far the writing of a chunk has got
+      constexpr static uint32_t EventVerify   = 0x08; // A chunk file has been checked
       std::string toString(uint8_t sub) {
         switch(sub) {
         case OTAStatus:         return "OTAStatus::OTAStatus";
         case UpdateStatus:      return "OTAStatus::UpdateStatus";
         case ChunkStatus:       return "OTAStatus::ChunkStatus";
         case SingleChunkStatus: return "OTAStatus::SingleChunkStatus";
+        case Subscribe:         return "OTAStatus::Subscribe";
+        case Event:             return "OTAStatus::Event";
         default:                return "OTAStatus::Invalid";
         }
       }
@@ -209,9 +289,35 @@ namespace iVeiOTA {
       23:20 - Immediate 3 value
       27:24 - Immediate 4 value
       31:28 - Payload Length
-      35:32 - Checksum (not currently used)
+      35:32 - Checksum.  CRC32C of the header with this field as 0.  0 if not checksummed
       
       A message will be a header followed by <Payload Length> bytes of payload.
+
+      Revision 2 headers are 52 bytes.  They let a message be split into fragments, so the
+      whole payload doesn't have to be in memory at once and can be larger than MaxPayload
+      03:00 - Sync1
+      07:04 - Sync2
+      09:08 - Message protocol revision (2)
+      10:10 - Message type
+      11:11 - Message sub type
+      27:12 - Immediate values 1-4
+      31:28 - Payload Length of this fragment
+      39:32 - Total payload length of the message (64 bits)
+      43:40 - Request ID.  The same for every fragment of a message
+      47:44 - Offset of this fragment in the payload (low 32 bits)
+      49:48 - Offset of this fragment in the payload (high 16 bits)
+      51:50 - Flags.  FlagMore (bit 0) is set on every fragment but the last.  FlagFd (bit 1)
+              is set if a file descriptor was passed (SCM_RIGHTS) along with the header
+      Every fragment repeats the type, sub type and immediate values.  There is no checksum
+      in a revision 2 header.  The server only sends revision 2 once it is agreed at
+      Initialize, but takes any revision from the client.  Passing a descriptor needs
+      revision 2 or later
+
+      Revision 3 headers are 60 bytes.  They are revision 2 headers with checksums on the end
+      51:00 - As revision 2.  FlagPayloadCrc (bit 2) is set if 59:56 is valid
+      55:52 - Checksum.  CRC32C of the header with this field as 0.  0 if not checksummed
+      59:56 - CRC32C of this fragment's payload
+      A header or payload whose checksum doesn't match is dropped
     */
     struct Header {
       uint32_t sync1;         // 'i' 'V' 'e' 'i' :: 0x 69 56 65 69
@@ -222,9 +328,28 @@ namespace iVeiOTA {
       uint32_t imm[4];        // 16 bytes (4 integers) of immediate data
       uint32_t pLen;          // Length of payload (in bytes)
       uint32_t checksum;      // Checksum of header
-      
-      static uint32_t Size(uint16_t rev) {return 36;} // Header is 36 bytes large for rev 1
-      uint32_t Size() const { return 36;} // Need to base this on the header rev
+
+      // Revision 2 only.  For a revision 1 header the message is a single fragment
+      uint64_t totalLen;      // Length of the whole payload, over all the fragments
+      uint32_t requestId;     // Ties fragments of one message together
+      uint64_t offset;        // Where this fragment's payload goes in the whole payload
+      uint16_t flags;         // FlagMore
+      uint32_t payloadCrc;    // Revision 3 only.  CRC32C of this fragment's payload
+
+      constexpr static uint16_t FlagMore = 0x0001; // More fragments of this message follow
+      constexpr static uint16_t FlagFd   = 0x0002; // A file descriptor came with this header
+      constexpr static uint16_t FlagPayloadCrc = 0x0004; // payloadCrc is valid
+
+      // Header is 36 bytes large for rev 1, 52 bytes for rev 2, 60 for rev 3.  0 for
+      //  revisions we don't know
+      static uint32_t Size(uint16_t rev) { return (rev == 1) ? 36 : (rev == 2) ? 52 : (rev == 3) ? 60 : 0; }
+      uint32_t Size() const { return Size(rev); }
+      constexpr static uint32_t MaxSize = 60;
+      // Where the header checksum is in a header of revision rev, 0 if there isn't one
+      static uint32_t ChecksumAt(uint16_t rev) { return (rev == 1) ? 32 : (rev == 3) ? 52 : 0; }
+
+      // True if this is the whole message, not one fragment of it
+      bool Whole() const { return offset == 0 && (flags & FlagMore) == 0; }
       
       explicit Header();
       
@@ -236,16 +361,57 @@ namespace iVeiOTA {
                       uint32_t pLen);
       
       // It is assumed that buffer holds an entire header if sync is true, 
-      //  else buf holds an entire header minus the two sync bytes
+      //  else buf holds an entire header minus the two sync bytes.  Throws if the header
+      //  isn't valid, or has a checksum that doesn't match
       explicit Header(const uint8_t *buf, bool sync = true);
       
       std::unique_ptr<uint8_t[]> ToByteArray() const;
+      // Write the header into buf, which must hold MaxSize bytes.  Returns how many bytes
+      //  it took, or 0 if this isn't a header we can send.  With checksum the header's
+      //  checksum is filled in, if its revision has one
+      uint32_t Serialize(uint8_t *buf, bool checksum = false) const;
       
       std::string toString() const;      
     }; // End Header class
     
+    //! A file descriptor passed along with a message
+    /*!
+      Closed once the last message holding it lets go, so a chunk that is being worked on
+      keeps its file open after the message is gone
+    */
+    class PassedFd {
+    public:
+      explicit PassedFd(int fd) : fd(fd) {}
+      ~PassedFd();
+      int Get() const { return fd; }
+      // A path that opens the same file, for code that works with paths.  It works for
+      //  commands we run too, even though they don't get the descriptor itself
+      std::string Path() const;
+    private:
+      PassedFd(const PassedFd&) = delete;
+      PassedFd &operator=(const PassedFd&) = delete;
+      int fd;
+    };
+
+    //! Takes the payload of a message as it comes off the socket
+    /*!
+      Instead of the whole payload being collected in the message first.  The message still
+      goes to the callback once all of it has arrived, with no payload and the sink attached
+    */
+    class PayloadSink {
+    public:
+      virtual ~PayloadSink() {}
+      // The next len bytes of the payload.  Return false to have the rest thrown away
+      virtual bool Write(const uint8_t *data, size_t len) = 0;
+      // The payload was bad (its checksum didn't match), so the message is being dropped
+      virtual void Abort() {}
+    };
+
     Header        header;
     std::vector<uint8_t> payload;
+    std::shared_ptr<PassedFd> fd;   // Not part of the data.  Sent and received with SCM_RIGHTS
+    uint32_t connection = 0;        // Not part of the data.  Which client it came from (server only)
+    std::shared_ptr<PayloadSink> sink; // Not part of the data.  Where the payload went, if not payload
     
     const static uint8_t sync[];// = {0x69, 0x56, 0x65, 0x69, 0x4f, 0x54, 0x41, 0x00};
     const static uint32_t sync1;// = sync[0];
@@ -253,7 +419,15 @@ namespace iVeiOTA {
     const static uint8_t SyncLength = 8;
     
     const static uint16_t DefaultRev = 1;
-    const static uint32_t MaxPayload = 1024 * 1024 * 16; // 16M to start
+    const static uint16_t MaxRev     = 3;
+
+    // Checksums a connection can agree to add to what it sends (Initialize imm[2])
+    const static uint32_t ChecksumHeader  = 0x1; // Revisions 1 and 3
+    const static uint32_t ChecksumPayload = 0x2; // Revision 3
+    static uint32_t Checksums(uint16_t rev) {
+      return (rev == 1) ? ChecksumHeader : (rev >= 3) ? (ChecksumHeader | ChecksumPayload) : 0;
+    }
+    const static uint32_t MaxPayload = 1024 * 1024 * 16; // 16M to start.  Per fragment for rev 2
 
     static inline std::unique_ptr<Message> MakeACK(const Message &m) {
         return std::unique_ptr<Message>(new Message(Management, Management.ACK, 
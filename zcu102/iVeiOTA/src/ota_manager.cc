@@ -11,11 +11,15 @@
 #include <array>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <atomic>
 
 #include "ota_manager.hh"
 #include "config.hh"
 #include "debug.hh"
 #include "support.hh"
+#include "delta.hh"
 
 namespace iVeiOTA {
   // These threads are targets for pthread functions.  They may not be needed anymore
@@ -23,18 +27,22 @@ namespace iVeiOTA {
     OTAManager *manager = (OTAManager*)data;
     manager->initUpdateFunction();
     manager->joinCopyThread = true;
+    manager->wakeEvent.Signal();
     return nullptr;
   }
-  void* ProcessThreadFunction(void *data) {
+
+  void* VerifyThreadFunction(void *data) {
     OTAManager *manager = (OTAManager*)data;
-    manager->processChunk();
-    manager->joinProcessThread = true;
+    manager->verifyAll();
+    manager->joinVerifyThread = true;
+    manager->wakeEvent.Signal();
     return nullptr;
   }
 
   // Extract the chunk type based on the (string) name
   OTAManager::ChunkType OTAManager::GetChunkType(const std::string &name) {
         if(name == "image")        return ChunkType::Image;
+        else if(name == "delta")   return ChunkType::Delta;
         else if(name == "file")    return ChunkType::File;
         else if(name == "script")  return ChunkType::Script;
         else if(name == "archive") return ChunkType::Archive;
@@ -43,22 +51,71 @@ namespace iVeiOTA {
         else                       return ChunkType::Unknown;
     }
 
-  OTAManager::OTAManager(UBootManager &bootMgr) : bootMgr(bootMgr) {
+  // How often image chunks are checkpointed.  A multiple of 1M so the pieces stay aligned
+  //  for O_DIRECT
+  static uint64_t checkpointInterval() {
+    uint64_t interval = std::max<int64_t>(config.GetOptionInt("checkpoint_interval", 64 * 1024 * 1024), 0);
+    return interval - interval % (1024 * 1024);
+  }
+
+  OTAManager::WakeEvent::WakeEvent() {
+    fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(fd < 0) debug << Debug::Mode::Failure << "Could not create the wake event" << std::endl;
+  }
+
+  OTAManager::WakeEvent::~WakeEvent() {
+    if(fd >= 0) close(fd);
+  }
+
+  void OTAManager::WakeEvent::Signal() {
+    uint64_t one = 1;
+    if(fd >= 0 && write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      debug << Debug::Mode::Err << "Could not signal the wake event" << std::endl;
+    }
+  }
+
+  void OTAManager::WakeEvent::Clear() {
+    uint64_t count;
+    if(fd >= 0 && read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      debug << Debug::Mode::Err << "Could not clear the wake event" << std::endl;
+    }
+  }
+
+  OTAManager::OTAManager(UBootManager &bootMgr) :
+    written(std::string(IVEIOTA_CACHE_LOCATION) + "/written"),
+    queueDepth(std::max<int64_t>(config.GetOptionInt("chunk_queue_depth", 4), 1)),
+    hashAhead(config.GetOptionInt("hash_ahead", 1) != 0), verifier(1),
+    scheduler(config.GetOptionInt("chunk_workers", 2)), bootMgr(bootMgr) {
     // Set our internal state to default to no update in progress and not doing anything
-    processingChunk = false;
     maxIdentLength = 0;
     chunks.clear();
     state = OTAState::Idle;
 
     // Our threads are idle
     copyThread = -1;
-    processThread = -1;
     joinCopyThread = false;
-    joinProcessThread = false;
+    verifyThread = -1;
+    joinVerifyThread = false;
+    verifyFailed = false;
+
+    // No chunk is being streamed
+    streamRequest = 0;
+    failedRequest = 0;
+    streamBase = 0;
+    streamDataStart = 0;
+    pausedConnection = 0;
 
     // We have no update in progress, so no update to cancel
     cancelUpdate = false;
 
+    // Subscribers hear about the state once it changes from this
+    reportedStatus = 0;
+    reportedPassed = 0;
+
+    // Whenever a worker finishes, Process() may have a state change to make
+    verifier.OnFinished([this]() { wakeEvent.Signal(); });
+    scheduler.OnFinished([this]() { wakeEvent.Signal(); });
+
     // Then we need to look and see if there is an upate currently in progress and,
     //  if so, try and restore it
     bool manifestValid = false;
@@ -93,6 +150,8 @@ namespace iVeiOTA {
         // A line in the journal is <ident:state> for each chunk that is processed
         //  state is:
         //    1 - succeeded
+        //    c - an image chunk checkpoint, <ident:c:offset:hash_state>.  The chunk isn't
+        //        done but offset bytes of it are on the device.  The last one counts
         //    anything else - failed
         //  We don't need to keep not processed information, because things only go
         //  into the journal when they are processed
@@ -108,7 +167,12 @@ namespace iVeiOTA {
                                       [&toks](const ChunkInfo &x) { return x.ident == toks[0];});
             if(chunk != chunks.end()) {
               // It was in the manifest
-              if(toks[1] == "1") {
+              if(toks[1] == "c") {
+                if(toks.size() >= 3 && chunk->type == ChunkType::Image) {
+                  chunk->resume.offset    = strtoull(toks[2].c_str(), 0, 10);
+                  chunk->resume.hashState = (toks.size() >= 4) ? toks[3] : "";
+                }
+              } else if(toks[1] == "1") {
                 chunk->processed = true;
                 chunk->succeeded = true;
               } else {
@@ -184,15 +248,30 @@ namespace iVeiOTA {
         debug << "State => initing" << std::endl;
         state = OTAState::Initing;
 
+        // Anything after a null in the payload is where the chunk files are, for verifying
+        std::string payload(message.payload.begin(), message.payload.end());
+        std::string chunkDir;
+        size_t end = payload.find('\0');
+        if(end != std::string::npos) {
+          chunkDir = payload.substr(end + 1);
+          chunkDir = chunkDir.substr(0, chunkDir.find('\0'));
+          payload.resize(end);
+        }
+        if(message.header.imm[0] == 2) chunkDir = payload;
+
         // Otherwise, we have to process the provided manifest
         std::string manifest;
         if(message.header.imm[0] == 0) {
           // Manifest is in the payload
           // TODO: This has not been tested
-          manifest.assign(message.payload.begin(), message.payload.end());
+          manifest = payload;
         } else if(message.header.imm[0] == 1) {
           // Manifest is on the filesystem and payload contains the path
-          std::string path(message.payload.begin(), message.payload.end());
+          std::string path = payload;
+          if(chunkDir.empty()) {
+            size_t slash = path.rfind('/');
+            chunkDir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+          }
           debug << "Manifest path: " << path << std::endl;
           try {
             // Read all the manifest data into a string for processing
@@ -205,6 +284,13 @@ namespace iVeiOTA {
             manifest = "";
             ret.push_back(Message::MakeNACK(message, 0, "Invalid Manifest Path"));
           }
+        } else if(message.header.imm[0] == 2) {
+          // Manifest is in a file the client passed us.  Read one byte past the limit so
+          //  a manifest that is too large gets caught below
+          if(!message.fd || !ReadDescriptor(message.fd->Get(), manifest, 1024*10)) {
+            debug << "Failed to read manifest from the passed file" << std::endl;
+            manifest = "";
+          }
         }
 
         // If we managed to make a manifest out of that, then process it
@@ -214,8 +300,19 @@ namespace iVeiOTA {
            manifest.length() < 1024*10) {
           if(processManifest(manifest)) {
             // If we are here, then we have a proper manifest and can continue with the update
-
-            {
+            verifyFailed = false;
+            if(message.header.imm[1] == 1) {
+              // The client wants the chunks checked first.  That takes a while, so it runs
+              //  on its own thread while we stay initing, and Process() prepares once it passes
+              if(startVerify(chunkDir)) {
+                ret.push_back(Message::MakeACK(message));
+              } else {
+                debug << "Could not verify: state -> idle" << std::endl;
+                dropManifest();
+                state = OTAState::Idle;
+                ret.push_back(Message::MakeNACK(message, 0, "Could not verify chunks"));
+              }
+            } else {
               debug << "state -> preparing" << std::endl;
               state = OTAState::Preparing;
               if(prepareForUpdate()) {
@@ -290,7 +387,18 @@ namespace iVeiOTA {
     {
       debug << "Got process chunk message" << std::endl;
       if(state != OTAState::InitDone) {
-        ret.push_back(Message::MakeNACK(message, 0, "Cannot process chunk now"));
+        // Only answer a fragmented message once
+        if(message.header.Whole() || !(message.header.flags & Message::Header::FlagMore)) {
+          ret.push_back(Message::MakeNACK(message, 0, "Cannot process chunk now"));
+        }
+      } else if(message.sink) {
+        // The chunk data has already gone to the stream, straight off the socket
+        std::unique_ptr<Message> resp = finishSink(message);
+        if(resp) ret.push_back(std::move(resp));
+      } else if(message.header.offset > 0) {
+        // The rest of a chunk's data, after the fragment with the identifier
+        std::unique_ptr<Message> resp = processChunkFragment(message);
+        if(resp) ret.push_back(std::move(resp));
       } else {
         // First we have to get the identifier out of the payload
         std::string ident = "";
@@ -308,28 +416,37 @@ namespace iVeiOTA {
         if(identEnd >= message.payload.size() || message.payload[identEnd] != '\0') {
           debug << Debug::Mode::Warn << "Malformed chunk message" << std::endl;
           ret.push_back(Message::MakeNACK(message, 0, "Malformed process message"));
+        } else if(message.header.imm[0] == 0) {
+          // payload contains a piece of the chunk data
+          uint64_t at = message.header.imm[2] | ((uint64_t)message.header.imm[3] << 32);
+          std::unique_ptr<Message> resp = processChunkData(message, ident, identEnd + 1, at);
+          if(!message.header.Whole()) {
+            // The first of many fragments.  Only answer now if something went wrong
+            streamRequest   = requestKey(message);
+            streamBase      = at;
+            streamDataStart = identEnd + 1;
+            if(resp->header.subType == Message::Management.NACK) failedRequest = requestKey(message);
+            else resp.reset();
+          }
+          if(resp) ret.push_back(std::move(resp));
+        } else if(!message.header.Whole()) {
+          ret.push_back(Message::MakeNACK(message, 0, "Only chunk data can be fragmented"));
         } else {
           // Valid Chunk identifier, check to see if it is in our list
+          std::lock_guard<std::mutex> guard(chunkLock);
           auto chunk = std::find_if(chunks.begin(), chunks.end(),
                                     [&ident](const ChunkInfo &x) { return x.ident == ident;});
-          if(chunk != chunks.end()) {
-            // Found it, so indicate that we are processing it
-            whichChunk = chunk->ident;
-            processingChunk = true;
-
+          unsigned queued = std::count_if(chunks.begin(), chunks.end(), [](const ChunkInfo &x) { return x.queued;});
+          if(chunk != chunks.end() && (chunk->queued || chunk->running)) {
+            debug << Debug::Mode::Warn << "Chunk " << ident << " is already being processed" << std::endl;
+            ret.push_back(Message::MakeNACK(message, 0, "Chunk already being processed"));
+          } else if(chunk != chunks.end() && queued >= queueDepth) {
+            // The client should wait for a chunk to start and send this one again
+            debug << Debug::Mode::Info << "Chunk queue is full, " << queued << " chunks waiting" << std::endl;
+            ret.push_back(Message::MakeNACK(message, 0, "Chunk queue full"));
+          } else if(chunk != chunks.end()) {
             // We should process this chunk, so first extract the path to the data
-            if(message.header.imm[0] == 0) {
-              // TODO: Implement chunk data in message payload
-              // payload contains the chunk data
-              debug << Debug::Mode::Err << "Chunk data in payload not yet supported" << std::endl;
-              ret.push_back(Message::MakeNACK(message, 0, "Chunk data in payload not implemented"));
-
-              // Mark this as failed for now
-              chunk->processed = true;
-              chunk->succeeded = false;
-              whichChunk = "";
-              processingChunk = false;
-            } else if(message.header.imm[0] == 1) {
+            if(message.header.imm[0] == 1) {
               // payload contains the path to the chunk data, but may have null terminators
 
               // Get past the null terminator
@@ -340,27 +457,37 @@ namespace iVeiOTA {
               // Get the string that is the path to the file, then send it for processing
               std::string path(message.payload.begin() + identEnd, itEnd);
               debug << "Chunk path " << path << std::endl;
-              intChunkPath = path;
-
-              // TODO: Investigate this
-              // We need to increase the stack size for the processing thread.  For some reason the
-              //  CopyFileData function (or the function that calls it) overflows the 1M stack
-              // Increasing it to 4M seems to be plently, but overflowing a 1M stack is surprising
-              //  1M is a lot of stack space, so something seems odd here
-              size_t stacksize;
-              pthread_attr_t attr;
-              pthread_attr_init(&attr);
-              pthread_attr_getstacksize(&attr, &stacksize);
-              debug << "Setting process stack size: " << pthread_attr_setstacksize(&attr, stacksize * 4) << " ** " << std::endl;
-              pthread_attr_getstacksize(&attr, &stacksize);
-              debug << "Stack process size is " << stacksize << std::endl;
-
-              // Create the thread and start running it
-              if(pthread_create(&processThread, &attr, &ProcessThreadFunction, (void*)this) == 0) {
+
+              // The ACK only means the chunk is queued.  Its progress shows up in the status messages
+              if(queueChunk(*chunk, path)) {
                 ret.push_back(Message::MakeACK(message));
               } else {
-                debug << Debug::Mode::Failure << "Could not create copy thread" << std::endl;
-                ret.push_back(Message::MakeNACK(message, 0, "Could not create copy thread"));
+                debug << Debug::Mode::Failure << "Could not queue chunk" << std::endl;
+                ret.push_back(Message::MakeNACK(message, 0, "Could not queue chunk"));
+              }
+            } else if(message.header.imm[0] == 2) {
+              // The chunk data is in a file the client passed us
+              struct stat ss;
+              bool queued = false;
+              if(!message.fd || fstat(message.fd->Get(), &ss) != 0) {
+                debug << Debug::Mode::Warn << "No file passed with chunk " << ident << std::endl;
+                ret.push_back(Message::MakeNACK(message, 0, "No file passed"));
+              } else if(S_ISREG(ss.st_mode)) {
+                // Anything that wants a path can open it again through /proc
+                queued = queueChunk(*chunk, message.fd->Path(), message.fd);
+              } else if(chunk->type == ChunkType::Image) {
+                // Most likely a pipe from a download that is still going.  That can only be
+                //  read once, so the image is hashed and written as it is read
+                queued = queuePipe(*chunk, message.fd);
+              } else {
+                ret.push_back(Message::MakeNACK(message, 0, "Only image chunks can be read from a pipe"));
+              }
+
+              if(queued) {
+                ret.push_back(Message::MakeACK(message));
+              } else if(ret.empty()) {
+                debug << Debug::Mode::Failure << "Could not queue chunk" << std::endl;
+                ret.push_back(Message::MakeNACK(message, 0, "Could not queue chunk"));
               }
             } else {
               debug << Debug::Mode::Warn << "Invalid chunk data location" << std::endl;
@@ -443,6 +570,20 @@ namespace iVeiOTA {
 
   // Process a status message.  A status message is read-only and just gets information from
   //  the OTA server
+  uint32_t OTAManager::updateStatus(bool inFlight) const {
+    switch(state) {
+    case OTAState::Idle:            return 0;
+    case OTAState::UpdateAvailable: return 1;
+    case OTAState::Initing:         return 2;
+    case OTAState::Preparing:       return 3;
+    case OTAState::Canceling:       return 3; // Canceling will count as preparing - TODO: Revisit this...
+    case OTAState::InitDone:        return inFlight ? 5 : 4;
+    case OTAState::AllDone:         return 6;
+    case OTAState::AllDoneFailed:   return 6;
+    }
+    return 0;
+  }
+
   std::vector<std::unique_ptr<Message>> OTAManager::processStatusMessage(const Message &message) {
     std::vector<std::unique_ptr<Message>> ret;
 
@@ -455,32 +596,35 @@ namespace iVeiOTA {
     switch(message.header.subType) {
     case Message::OTAStatus.UpdateStatus:
     {
-      uint32_t status = 0;
-      switch(state) {
-      case OTAState::Idle:            status = 0; break;
-      case OTAState::UpdateAvailable: status = 1; break;
-      case OTAState::Initing:         status = 2; break;
-      case OTAState::Preparing:       status = 3; break;
-      case OTAState::Canceling:       status = 3; break; // Canceling will count as preparing - TODO: Revisit this...
-      case OTAState::InitDone:
-        if(!processingChunk) {
-          status = 4;
-        } else {
-          status = 5;
+      // Every chunk that is queued or running, in manifest order
+      std::vector<uint8_t> inFlight;
+      {
+        std::lock_guard<std::mutex> guard(chunkLock);
+        for(const ChunkInfo &chunk : chunks) {
+          if(!chunk.queued && !chunk.running) continue;
+          std::copy(chunk.ident.begin(), chunk.ident.end(), std::back_inserter(inFlight));
+          inFlight.push_back('\0');
         }
-        break;
-      case OTAState::AllDone:         status = 6; break;
-      case OTAState::AllDoneFailed:   status = 6; break;
       }
 
+      uint32_t status = updateStatus(!inFlight.empty());
+
       uint32_t allPassed = (state == OTAState::AllDone)?1:0;
 
       if(status == 5) {
-        // Put which chunk we are processing into the payload
-        std::vector<uint8_t> payload(whichChunk.begin(), whichChunk.end());
-        payload.push_back('\0');
+        // Put which chunks we are processing into the payload
         ret.push_back(std::unique_ptr<Message>(new Message(Message::OTAStatus, Message::OTAStatus.UpdateStatus,
-                                                           status, 0, 0, 0, payload)));
+                                                           status, 0, 0, 0, inFlight)));
+      } else if(status == 0 && verifyFailed) {
+        // Say why the last update was dropped, chunk by chunk
+        std::vector<uint8_t> results;
+        for(const VerifyCheck &check : verifyChecks) {
+          std::string entry = check.ident + ":" + std::to_string(static_cast<uint32_t>(check.result));
+          std::copy(entry.begin(), entry.end(), std::back_inserter(results));
+          results.push_back('\0');
+        }
+        ret.push_back(std::unique_ptr<Message>(new Message(Message::OTAStatus, Message::OTAStatus.UpdateStatus,
+                                                           status, 0, 1, 0, results)));
       } else {
         // Else the payload is empty
         ret.push_back(std::unique_ptr<Message>(new Message(Message::OTAStatus, Message::OTAStatus.UpdateStatus,
@@ -489,16 +633,33 @@ namespace iVeiOTA {
     }
     break;
 
+    case Message::OTAStatus.Subscribe:
+    {
+      if(message.header.imm[0] == 0) {
+        subscribers.erase(message.connection);
+      } else {
+        Subscriber &sub = subscribers[message.connection];
+        sub.mask         = message.header.imm[0];
+        sub.interval     = std::chrono::milliseconds(message.header.imm[1]);
+        sub.lastProgress = std::chrono::steady_clock::time_point();
+      }
+      debug << "Connection " << message.connection << " subscribed to events " << message.header.imm[0] << std::endl;
+      ret.push_back(Message::MakeACK(message));
+    }
+    break;
+
     case Message::OTAStatus.ChunkStatus:
     {
       debug << "Chunk status message" << std::endl;
       std::vector<uint8_t> payload;
-      for(auto chunk : chunks) {
+      std::lock_guard<std::mutex> guard(chunkLock);
+      for(const ChunkInfo &chunk : chunks) {
         // Identifier first
         std::copy(chunk.ident.begin(), chunk.ident.end(), std::back_inserter(payload));
         payload.push_back(':');
         // Then the current status of this chunk
-        if(chunk.ident == whichChunk) payload.push_back('1');
+        if(chunk.running) payload.push_back('1');
+        else if(chunk.queued) payload.push_back('4');
         else if(chunk.processed &&  chunk.succeeded) payload.push_back('2');
         else if(chunk.processed && !chunk.succeeded) payload.push_back('3');
         else payload.push_back('0');
@@ -542,7 +703,10 @@ namespace iVeiOTA {
       std::string src = config.GetDevice(Container::Active, Partition::BootInfo);
       std::string dest = config.GetDevice(Container::Alternate, Partition::BootInfo);
       debug << "Copying file " << src << " to " << dest << std::endl;
-      CopyFileData(dest, src, 0, 0, &cancelUpdate);
+      CopyStats stats;
+      written.Forget(dest);
+      ClonePartition(dest, src, &cancelUpdate, &stats);
+      debug << Debug::Mode::Info << "Cloned BootInfo using " << iVeiOTA::ToString(stats.method) << std::endl;
 
       debug << "Setting alternate validity to false after copying BI partition" << std::endl;
       bootMgr.SetValidity(Container::Alternate, false);
@@ -552,14 +716,20 @@ namespace iVeiOTA {
       debug << "starting to copy Root" << std::endl;
       std::string src = config.GetDevice(Container::Active, Partition::Root);
       std::string dest = config.GetDevice(Container::Alternate, Partition::Root);
-      CopyFileData(dest, src, 0, 0, &cancelUpdate);
+      CopyStats stats;
+      written.Forget(dest);
+      ClonePartition(dest, src, &cancelUpdate, &stats);
+      debug << Debug::Mode::Info << "Cloned Root using " << iVeiOTA::ToString(stats.method) << std::endl;
     }
 
     if(copySystem) {
       debug << "starting to copy System" << std::endl;
       std::string src = config.GetDevice(Container::Active, Partition::System);
       std::string dest = config.GetDevice(Container::Alternate, Partition::System);
-      CopyFileData(dest, src, 0, 0, &cancelUpdate);
+      CopyStats stats;
+      written.Forget(dest);
+      ClonePartition(dest, src, &cancelUpdate, &stats);
+      debug << Debug::Mode::Info << "Cloned System using " << iVeiOTA::ToString(stats.method) << std::endl;
     }
 
     // Then we have to clear the cache
@@ -569,6 +739,7 @@ namespace iVeiOTA {
       if(cache.length() > 1) {
         // Make sure we have something to try and mount
         // TODO: Should add more checks here.  This can be very destructure
+        written.Forget(cache);
         Mount mount(cache, IVEIOTA_MNT_POINT);
         if(mount.IsMounted()) {
           // TODO: Really need to make sure this always works
@@ -638,7 +809,7 @@ namespace iVeiOTA {
 
     for(auto chunk: chunks) {
       bool copy = true;
-      if(chunk.type == ChunkType::Image) {
+      if(chunk.type == ChunkType::Image || chunk.type == ChunkType::Delta) {
         copy = false;
       } else if(chunk.type == ChunkType::Archive && chunk.complete == true) {
         copy = false;
@@ -676,43 +847,462 @@ namespace iVeiOTA {
     return ret == 0;
   }
 
-  void OTAManager::processChunk() {
-    // Find the chunk we are supposed to process first
-    std::string ident = this->whichChunk;
+  bool OTAManager::chunkKeys(const ChunkInfo &chunk, std::set<std::string> &keys) {
+    // Chunks that write to the same flash part are kept in order, and everything that gets
+    //  mounted shares the one mount point
+    if(chunk.dest != Partition::None &&
+       (chunk.type == ChunkType::Image || chunk.type == ChunkType::Delta ||
+        chunk.type == ChunkType::Archive || chunk.type == ChunkType::File)) {
+      std::string device = GetPhysicalDevice(config.GetDevice(Container::Alternate, chunk.dest));
+      if(device.length() > 0) keys.insert(device);
+    }
+    if(chunk.type == ChunkType::Archive || chunk.type == ChunkType::File) keys.insert(IVEIOTA_MNT_POINT);
+
+    // We can't know what a script touches, and chunks with an order have to see everything
+    //  before them done, so those run on their own
+    return chunk.orderMatters || chunk.type == ChunkType::Script;
+  }
+
+  bool OTAManager::queueChunk(ChunkInfo &chunk, const std::string &path, std::shared_ptr<Message::PassedFd> fd) {
+    std::set<std::string> keys;
+    bool exclusive = chunkKeys(chunk, keys);
+
+    // Hash the chunk file now, so the worker only has to write it.  The verifier reads one
+    //  file at a time to leave the storage to the workers
+    std::shared_future<std::string> verified;
+    if(hashAhead && chunk.hashType != HashAlgorithm::None && !fusedHash(chunk, path)) {
+      auto hashed = std::make_shared<std::promise<std::string>>();
+      HashAlgorithm hashType = chunk.hashType;
+      if(verifier.Submit(std::set<std::string>(), false, [this, hashed, hashType, path, fd]() {
+            hashed->set_value(cancelUpdate ? "" : GetHashValue(hashType, path));
+          })) {
+        verified = hashed->get_future().share();
+      }
+    }
+
+    std::string ident = chunk.ident;
+    chunk.queued = true;
+    // The jobs hold on to fd, if there is one, so path stays good until they are done
+    if(!scheduler.Submit(keys, exclusive, [this, ident, path, verified, fd]() { processChunk(ident, path, verified); })) {
+      chunk.queued = false;
+      return false;
+    }
+
+    debug << "Queued chunk " << ident << (exclusive ? " to run alone" : "") << " on";
+    for(const std::string &key : keys) debug << " " << key;
+    debug << std::endl;
+    return true;
+  }
+
+  void OTAManager::processChunk(const std::string &ident, const std::string &path,
+                                std::shared_future<std::string> verified) {
+    // Work on a copy so the lock isn't held while the chunk is written
+    ChunkInfo chunk;
+    {
+      std::lock_guard<std::mutex> guard(chunkLock);
+      auto it = std::find_if(chunks.begin(), chunks.end(), [&ident](const ChunkInfo &x) { return x.ident == ident;});
+      if(it == chunks.end()) {
+        debug << "Didn't find the chunk: " << ident << std::endl;
+        return;
+      }
+      it->queued  = false;
+      it->running = true;
+      chunk = *it;
+    }
+
+    debug << "Processing chunk: " << ident << std::endl;
+    int exitCode = 0;
+    bool success = !cancelUpdate && processChunkFile(chunk, path, exitCode, verified);
+    finishChunk(ident, success, exitCode);
+  }
+
+  void OTAManager::finishChunk(const std::string &ident, bool success, int exitCode) {
+    {
+      std::lock_guard<std::mutex> guard(chunkLock);
+      auto it = std::find_if(chunks.begin(), chunks.end(), [&ident](const ChunkInfo &x) { return x.ident == ident;});
+      if(it != chunks.end()) {
+        it->running   = false;
+        it->processed = true;
+        it->succeeded = success;
+        it->resume    = CopyCheckpoint();
+        if(it->type == ChunkType::Script) it->exitCode = exitCode;
+      }
+    }
+
+    std::vector<uint8_t> payload(ident.begin(), ident.end());
+    payload.push_back('\0');
+    postEvent(Message(Message::OTAStatus, Message::OTAStatus.Event, Message::OTAStatus.EventChunk,
+                      success ? 1 : 0, exitCode, 0, payload));
+
+    try {
+      std::lock_guard<std::mutex> guard(journalLock);
+      debug << "Succeeded in processing chunk: " << ident << std::endl;
+      std::ofstream journal(std::string(IVEIOTA_CACHE_LOCATION) + "/journal", std::ios::out | std::ios::app);
+      RunCommand("sync"); // We also have to sync the filesystem so we can reboot
+      journal << ident << ":" << (success ? "1" : "2") << std::endl;
+    } catch(...) {
+      //TODO: Implement logging
+      // Failed to write to the journal -- can't resume a failed update
+      debug << Debug::Mode::Failure << "Failed to write to the journal" << std::endl;
+    }
+  }
+
+  std::unique_ptr<Message> OTAManager::processChunkFragment(const Message &message) {
+    bool last = !(message.header.flags & Message::Header::FlagMore);
+    if(requestKey(message) == failedRequest) return nullptr;
+    if(requestKey(message) != streamRequest || !stream) {
+      debug << Debug::Mode::Warn << "Fragment of an unknown chunk message " << message.header.toString() << std::endl;
+      failedRequest = requestKey(message);
+      return Message::MakeNACK(message, 0, "Fragment of an unknown chunk message");
+    }
+
+    uint64_t at = streamBase + message.header.offset - streamDataStart;
+    std::unique_ptr<Message> resp = processChunkData(message, streamIdent, 0, at);
+    if(resp->header.subType == Message::Management.NACK) {
+      failedRequest = requestKey(message);
+      return resp;
+    }
+    if(last) streamRequest = 0;
+    return last ? std::move(resp) : nullptr;
+  }
+
+  std::unique_ptr<Message> OTAManager::processChunkData(const Message &message, const std::string &ident,
+                                                       unsigned int dataStart, uint64_t at) {
+    std::string error = openStream(ident, at);
+    if(error.empty()) {
+      std::vector<uint8_t> data(message.payload.begin() + dataStart, message.payload.end());
+      error = pushStream(std::move(data), at, message.connection);
+    }
+    return error.empty() ? Message::MakeACK(message) : Message::MakeNACK(message, 0, error);
+  }
+
+  std::string OTAManager::openStream(const std::string &ident, uint64_t at) {
+    // A writer that gave up (timed out or failed) frees the stream up for another chunk
+    if(stream && stream->Done()) {
+      stream.reset();
+      streamIdent.clear();
+    }
+    if(stream && streamIdent != ident) {
+      debug << Debug::Mode::Warn << "Got data for " << ident << " while streaming " << streamIdent << std::endl;
+      return "Another chunk is being streamed";
+    }
+    if(stream) return "";
+
+    std::lock_guard<std::mutex> guard(chunkLock);
     auto chunk = std::find_if(chunks.begin(), chunks.end(), [&ident](const ChunkInfo &x) { return x.ident == ident;});
-    if(chunk != chunks.end()) {
-      debug << "Processing chunk: " << whichChunk << std::endl;
-      // Process the chunk
-      bool success = false;
-      if(processChunkFile(*chunk, intChunkPath)) {
-        chunk->processed = true;
-        chunk->succeeded = true;
-        success = true;
-      } else {
-        chunk->processed = true;
-        chunk->succeeded = false;
-        success = false;
+    if(chunk == chunks.end()) {
+      debug << Debug::Mode::Warn << "Chunk identifier not found" << std::endl;
+      return "Chunk identifier not found";
+    }
+    if(chunk->type != ChunkType::Image) {
+      return "Only image chunks can be streamed";
+    }
+    if(chunk->queued || chunk->running) {
+      return "Chunk already being processed";
+    }
+
+    std::shared_ptr<ChunkStream> newStream = makeStream(*chunk);
+    // So Process() can start reading a client that was held back again
+    newStream->OnRoom([this]() { wakeEvent.Signal(); });
+    // A stream can pick up from the last checkpoint of an earlier one
+    if(at != 0 && (at != chunk->resume.offset || !newStream->Resume(chunk->resume))) {
+      std::string error = "Stream must start at 0";
+      if(chunk->resume.offset > 0) error += " or " + std::to_string(chunk->resume.offset);
+      return error;
+    }
+
+    std::set<std::string> keys;
+    bool exclusive = chunkKeys(*chunk, keys);
+    chunk->queued = true;
+    if(!scheduler.Submit(keys, exclusive, [this, ident, newStream]() { processStream(ident, newStream); })) {
+      chunk->queued = false;
+      debug << Debug::Mode::Failure << "Could not queue chunk stream" << std::endl;
+      return "Could not queue chunk";
+    }
+    debug << Debug::Mode::Info << "Streaming chunk " << ident << " from " << at << std::endl;
+    stream = newStream;
+    streamIdent = ident;
+    return "";
+  }
+
+  std::string OTAManager::pushStream(std::vector<uint8_t> &&data, uint64_t at, uint32_t connection) {
+    if(at != stream->Received()) {
+      debug << Debug::Mode::Warn << "Chunk data for " << streamIdent << " at " << at << ", expected " << stream->Received() << std::endl;
+      stream->Abort();
+      stream.reset();
+      streamIdent.clear();
+      return "Chunk data out of order";
+    }
+
+    // Without a way to stop reading the client, give the writer a moment to catch up, but
+    //  no more since everyone else is waiting on the main loop.  Nothing was taken, so the
+    //  same data can be sent again
+    if(!pauseCallback && !stream->WaitForRoom(100)) return "Chunk stream busy";
+
+    if(!stream->Push(std::move(data))) {
+      stream->Abort();
+      stream.reset();
+      streamIdent.clear();
+      return "Chunk stream failed";
+    }
+
+    // Stop reading the client until the writer catches up.  Process() starts it again
+    if(pauseCallback && pausedConnection == 0 && stream->Full()) {
+      debug << Debug::Mode::Debug << "Stream for " << streamIdent << " is full, holding client " << connection << " back" << std::endl;
+      pausedConnection = connection;
+      pausedStream = stream;
+      pauseCallback(connection, true);
+    }
+
+    if(stream->Complete()) {
+      // The worker has all of it now
+      stream.reset();
+      streamIdent.clear();
+    }
+    return "";
+  }
+
+  OTAManager::ChunkSink::ChunkSink(OTAManager &manager, uint32_t connection, const std::string &ident, uint64_t at) :
+    manager(manager), connection(connection), ident(ident), identDone(!ident.empty()), base(at), at(at), quiet(false) {
+  }
+
+  bool OTAManager::ChunkSink::Write(const uint8_t *data, size_t len) {
+    if(quiet || !error.empty()) return false;
+
+    // The first fragment starts with the identifier, which says where the data goes
+    if(!identDone) {
+      size_t used = 0;
+      while(used < len && !identDone) {
+        if(data[used] == '\0') identDone = true;
+        else                   ident += (char)data[used];
+        used++;
+      }
+      if(!identDone && ident.size() >= manager.maxIdentLength) {
+        error = "Malformed process message";
+        return false;
       }
+      if(!identDone) return true;
 
-      // THis isn't a real good way to do this.  We need to refactor the processing somewhat
-      if(chunk->type == ChunkType::Script) chunk->exitCode = lastExitCode;
+      error = manager.openStream(ident, at);
+      if(!error.empty()) return false;
+      data += used;
+      len  -= used;
+    }
 
-      try {
-        debug << "Succeeded in processing chunk: " << chunk->ident << std::endl;
-        std::ofstream journal(std::string(IVEIOTA_CACHE_LOCATION) + "/journal", std::ios::out | std::ios::app);
-        RunCommand("sync"); // We also have to sync the filesystem so we can reboot
-        journal << chunk->ident << ":" << (success ? "1" : "2") << std::endl;
-      } catch(...) {
-        //TODO: Implement logging
-        // Failed to write to the journal -- can't resume a failed update
-        debug << Debug::Mode::Failure << "Failed to write to the journal" << std::endl;
+    if(len == 0) return true;
+    error = manager.pushStream(std::vector<uint8_t>(data, data + len), at, connection);
+    at += len;
+    return error.empty();
+  }
+
+  void OTAManager::ChunkSink::Abort() {
+    // Some of what was pushed was bad, so the rest of the chunk can't follow it
+    if(identDone && manager.stream && manager.streamIdent == ident) {
+      manager.stream->Abort();
+      manager.stream.reset();
+      manager.streamIdent.clear();
+    }
+  }
+
+  std::shared_ptr<Message::PayloadSink> OTAManager::MakeChunkSink(const Message &message) {
+    // Only chunk data in the payload, and only once there is an update to put it in.  Small
+    //  messages are simpler collected, and anything else is answered as usual
+    const Message::Header &h = message.header;
+    if(h.type != Message::OTAUpdate || h.subType != Message::OTAUpdate.ProcessChunk ||
+       h.imm[0] != 0 || state != OTAState::InitDone || h.pLen < sinkThreshold) {
+      return nullptr;
+    }
+    if(h.offset == 0) {
+      uint64_t at = h.imm[2] | ((uint64_t)h.imm[3] << 32);
+      return std::make_shared<ChunkSink>(*this, message.connection, "", at);
+    }
+
+    // The rest of a chunk's data, after the fragment with the identifier
+    if(requestKey(message) != streamRequest || !stream) return nullptr;
+    std::shared_ptr<ChunkSink> sink = std::make_shared<ChunkSink>(*this, message.connection, streamIdent,
+                                                                  streamBase + h.offset - streamDataStart);
+    sink->quiet = (requestKey(message) == failedRequest);
+    return sink;
+  }
+
+  std::unique_ptr<Message> OTAManager::finishSink(const Message &message) {
+    const ChunkSink *sink = dynamic_cast<const ChunkSink*>(message.sink.get());
+    if(sink == nullptr) return Message::MakeNACK(message, 0, "Malformed process message");
+    if(sink->quiet) return nullptr;
+
+    std::string error = sink->error;
+    if(error.empty() && !sink->identDone) error = "Malformed process message";
+    std::unique_ptr<Message> resp = error.empty() ? Message::MakeACK(message) : Message::MakeNACK(message, 0, error);
+    if(message.header.Whole()) return resp;
+
+    // Answer a fragmented message once, when it's done or something goes wrong
+    bool last = !(message.header.flags & Message::Header::FlagMore);
+    if(message.header.offset == 0) {
+      streamRequest   = requestKey(message);
+      streamBase      = sink->base;
+      streamDataStart = sink->ident.size() + 1;
+    }
+    if(!error.empty()) {
+      failedRequest = requestKey(message);
+      return resp;
+    }
+    if(last) streamRequest = 0;
+    return last ? std::move(resp) : nullptr;
+  }
+
+  std::shared_ptr<ChunkStream> OTAManager::makeStream(const ChunkInfo &chunk) {
+    return std::shared_ptr<ChunkStream>(new ChunkStream(config.GetDevice(Container::Alternate, chunk.dest),
+                                                        chunk.pOffset, chunk.size, chunk.hashType, chunk.hashValue,
+                                                        std::max<int64_t>(config.GetOptionInt("stream_buffer", 8 * 1024 * 1024), 1)));
+  }
+
+  bool OTAManager::queuePipe(ChunkInfo &chunk, std::shared_ptr<Message::PassedFd> fd) {
+    std::set<std::string> keys;
+    bool exclusive = chunkKeys(chunk, keys);
+
+    // A pipe always starts at the beginning, so there is nothing to resume from
+    std::shared_ptr<ChunkStream> pipeStream = makeStream(chunk);
+    std::string ident = chunk.ident;
+    chunk.queued = true;
+    if(!scheduler.Submit(keys, exclusive, [this, ident, fd, pipeStream]() { processPipe(ident, fd, pipeStream); })) {
+      chunk.queued = false;
+      return false;
+    }
+    debug << "Queued chunk " << ident << " from a pipe" << std::endl;
+    return true;
+  }
+
+  void OTAManager::processPipe(const std::string &ident, std::shared_ptr<Message::PassedFd> fd,
+                               std::shared_ptr<ChunkStream> chunkStream) {
+    // Feed the stream from the pipe while this worker writes it out
+    std::atomic<bool> finished(false);
+    std::thread feeder([this, fd, chunkStream, &finished]() {
+      while(!finished && !cancelUpdate && !chunkStream->Complete()) {
+        struct pollfd pfd;
+        pfd.fd      = fd->Get();
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, 1000);
+        if(ready < 0 && errno == EINTR) continue;
+        if(ready <= 0) {
+          if(ready < 0) break;
+          continue;
+        }
+
+        std::vector<uint8_t> piece(std::min<uint64_t>(1024 * 1024, chunkStream->Size() - chunkStream->Received()));
+        ssize_t got = read(fd->Get(), piece.data(), piece.size());
+        if(got < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if(got <= 0) break;
+        piece.resize(got);
+        if(!chunkStream->Push(std::move(piece))) break;
+      }
+
+      // The other end closed before the whole chunk came through, so don't wait for it
+      if(!chunkStream->Complete()) {
+        debug << Debug::Mode::Warn << "Pipe closed after " << chunkStream->Received() << " of " <<
+          chunkStream->Size() << " bytes" << std::endl;
+        chunkStream->Abort();
       }
+    });
+
+    processStream(ident, chunkStream);
+    finished = true;
+    chunkStream->Abort();
+    feeder.join();
+  }
+
+  void OTAManager::processStream(const std::string &ident, std::shared_ptr<ChunkStream> chunkStream) {
+    ChunkInfo chunk;
+    {
+      std::lock_guard<std::mutex> guard(chunkLock);
+      auto it = std::find_if(chunks.begin(), chunks.end(), [&ident](const ChunkInfo &x) { return x.ident == ident;});
+      if(it == chunks.end()) {
+        chunkStream->Abort();
+        return;
+      }
+      it->queued  = false;
+      it->running = true;
+      chunk = *it;
+    }
+
+    debug << "Writing streamed chunk: " << ident << std::endl;
+    bool success = false;
+    if(!cancelUpdate) {
+      std::string dest = config.GetDevice(Container::Alternate, chunk.dest);
+      written.Forget(dest, chunk.pOffset, chunk.size);
+      unsigned timeout = std::max<int64_t>(config.GetOptionInt("stream_timeout", 60), 1);
+      success = chunkStream->Run(&cancelUpdate, checkpointInterval(), timeout,
+                                 [this, ident](const CopyCheckpoint &point) { checkpointChunk(ident, point); },
+                                 progressReporter(ident));
+      if(success) written.Record(dest, chunk.pOffset, chunk.size, chunk.hashType, chunk.hashValue);
     } else {
-      debug << "Didn't find the chunk: " << whichChunk << std::endl;
+      chunkStream->Abort();
     }
+    finishChunk(ident, success, 0);
   }
 
-  bool OTAManager::processChunkFile(const ChunkInfo &chunk, const std::string &path) {
+  bool OTAManager::alreadyWritten(const ChunkInfo &chunk, const std::string &path) {
+    std::string mode = config.GetOption("skip_written", "verify");
+    if((chunk.type != ChunkType::Image && chunk.type != ChunkType::Delta) ||
+       chunk.hashType == HashAlgorithm::None || mode == "off") {
+      return false;
+    }
+
+    // An image is known by the hash of its chunk file, and a delta by the SHA256 of the
+    //  image it rebuilds, which is only trusted once the delta matches the manifest
+    HashAlgorithm algo = chunk.hashType;
+    std::string hash   = chunk.hashValue;
+    if(chunk.type == ChunkType::Delta) {
+      algo = HashAlgorithm::SHA256;
+      hash = DeltaTarget(path);
+      if(hash.empty()) return false;
+    }
+    std::string dest = config.GetDevice(Container::Alternate, chunk.dest);
+    if(!written.Holds(dest, chunk.pOffset, chunk.size, algo, hash)) return false;
+    if(chunk.type == ChunkType::Delta && GetHashValue(chunk.hashType, path) != chunk.hashValue) return false;
+
+    // The container may have been mounted and changed since, while it was the active one.
+    //  An image's hash is of the chunk file, so the device can only be checked against it
+    //  if the file is just the image
+    if(mode != "trust") {
+      struct stat ss;
+      bool whole = chunk.type == ChunkType::Delta ||
+        (stat(path.c_str(), &ss) == 0 && (uint64_t)ss.st_size == chunk.size);
+      if(!whole || GetHashValue(algo, dest, chunk.pOffset, chunk.size) != hash) {
+        debug << Debug::Mode::Info << "Chunk " << chunk.ident << " is recorded on " << dest << " but doesn't match" << std::endl;
+        return false;
+      }
+    }
+    debug << Debug::Mode::Info << "Chunk " << chunk.ident << " is already on " << dest << " at " << chunk.pOffset << ", skipping" << std::endl;
+    return true;
+  }
+
+  bool OTAManager::fusedHash(const ChunkInfo &chunk, const std::string &path) {
+    // Images can be hashed while they are being written, so the chunk file is only read
+    //  once.  That only works if the whole file is the image, since the hash covers the file
+    if(chunk.type != ChunkType::Image || chunk.hashType == HashAlgorithm::None ||
+       config.GetOptionInt("image_fused_hash", 1) == 0 || config.GetOption("hash_engine", "native") == "external") {
+      return false;
+    }
+    struct stat ss;
+    return stat(path.c_str(), &ss) == 0 && (uint64_t)ss.st_size == chunk.size;
+  }
+
+  void OTAManager::checkpointChunk(const std::string &ident, const CopyCheckpoint &point) {
+    // The data is already synced, so sync the line that says so before going on
+    std::lock_guard<std::mutex> guard(journalLock);
+    std::string line = ident + ":c:" + std::to_string(point.offset) + ":" + point.hashState + "\n";
+    int fd = open((std::string(IVEIOTA_CACHE_LOCATION) + "/journal").c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if(fd < 0 || write(fd, line.data(), line.length()) != (ssize_t)line.length() || fdatasync(fd) != 0) {
+      debug << Debug::Mode::Warn << "Failed to checkpoint " << ident << " in the journal" << std::endl;
+    } else {
+      debug << "Checkpointed " << ident << " at " << point.offset << std::endl;
+    }
+    if(fd >= 0) close(fd);
+  }
+
+  bool OTAManager::processChunkFile(const ChunkInfo &chunk, const std::string &path, int &exitCode,
+                                    std::shared_future<std::string> verified) {
     bool success = false;
 
     // First, see if the file exists
@@ -722,9 +1312,26 @@ namespace iVeiOTA {
       if(!existTest.good()) return false;
     } // end scope to close file
 
-    // Then we need to check the hash
-    {
-      std::string hashValue = GetHashValue(chunk.hashType, path);
+    // An image that is already on the alternate container (whether written from an image or
+    //  a delta chunk) doesn't need the chunk file hashed or written
+    if(alreadyWritten(chunk, path)) return true;
+
+    bool fused = fusedHash(chunk, path);
+
+    // Then we need to check the hash.  It may already have been worked out while the
+    //  chunk was queued.  If that was dropped (a cancel) we do it ourselves
+    if(!fused) {
+      std::string hashValue;
+      bool hashed = false;
+      if(verified.valid()) {
+        try {
+          hashValue = verified.get();
+          hashed = true;
+        } catch(const std::future_error &e) {
+          debug << Debug::Mode::Debug << "Queued hash of " << path << " was dropped" << std::endl;
+        }
+      }
+      if(!hashed) hashValue = GetHashValue(chunk.hashType, path);
       if(hashValue != chunk.hashValue) {
         debug << "Hashed values differed: " << hashValue << "::" << chunk.hashValue << std::endl;
 
@@ -744,11 +1351,65 @@ namespace iVeiOTA {
       uint64_t offset = chunk.pOffset;
       uint64_t size = chunk.size;
       debug << "Writing image " << path << " to " << dest << " offset: " << offset << " size: " << size << std::endl;
-      uint64_t written = CopyFileData(dest, path, offset, size, &cancelUpdate);
-      if(written != size) {
-        debug << "Didn't write proper amount: " << written << ":" << size << std::endl;
+
+      // Checkpoint as we go so a power cut doesn't cost the whole image
+      CopyResume resume;
+      resume.from     = chunk.resume;
+      resume.interval = checkpointInterval();
+      std::string ident = chunk.ident;
+      resume.checkpoint = [this, ident](const CopyCheckpoint &point) { checkpointChunk(ident, point); };
+      resume.progress   = progressReporter(ident);
+      if(resume.from.offset >= size || (resume.from.offset > 0 && fused && resume.from.hashState.empty())) {
+        // Not something we could have written, start over
+        resume.from = CopyCheckpoint();
+      }
+      if(resume.from.offset > 0) {
+        debug << Debug::Mode::Info << "Resuming image " << chunk.ident << " at " << resume.from.offset << std::endl;
+      }
+
+      // Whatever was there is gone once this starts
+      written.Forget(dest, offset, size);
+      uint64_t copied;
+      if(fused) copied = CopyFileDataVerified(dest, path, offset, size, chunk.hashType, chunk.hashValue, &cancelUpdate, 0, &resume);
+      else      copied = CopyFileData(dest, path, offset, size, &cancelUpdate, 0, &resume);
+      if(copied != size) {
+        debug << "Didn't write proper amount: " << copied << ":" << size << std::endl;
+        return false;
+      }
+
+      // A verified copy has already synced.  The data has to be on the device before the
+      //  record says it is
+      int fd = fused ? -1 : open(dest.c_str(), O_WRONLY | O_CLOEXEC);
+      if(fused || (fd >= 0 && fdatasync(fd) == 0)) {
+        written.Record(dest, offset, size, chunk.hashType, chunk.hashValue);
+      }
+      if(fd >= 0) close(fd);
+    }
+    success = true;
+    break;
+
+    ///////////////////////////////////////////////////////////////////////////
+    case ChunkType::Delta:
+    {
+      // The image is rebuilt from the one that is running, so both containers need their
+      //  own copy of the partition
+      std::string src  = config.GetDevice(Container::Active, chunk.dest);
+      std::string dest = config.GetDevice(Container::Alternate, chunk.dest);
+      if(src == dest || config.IsSinglePartition(chunk.dest)) {
+        debug << Debug::Mode::Err << "Delta chunk " << chunk.ident << " can't go on a single partition" << std::endl;
         return false;
       }
+      debug << "Applying delta " << path << " to " << dest << " offset: " << chunk.pOffset << " size: " << chunk.size << std::endl;
+
+      std::string target = DeltaTarget(path);
+      written.Forget(dest, chunk.pOffset, chunk.size);
+      uint64_t rebuilt = ApplyDelta(dest, chunk.pOffset, src, path, chunk.size, &cancelUpdate, progressReporter(chunk.ident));
+      if(rebuilt != chunk.size) {
+        debug << "Delta didn't rebuild the image: " << rebuilt << ":" << chunk.size << std::endl;
+        return false;
+      }
+      // The rebuilt image was checked against the target's hash and synced
+      written.Record(dest, chunk.pOffset, chunk.size, HashAlgorithm::SHA256, target);
     }
     success = true;
     break;
@@ -758,6 +1419,8 @@ namespace iVeiOTA {
     {
       std::string dest = config.GetDevice(Container::Alternate, chunk.dest);
       std::string ftype = config.GetFilesystemType(dest);
+      // Mounting and unpacking could change any of it
+      written.Forget(dest);
 
       {
         Mount mount(dest, IVEIOTA_MNT_POINT, ftype);
@@ -797,13 +1460,12 @@ namespace iVeiOTA {
     ///////////////////////////////////////////////////////////////////////////
     case ChunkType::Script:
     {
-      // Simply invoke the script if we get this far
+      // Simply invoke the script if we get this far.  There's no telling what it writes
+      written.Forget("");
       std::string command = path;
       int status;
-      int exitCode;
       std::string output = RunCommandWithRet("/system/bin/sh " + command, status);
       exitCode = WEXITSTATUS(status);
-      lastExitCode = exitCode;
 
       if(!WIFEXITED(status)) {
         success = false;
@@ -818,6 +1480,7 @@ namespace iVeiOTA {
     {
       std::string dest = config.GetDevice(Container::Alternate, chunk.dest);
       std::string ftype = config.GetFilesystemType(dest);
+      written.Forget(dest);
 
       Mount mount(dest, IVEIOTA_MNT_POINT, ftype);
       if(!mount.IsMounted()) {
@@ -849,12 +1512,118 @@ namespace iVeiOTA {
     return success;
   }
 
+  bool OTAManager::startVerify(const std::string &dir) {
+    if(dir.empty()) {
+      debug << Debug::Mode::Err << "No directory to verify the chunks in" << std::endl;
+      return false;
+    }
+
+    verifyChecks.clear();
+    for(const ChunkInfo &chunk : chunks) {
+      if(chunk.hashType == HashAlgorithm::None) continue;
+      VerifyCheck check;
+      check.ident     = chunk.ident;
+      check.path      = dir + "/" + chunk.ident;
+      check.hashType  = chunk.hashType;
+      check.hashValue = chunk.hashValue;
+      check.result    = VerifyResult::NotStaged;
+      verifyChecks.push_back(check);
+    }
+
+    int ret = pthread_create(&verifyThread, NULL, &VerifyThreadFunction, (void*)this);
+    if(ret != 0) {
+      debug << Debug::Mode::Failure << "Could not create the verify thread" << std::endl;
+      verifyThread = -1;
+    }
+    return ret == 0;
+  }
+
+  void OTAManager::verifyAll() {
+    // Each worker takes the next file that nobody has started on.  Hashing is CPU bound
+    //  with the files in the page cache, so by default there is one per core
+    int64_t workers = config.GetOptionInt("verify_workers", 0);
+    if(workers <= 0) workers = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+    workers = std::min<int64_t>(workers, std::max<size_t>(verifyChecks.size(), 1));
+    debug << Debug::Mode::Info << "Verifying " << verifyChecks.size() << " chunks with " << workers << " workers" << std::endl;
+
+    std::atomic<size_t> next(0);
+    auto work = [this, &next]() {
+      for(size_t i = next++; i < verifyChecks.size() && !cancelUpdate; i = next++) {
+        VerifyCheck &check = verifyChecks[i];
+        if(access(check.path.c_str(), F_OK) != 0) {
+          check.result = VerifyResult::NotStaged;
+          debug << Debug::Mode::Info << "Chunk " << check.ident << ": no file to verify" << std::endl;
+        } else {
+          std::string hash = GetHashValue(check.hashType, check.path);
+          if(hash.empty()) {
+            check.result = VerifyResult::Unreadable;
+            debug << Debug::Mode::Warn << "Chunk " << check.ident << ": could not be read" << std::endl;
+          } else if(hash != check.hashValue) {
+            check.result = VerifyResult::Mismatch;
+            debug << Debug::Mode::Warn << "Chunk " << check.ident << ": hash mismatch" << std::endl;
+          } else {
+            check.result = VerifyResult::Verified;
+            debug << Debug::Mode::Info << "Chunk " << check.ident << ": verified" << std::endl;
+          }
+        }
+
+        std::vector<uint8_t> payload(check.ident.begin(), check.ident.end());
+        payload.push_back('\0');
+        postEvent(Message(Message::OTAStatus, Message::OTAStatus.Event, Message::OTAStatus.EventVerify,
+                          static_cast<uint32_t>(check.result), 0, 0, payload));
+      }
+    };
+    std::vector<std::thread> threads;
+    for(int64_t i = 1; i < workers; i++) threads.emplace_back(work);
+    work();
+    for(std::thread &t : threads) t.join();
+  }
+
+  void OTAManager::finishVerify() {
+    // A cancel cleans up after itself
+    if(cancelUpdate) return;
+
+    unsigned staged = 0, failed = 0;
+    for(const VerifyCheck &check : verifyChecks) {
+      if(check.result != VerifyResult::NotStaged) staged++;
+      if(check.result == VerifyResult::Mismatch || check.result == VerifyResult::Unreadable) failed++;
+    }
+
+    // No files at all most likely means the wrong directory, not that every chunk is
+    //  coming some other way
+    if(failed > 0 || staged == 0) {
+      debug << Debug::Mode::Failure << "Chunks failed verification (" << failed << " bad, " << staged << " of " <<
+        verifyChecks.size() << " there): state -> idle" << std::endl;
+      // Nothing has been touched yet, so there is nothing to undo but the manifest
+      verifyFailed = true;
+      dropManifest();
+      state = OTAState::Idle;
+      return;
+    }
+
+    debug << "Verified " << staged << " chunks: state -> preparing" << std::endl;
+    state = OTAState::Preparing;
+    if(!prepareForUpdate()) {
+      debug << "Failed to prepare: state -> idle" << std::endl;
+      state = OTAState::Idle;
+    }
+  }
+
+  void OTAManager::dropManifest() {
+    {
+      std::lock_guard<std::mutex> guard(chunkLock);
+      chunks.clear();
+    }
+    maxIdentLength = 0;
+    RemoveFile(std::string(IVEIOTA_CACHE_LOCATION) + "/manifest");
+  }
+
   bool OTAManager::processManifest(const std::string &manifest) {
     // The manifest is a list of chunks in the format
     // ident:type:partition:order:<params_list>:hash_type:hash_value
     // ident is a string identifier
     // type is the type of chunk
-    //      image, file, script
+    //      image, delta, file, script
     // partition is the destination of the chunk/file
     //      root, system, boot_info, boot, data, qspi
     // order is 0/false or 1/true indicating if this chunk has
@@ -872,6 +1641,9 @@ namespace iVeiOTA {
     //  For files:
     //   dest_path
     //   dest_path is the location the file should be placed at (including path and name)
+    //  For deltas:
+    //   pOffset:fOffset:num_bytes, as for images.  num_bytes is the size of the image the
+    //   delta rebuilds, from the image at pOffset in the active container
     //  For dummy:
     //   dest_path - a file to (possibly) test for hash calculations.  If it doesn't exist
     //               this isn't a problem.  It will be ignored.
@@ -888,7 +1660,12 @@ namespace iVeiOTA {
         continue;
       }
       ChunkInfo chunk;
+      chunk.resume.offset = 0;
       chunk.processed = false;
+      chunk.succeeded = false;
+      chunk.queued    = false;
+      chunk.running   = false;
+      chunk.exitCode  = 0;
 
       chunk.ident = toks[0];
       chunk.type = GetChunkType(toks[1]);
@@ -902,7 +1679,7 @@ namespace iVeiOTA {
         continue;
       }
 
-      if((chunk.type == ChunkType::Image && toks.size() < 9) ||
+      if(((chunk.type == ChunkType::Image || chunk.type == ChunkType::Delta) && toks.size() < 9) ||
          (chunk.type == ChunkType::File && toks.size() < 7) ||
          (chunk.type == ChunkType::Archive && toks.size() < 7)) {
         debug << "Incorrect number of params for " << line << " #" << toks.size() << std::endl;
@@ -926,6 +1703,7 @@ namespace iVeiOTA {
       // Then get the chunk specific stuff
       switch(chunk.type) {
       case ChunkType::Image:
+      case ChunkType::Delta:
         chunk.pOffset = strtoll(toks[4].c_str(), 0, 10);
         chunk.fOffset = strtoll(toks[5].c_str(), 0, 10);
         chunk.size    = strtoll(toks[6].c_str(), 0, 10);
@@ -980,11 +1758,24 @@ namespace iVeiOTA {
     // Setting this flag will cause the processing threads to exit
     cancelUpdate = true;
 
+    // Chunks that haven't started never will
+    if(stream) {
+      stream->Abort();
+      stream.reset();
+      streamIdent.clear();
+    }
+    verifier.Clear();
+    size_t dropped = scheduler.Clear();
+    if(dropped > 0) debug << "Dropped " << dropped << " queued chunks" << std::endl;
+
     // Then we have to clear out our other state
     state = OTAState::Canceling;
   }
 
   bool OTAManager::Process() {
+    // Whatever woke us is handled below
+    wakeEvent.Clear();
+
     // Do anything that we need to check on periodially
     if(joinCopyThread && copyThread != -1) {
       // We need to join the copy thread
@@ -1002,40 +1793,49 @@ namespace iVeiOTA {
       }
     }
 
-    if(joinProcessThread && processThread != -1) {
-      // Need to join the process chunk thread
-      pthread_join(processThread, NULL);
-      processThread = -1;
-      joinProcessThread = false;
+    // Read the client we held back again once its stream has room, or has finished
+    if(pausedConnection != 0 && !pausedStream->Full()) {
+      if(pauseCallback) pauseCallback(pausedConnection, false);
+      pausedConnection = 0;
+      pausedStream.reset();
+    }
 
-      // update our data about this chunk
-      processingChunk = false;
-      whichChunk = "";
-      intChunkPath = "";
+    if(joinVerifyThread && verifyThread != -1) {
+      pthread_join(verifyThread, NULL);
+      verifyThread = -1;
+      joinVerifyThread = false;
+      finishVerify();
+    }
 
-      // We should check to see if all chunks have been processed now
-      if(!cancelUpdate) {
-        bool allProcessed = true;
-        bool allSucceeded = true;
-        for(auto chunk : chunks) {
+    // Once the workers have nothing left to do, see if all the chunks have been processed
+    if(state == OTAState::InitDone && !cancelUpdate && scheduler.Idle()) {
+      bool allProcessed = true;
+      bool allSucceeded = true;
+      {
+        std::lock_guard<std::mutex> guard(chunkLock);
+        for(const ChunkInfo &chunk : chunks) {
           if(!chunk.processed) allProcessed = false;
           if(!chunk.succeeded) allSucceeded = false;
         }
-
-        if(allProcessed && allSucceeded) state = OTAState::AllDone;
-        else if(allProcessed) state = OTAState::AllDoneFailed;
       }
+
+      if(allProcessed && allSucceeded) state = OTAState::AllDone;
+      else if(allProcessed) state = OTAState::AllDoneFailed;
     }
 
     // If all our threads are join()ed, then we can turn off the cancel flag
     //  and move back to the idle state
     if(cancelUpdate &&
-       (!joinProcessThread && processThread == -1) &&
-       (!joinCopyThread && copyThread == -1)
+       scheduler.Idle() && verifier.Idle() &&
+       (!joinCopyThread && copyThread == -1) &&
+       (!joinVerifyThread && verifyThread == -1)
       ) {
       debug << Debug::Mode::Debug << "Update cancel completed. Updating status to reflect" << std::endl;
       cancelUpdate = false;
-      chunks.clear();
+      {
+        std::lock_guard<std::mutex> guard(chunkLock);
+        chunks.clear();
+      }
       maxIdentLength = 0;
 
       // We have to remove any cached files too
@@ -1046,6 +1846,93 @@ namespace iVeiOTA {
       state = OTAState::Idle;
     }
 
+    reportState();
+    deliverEvents();
     return true;
   }
+
+  void OTAManager::postEvent(const Message &event) {
+    {
+      std::lock_guard<std::mutex> guard(eventLock);
+      events.push_back(event);
+    }
+    wakeEvent.Signal();
+  }
+
+  void OTAManager::reportState() {
+    bool inFlight = false;
+    {
+      std::lock_guard<std::mutex> guard(chunkLock);
+      for(const ChunkInfo &chunk : chunks) {
+        if(chunk.queued || chunk.running) inFlight = true;
+      }
+    }
+
+    uint32_t status = updateStatus(inFlight);
+    uint32_t passed = (state == OTAState::AllDone) ? 1 : 0;
+    if(status == reportedStatus && passed == reportedPassed) return;
+    reportedStatus = status;
+    reportedPassed = passed;
+    postEvent(Message(Message::OTAStatus, Message::OTAStatus.Event, Message::OTAStatus.EventState, status, passed, 0));
+  }
+
+  void OTAManager::deliverEvents() {
+    std::deque<Message> pending;
+    {
+      std::lock_guard<std::mutex> guard(eventLock);
+      pending.swap(events);
+    }
+    if(!eventCallback) return;
+
+    auto now = std::chrono::steady_clock::now();
+    for(const Message &event : pending) {
+      uint32_t kind = event.header.imm[0];
+      for(auto it = subscribers.begin(); it != subscribers.end(); ) {
+        Subscriber &sub = it->second;
+        bool wanted = (sub.mask & kind) != 0;
+        if(wanted && kind == Message::OTAStatus.EventProgress) {
+          // Some watchers only want to hear about progress now and then
+          wanted = (now - sub.lastProgress >= sub.interval);
+          if(wanted) sub.lastProgress = now;
+        }
+
+        if(wanted && !eventCallback(it->first, event)) {
+          debug << "Connection " << it->first << " is gone, dropping its subscription" << std::endl;
+          it = subscribers.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+  }
+
+  std::function<void(uint64_t)> OTAManager::progressReporter(const std::string &ident) {
+    std::chrono::milliseconds interval(std::max<int64_t>(config.GetOptionInt("progress_interval", 1000), 1));
+
+    // The first call only sets where we start from, since a resumed copy doesn't start at 0
+    struct Sample {
+      bool started;
+      std::chrono::steady_clock::time_point at;
+      uint64_t done;
+    };
+    std::shared_ptr<Sample> last(new Sample{false, std::chrono::steady_clock::now(), 0});
+
+    return [this, ident, interval, last](uint64_t done) {
+      auto now = std::chrono::steady_clock::now();
+      if(!last->started) {
+        *last = Sample{true, now, done};
+        return;
+      }
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last->at);
+      if(elapsed < interval) return;
+
+      uint64_t rate = (done - last->done) * 1000 / std::max<int64_t>(elapsed.count(), 1) / 1024;
+      *last = Sample{true, now, done};
+
+      std::vector<uint8_t> payload(ident.begin(), ident.end());
+      payload.push_back('\0');
+      postEvent(Message(Message::OTAStatus, Message::OTAStatus.Event, Message::OTAStatus.EventProgress,
+                        done & 0xFFFFFFFF, done >> 32, rate, payload));
+    };
+  }
 };
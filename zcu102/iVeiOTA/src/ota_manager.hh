@@ -5,12 +5,22 @@
 #include <vector>
 #include <memory>
 #include <fstream>
+#include <mutex>
+#include <future>
+#include <set>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <functional>
 #include <pthread.h>
 
 #include "iveiota.hh"
 #include "message.hh"
 #include "support.hh"
 #include "uboot.hh"
+#include "chunk_scheduler.hh"
+#include "chunk_stream.hh"
+#include "written_regions.hh"
 
 // TODO: This class has gotten too large.  Just for maintence purposes
 //       I should look into splitting off some functionality, like chunk
@@ -22,6 +32,7 @@ namespace iVeiOTA {
     // The types of chunks the system supports
     enum class ChunkType {
       Image,    // A full filesystem image
+      Delta,    // The changes to an image, applied to the one in the active container
       Archive,  // A zipped archive (only what tar -xf supports)
       File,     // A single file copied to a destination
       Script,   // A script to execute (not implemented yet)
@@ -46,6 +57,7 @@ namespace iVeiOTA {
     inline std::string ToString(const ChunkType type) {
       switch(type) {
       case ChunkType::Image:   return "Image";   break;
+      case ChunkType::Delta:   return "Delta";   break;
       case ChunkType::Archive: return "Archive"; break;
       case ChunkType::File:    return "File";    break;
       case ChunkType::Script:  return "Script";  break;
@@ -69,12 +81,16 @@ namespace iVeiOTA {
       
       bool processed;          // If this chunk has been processed
       bool succeeded;          // If this chunks succeeded processing
+      bool queued;             // Waiting for a worker (or for its device) to be free
+      bool running;            // A worker is processing this chunk right now
 
       // TODO: maybe make this a union?
-      // -------------- For image chunk types ----------------------------------
+      // -------------- For image (and delta) chunk types ----------------------
       uint64_t pOffset;        // Physical offset (on the device) for Image chunks
       uint64_t fOffset;        // File offset for Image chunks
       uint64_t size;           // How many bytes in the image to write
+      CopyCheckpoint resume;   // Where the last interrupted write of this chunk got to
+                               //  (from the journal).  offset is 0 to start from scratch
 
       // -------------- For archive chunk types --------------------------------
       // TODO: Maybe add a destination for archive chunks so that we can
@@ -91,12 +107,11 @@ namespace iVeiOTA {
     };
 
     // For handling the processing of chunks
-    pthread_t processThread;  // The thread that does the processing
-    bool processingChunk;     // True if we are currently processing a chunk
-    bool joinProcessThread;   // True if the processing thread has completed and needs to be join()ed
-    std::string whichChunk;   // Which chunk we are processing
-    std::string intChunkPath; // The path to the chunk file, for internal use
-    int lastExitCode;         // The last exit code of a script
+    //  Chunks are run by the scheduler's workers, so anything in chunks that a worker
+    //  can change (processed, succeeded, queued, running, exitCode) is only touched
+    //  with chunkLock held.  journalLock keeps the workers' journal lines whole
+    std::mutex chunkLock;
+    std::mutex journalLock;
     
     // For the handling of update initialization -------------------------------
     pthread_t copyThread; // The thread that does the initialization
@@ -110,12 +125,112 @@ namespace iVeiOTA {
     unsigned int maxIdentLength;   // The max identifier encountered in the manifest
 
 
+    // For checking every chunk file before an update touches anything (BeginUpdate
+    //  imm[1]).  The checks are made on the main thread, and the verify thread fills in
+    //  their results.  Results are as for OTAStatus::EventVerify
+    enum class VerifyResult : uint32_t {
+      Verified   = 0,  // The file matched its hash
+      Mismatch   = 1,  // The file didn't match its hash
+      Unreadable = 2,  // The file is there but couldn't be read
+      NotStaged  = 3   // There is no file for the chunk
+    };
+    struct VerifyCheck {
+      std::string ident;
+      std::string path;
+      HashAlgorithm hashType;
+      std::string hashValue;
+      VerifyResult result;
+    };
+    std::vector<VerifyCheck> verifyChecks;
+    pthread_t verifyThread;   // The thread that does the verifying
+    bool joinVerifyThread;    // True if the verify thread needs to be join()ed
+    bool verifyFailed;        // The last update was dropped because its chunks failed to verify
+
     // For handling the canceling of an update
     bool cancelUpdate;    // True if we are trying to cancel the update
 
     // For handling container switching
     bool singleContainerOnly;  // If all chunks are going onto a single container
                                //  then there is no reason for us to switch containers
+
+    // The image chunk being streamed over the socket (ProcessChunk with the data in the
+    //  payload).  Only one at a time, so a stream can't sit waiting for a device that
+    //  another half sent stream is holding.  Only used by the main thread
+    std::shared_ptr<ChunkStream> stream;
+    std::string streamIdent;
+    // A chunk's data can also come as one large message split into fragments (protocol
+    //  revision 2).  Only the first fragment has the identifier in it, so remember where
+    //  that fragment's data went
+    // Request IDs are only unique on one connection, so they are kept with the connection
+    static uint64_t requestKey(const Message &m) { return ((uint64_t)m.connection << 32) | m.header.requestId; }
+    uint64_t streamRequest;    // requestKey of the fragmented message, 0 if none
+    uint64_t streamBase;       // Chunk offset of the first fragment's data
+    uint64_t streamDataStart;  // Where the data started in the first fragment
+    uint64_t failedRequest;    // A fragmented message that has already been NACKed
+    // The connection we stopped reading because the stream it is sending to is full, and
+    //  that stream.  It is read again once the writer makes room.  0 if none
+    uint32_t pausedConnection;
+    std::shared_ptr<ChunkStream> pausedStream;
+
+    // Chunk data in a large ProcessChunk message goes to the stream as it comes off the
+    //  socket rather than being collected first.  Anything smaller than this is collected
+    static const uint32_t sinkThreshold = 64 * 1024;
+    class ChunkSink : public Message::PayloadSink {
+    public:
+      // ident is empty if it is still to come at the start of the payload
+      ChunkSink(OTAManager &manager, uint32_t connection, const std::string &ident, uint64_t at);
+      bool Write(const uint8_t *data, size_t len) override;
+      void Abort() override;
+
+      OTAManager &manager;
+      uint32_t connection;
+      std::string ident;
+      bool identDone;     // All of the identifier has been read
+      uint64_t base;      // Where this message's data goes in the chunk
+      uint64_t at;        // Where the next byte goes
+      std::string error;  // Why the data was refused, if it was
+      bool quiet;         // Part of a message that was already NACKed, so drop it silently
+    };
+
+    // Clients that want events pushed to them (OTAStatus::Subscribe), by connection.
+    //  Only used by the main thread
+    struct Subscriber {
+      uint32_t mask;                                     // Which events
+      std::chrono::milliseconds interval;                // Least time between progress events
+      std::chrono::steady_clock::time_point lastProgress;
+    };
+    std::map<uint32_t, Subscriber> subscribers;
+    // Events waiting to go out.  Workers add to this, the main thread sends them
+    std::mutex eventLock;
+    std::deque<Message> events;
+    uint32_t reportedStatus;   // The UpdateStatus state subscribers were last told about
+    uint32_t reportedPassed;
+
+    // What image chunks have been written where, so one that is already on the alternate
+    //  container can be skipped (option skip_written)
+    WrittenRegions written;
+    // True if chunk is an image (or a delta whose image) is already where it is going
+    bool alreadyWritten(const ChunkInfo &chunk, const std::string &path);
+
+    // Lets the workers wake the main loop up when they finish something, so the state can
+    //  move on right away.  Declared before the schedulers so it outlives their workers
+    class WakeEvent {
+    public:
+      WakeEvent();
+      ~WakeEvent();
+      void Signal();
+      void Clear();
+      int fd;
+    } wakeEvent;
+
+    // For queueing chunks
+    unsigned queueDepth;       // How many chunks can be waiting for a worker at once
+    bool hashAhead;            // Hash queued chunks before a worker gets to them
+    ChunkScheduler verifier;   // Hashes queued chunks, one at a time, in the order they were queued
+
+    // Runs chunks on a pool of workers.  Declared last so it is destroyed (and its workers
+    //  are stopped) before anything the workers use
+    ChunkScheduler scheduler;
     
   public:
 
@@ -130,11 +245,43 @@ namespace iVeiOTA {
     // Called to cancel an update
     void Cancel();
 
-    // Must be called periodically to handle internal bookeeping, such as thread join()ing
+    // Must be called to handle internal bookeeping, such as thread join()ing.  There is
+    //  only something to do when WakeFd() is readable, or after a command
     bool Process();
+
+    // Becomes readable when a worker has finished something and Process() should be called
+    int WakeFd() const { return wakeEvent.fd; }
+
+    // Where events for subscribed clients go, from Process().  It returns false if the
+    //  connection has gone away, which ends that subscription
+    typedef std::function<bool (uint32_t connection, const Message &event)> EventCallback;
+    void OnEvent(const EventCallback &callback) { eventCallback = callback; }
+
+    // How to stop and start reading a connection that is sending a chunk faster than it can
+    //  be written.  Without it, a full stream NACKs the data with "Chunk stream busy"
+    typedef std::function<void (uint32_t connection, bool paused)> PauseCallback;
+    void OnPause(const PauseCallback &callback) { pauseCallback = callback; }
+
+    // A sink for SocketInterface::SetPayloadSink that streams ProcessChunk data straight to
+    //  the chunk's stream.  Returns nullptr for messages that should be collected as usual
+    std::shared_ptr<Message::PayloadSink> MakeChunkSink(const Message &message);
     
   protected:
     UBootManager &bootMgr; // A handle to our boot manager, for setting container validity
+    EventCallback eventCallback;
+    PauseCallback pauseCallback;
+
+    // The state as UpdateStatus reports it (imm[0])
+    uint32_t updateStatus(bool inFlight) const;
+
+    // Queue an event for subscribers.  Can be called from any thread
+    void postEvent(const Message &event);
+    // Send a state event if the state has changed, then send out what is queued
+    void reportState();
+    void deliverEvents();
+    // Something for a copy to call with how far it has got, that sends rate limited
+    //  progress events for a chunk
+    std::function<void(uint64_t)> progressReporter(const std::string &ident);
 
     // Our message handlers
     std::vector<std::unique_ptr<Message>> processActionMessage(const Message &message);
@@ -146,9 +293,69 @@ namespace iVeiOTA {
     //  not be bootable
     bool prepareForUpdate(bool noCopy = false);
 
-    // Called to process a chunk, and to process a chunk file
-    void processChunk();
-    bool processChunkFile(const ChunkInfo &chunk, const std::string &path);
+    // Called by a worker to process a chunk, and to process a chunk file
+    //  exitCode is set for script chunks.  If verified is valid it is the hash of the
+    //  chunk file, worked out while the chunk was queued
+    void processChunk(const std::string &ident, const std::string &path,
+                      std::shared_future<std::string> verified);
+    bool processChunkFile(const ChunkInfo &chunk, const std::string &path, int &exitCode,
+                          std::shared_future<std::string> verified = std::shared_future<std::string>());
+
+    // True if an image chunk will be hashed while it is written, rather than beforehand
+    bool fusedHash(const ChunkInfo &chunk, const std::string &path);
+
+    // Record in the journal how far an image chunk has been written, so it can be resumed
+    void checkpointChunk(const std::string &ident, const CopyCheckpoint &point);
+
+    // Handle a piece of a streamed image chunk.  dataStart is where the data starts in the
+    //  payload and at is where it goes in the chunk
+    std::unique_ptr<Message> processChunkData(const Message &message, const std::string &ident,
+                                              unsigned int dataStart, uint64_t at);
+    // Handle ProcessChunk fragments after the first.  Returns nullptr if there is nothing
+    //  to send back yet
+    std::unique_ptr<Message> processChunkFragment(const Message &message);
+    // Answer a ProcessChunk message whose data went to a ChunkSink.  Returns nullptr if
+    //  there is nothing to send back yet
+    std::unique_ptr<Message> finishSink(const Message &message);
+    // Start streaming a chunk from at (or carry on with the one already streaming), and
+    //  give the stream the next piece of it, from connection.  Both return why not, or ""
+    //  on success
+    std::string openStream(const std::string &ident, uint64_t at);
+    std::string pushStream(std::vector<uint8_t> &&data, uint64_t at, uint32_t connection);
+    // Called by a worker to write out a streamed chunk
+    void processStream(const std::string &ident, std::shared_ptr<ChunkStream> chunkStream);
+    // A stream that writes chunk to its place in the alternate container
+    std::shared_ptr<ChunkStream> makeStream(const ChunkInfo &chunk);
+
+    // Queue an image chunk that is read from a pipe the client passed us, and the worker
+    //  job for it.  chunkLock must be held to queue
+    bool queuePipe(ChunkInfo &chunk, std::shared_ptr<Message::PassedFd> fd);
+    void processPipe(const std::string &ident, std::shared_ptr<Message::PassedFd> fd,
+                     std::shared_ptr<ChunkStream> chunkStream);
+
+    // Mark a chunk as processed and journal the result
+    void finishChunk(const std::string &ident, bool success, int exitCode);
+
+    // What a chunk has to wait for on the scheduler.  Returns true if it has to run alone
+    bool chunkKeys(const ChunkInfo &chunk, std::set<std::string> &keys);
+
+    // Queue a chunk on the scheduler.  Chunks writing to different physical devices run at
+    //  the same time, chunks on the same device run in the order they are queued.  The
+    //  chunk file is hashed while it waits, if it can be.  If the file was passed to us, fd
+    //  is kept open until the chunk is done.  chunkLock must be held
+    bool queueChunk(ChunkInfo &chunk, const std::string &path,
+                    std::shared_ptr<Message::PassedFd> fd = nullptr);
+
+    // Start the verify thread on every chunk's file in dir (named by its identifier),
+    //  before an update touches anything.  Returns false if it couldn't be started
+    bool startVerify(const std::string &dir);
+    // Called by the verify thread to hash all the files at once, sending an event for each
+    void verifyAll();
+    // Once the verify thread is done, prepare for the update if every file there matched
+    //  and at least one was there.  Otherwise drop the update
+    void finishVerify();
+    // Forget the manifest of an update that never got started
+    void dropManifest();
 
     // Process a manifest file.  This will extract all the chunks needed for the
     //  update, and call the prepareForUpdate function to start initialization
@@ -157,7 +364,7 @@ namespace iVeiOTA {
 
     // Targets for pthread's
     friend void* CopyThreadFunction(void *data);
-    friend void* ProcessThreadFunction(void *data);
+    friend void* VerifyThreadFunction(void *data);
   };  
 };
 
@@ -6,7 +6,7 @@
 #include "debug.hh"
 namespace iVeiOTA {
 
-  SocketEchoInterface::SocketEchoInterface(EchoCallback callback, bool server, const std::string &name) :
+  SocketEchoInterface::SocketEchoInterface(EchoCallback callback, bool server, const std::string &name, int type) :
         server(server), callback(callback) {
         clientSocket = -2;
         serverSocket = -2;
@@ -14,7 +14,7 @@ namespace iVeiOTA {
         struct sockaddr_un server_address;
         socklen_t address_length = offsetof(struct sockaddr_un, sun_path) + strlen(name.c_str());
 
-        if ((tempSocket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        if ((tempSocket = socket(AF_UNIX, type, 0)) < 0) {
             // Failed to create the server socket
             serverSocket = -1;
             return;
@@ -50,7 +50,16 @@ namespace iVeiOTA {
         } else {
             // Client code
             clientSocket = tempSocket;
-            if (connect(clientSocket, (struct sockaddr*)&server_address, address_length) < 0) {
+            int connected = connect(clientSocket, (struct sockaddr*)&server_address, address_length);
+            if(connected < 0 && (errno == EPROTOTYPE || errno == ECONNREFUSED) && type != SOCK_STREAM) {
+                // The server may only take streams
+                close(clientSocket);
+                clientSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+                connected = (clientSocket < 0) ? -1 :
+                    connect(clientSocket, (struct sockaddr*)&server_address, address_length);
+            }
+            if (connected < 0) {
+                if(clientSocket >= 0) close(clientSocket);
                 clientSocket = -1;
                 return;
             }
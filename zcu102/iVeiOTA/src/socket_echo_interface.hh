@@ -21,8 +21,10 @@ namespace iVeiOTA {
   public:
     typedef std::function< void (uint8_t *data, int len) > EchoCallback;
     
+    // type as for SocketInterface.  Each read of a packet socket is one packet
     SocketEchoInterface(EchoCallback callback, bool server = false, 
-                    const std::string &name = IVEIOTA_DEFAULT_SOCK_NAME);
+                    const std::string &name = IVEIOTA_DEFAULT_SOCK_NAME,
+                    int type = IVEIOTA_DEFAULT_SOCK_TYPE);
     
     bool Process();
     
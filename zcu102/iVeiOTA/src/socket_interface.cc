@@ -1,20 +1,56 @@
-
 #include <string.h>
 #include <errno.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include "socket_interface.hh"
+#include "hash.hh"
 #include "debug.hh"
 namespace iVeiOTA {
+  // These are taken by reference (std::min, the stream operators), so they need a definition
+  //  somewhere until C++17 makes them inline
+  constexpr uint64_t SocketInterface::packetSize;
+  constexpr int      SocketInterface::rdbufLen;
+
+  SocketInterface::Connection::Connection(int fd, uint32_t id) :
+        fd(fd), id(id), closing(false), state(messageState::WaitingSync), syncAt(0), hbufPos(0),
+        gathering(false), sendRev(1), nextRequestId(1), checksums(0), payloadCrc(0),
+        received(0), sinkFailed(false), queued(0), wantWrite(false), paused(false), packet(false) {
+  }
+
+  int SocketInterface::SocketType(const std::string &name) {
+    if(name == "stream")    return SOCK_STREAM;
+    if(name == "seqpacket") return SOCK_SEQPACKET;
+    return -1;
+  }
 
-  SocketInterface::SocketInterface(OTAMessageCallback callback, bool server, const std::string &name) :
-        server(server), callback(callback), state(messageState::WaitingSync), syncAt(0), hbufPos(0) {
-        clientSocket = -2;
+  SocketInterface::SocketInterface(OTAMessageCallback callback, bool server, const std::string &name, int type) :
+        server(server), callback(callback), socketType(type), nextConnection(1), current(nullptr), client(nullptr),
+        rdbuf(new uint8_t[rdbufLen]) {
         serverSocket = -2;
         int tempSocket = -2;
         struct sockaddr_un server_address;
         socklen_t address_length = offsetof(struct sockaddr_un, sun_path) + strlen(name.c_str());
 
-        if ((tempSocket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        // Everything we read from goes in one epoll set, however many clients there are
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if(epollFd < 0) {
+            debug << Debug::Mode::Failure << "Failed to create epoll set: " << strerror(errno) << std::endl << Debug::Mode::Info;
+        }
+
+        if(!server) {
+            // A client always has its one connection, even if it couldn't connect
+            std::unique_ptr<Connection> conn(new Connection(-1, nextConnection++));
+            client = conn.get();
+            connections[client->id] = std::move(conn);
+        }
+
+        if(socketType != SOCK_STREAM && socketType != SOCK_SEQPACKET) {
+            debug << Debug::Mode::Err << "Unknown socket type " << socketType << ", using a stream" << std::endl;
+            socketType = SOCK_STREAM;
+        }
+        if ((tempSocket = socket(AF_UNIX, socketType | SOCK_CLOEXEC, 0)) < 0) {
             // Failed to create the server socket
             serverSocket = -1;
             return;
@@ -27,6 +63,7 @@ namespace iVeiOTA {
         strcpy(server_address.sun_path, name.c_str()); 
         server_address.sun_path[0] = '\0';
 
+        int watch = -1;
         if(server) {
             serverSocket = tempSocket;
 
@@ -40,131 +77,333 @@ namespace iVeiOTA {
             }
 
             // Then start listening for incoming connections
-            if(listen(serverSocket, 2) < 0) {
+            if(listen(serverSocket, listenBacklog) < 0) {
                 // Failed to listen on socket
               debug << Debug::Mode::Failure << "Failed to listen on socket: " << strerror(errno) << std::endl << Debug::Mode::Info;
                 close(serverSocket);
                 serverSocket = -1;
                 return;
             }
+            watch = serverSocket;
         } else {
-            // Client code
-            clientSocket = tempSocket;
-            if (connect(clientSocket, (struct sockaddr*)&server_address, address_length) < 0) {
-                clientSocket = -1;
+            // Client code.  A server that only takes streams turns a packet socket away, with
+            //  EPROTOTYPE, or ECONNREFUSED for an abstract name, so fall back to a stream
+            int connected = connect(tempSocket, (struct sockaddr*)&server_address, address_length);
+            if(connected < 0 && (errno == EPROTOTYPE || errno == ECONNREFUSED) && socketType != SOCK_STREAM) {
+                close(tempSocket);
+                socketType = SOCK_STREAM;
+                tempSocket = socket(AF_UNIX, socketType | SOCK_CLOEXEC, 0);
+                connected = (tempSocket < 0) ? -1 :
+                    connect(tempSocket, (struct sockaddr*)&server_address, address_length);
+            }
+            if (connected < 0) {
+                if(tempSocket >= 0) close(tempSocket);
                 return;
             }
+            client->packet = (socketType == SOCK_SEQPACKET);
+            // Connected, so now nothing we do with it should wait
+            fcntl(tempSocket, F_SETFL, fcntl(tempSocket, F_GETFL) | O_NONBLOCK);
+            client->fd = tempSocket;
+            watch = tempSocket;
+        }
+
+        // The listening socket goes in the set as connection 0
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.u32 = server ? 0 : client->id;
+        if(epollFd >= 0 && epoll_ctl(epollFd, EPOLL_CTL_ADD, watch, &event) < 0) {
+            debug << Debug::Mode::Failure << "Failed to watch socket: " << strerror(errno) << std::endl << Debug::Mode::Info;
         }
         return;
     }
 
-    bool SocketInterface::Process() {
-        fd_set rset;
-        int maxfd = 0;
-
-        if(clientSocket < 0 && serverSocket < 0) {
+    bool SocketInterface::Process(int timeout) {
+        if(!IsOpen() || epollFd < 0) {
             return false;
         }
 
-        // Set up our sockets for the select call so that we dont block
-        FD_ZERO(&rset);
-        if(clientSocket >= 0) {
-            // There is an active client, so check to see if it has data to read
-            FD_SET(clientSocket, &rset);
-            maxfd = clientSocket + 1;
-        } else if(serverSocket >= 0) {
-            // Check to see if there is an incoming connection
-            FD_SET(serverSocket, &rset);
-            maxfd = serverSocket + 1;
-        } else {
-          // We have no valid sockets
-          return false;
+        struct epoll_event events[maxEvents];
+        int ready = epoll_wait(epollFd, events, maxEvents, timeout);
+        if(ready < 0) {
+            return errno == EINTR;
         }
 
-        // TODO: Make this number configurable?  Decide on the best value here
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+        for(int i = 0; i < ready; i++) {
+            if(events[i].data.u32 == 0) {
+                // Something to accept()
+                accept();
+                continue;
+            }
+            auto watch = watched.find(events[i].data.u32);
+            if(watch != watched.end()) {
+                watch->second();
+                continue;
+            }
 
-        if(select(maxfd, &rset, NULL, NULL, &timeout) < 0) {
+            Connection *conn = find(events[i].data.u32);
+            if(conn == nullptr || conn->closing) continue;
+
+            // Room to send more of what is queued
+            if((events[i].events & EPOLLOUT) && !flush(*conn)) continue;
+            if((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) == 0) continue;
+
+            // there is data to read.  On a hang up whatever was still waiting is read first
+            int bread = receive(*conn);
+            if(bread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                continue;
+            } else if(bread <= 0) {
+                // error, or 0 when the socket is closed
+                closeConnection(*conn);
+            } else {
+                processData(*conn, rdbuf.get(), bread);
+            }
+        }
+
+        // Only now is nothing using the connections that were closed
+        reap();
+        return true;
+    }
+
+    bool SocketInterface::Watch(int fd, const std::function<void()> &handler) {
+        if(epollFd < 0 || fd < 0) return false;
+
+        uint32_t id = nextConnection++;
+        if(nextConnection == 0) nextConnection = 1;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.u32 = id;
+        if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            debug << Debug::Mode::Err << "Failed to watch fd " << fd << ": " << strerror(errno) << std::endl;
             return false;
         }
+        watched[id] = handler;
+        return true;
+    }
 
-        if(serverSocket >= 0 && FD_ISSET(serverSocket, &rset)) {
-            // Something to accept()
-            struct sockaddr_un client_addr;
-            socklen_t client_addr_size = sizeof(client_addr);
-            clientSocket = accept(serverSocket, (struct sockaddr*) &client_addr, &client_addr_size);
-            state = messageState::WaitingSync;
-            syncAt = 0;
-            if(clientSocket < 0) {
-                //TODO: This probably means we have to quit/restart the OTA application
-                clientSocket = -2;
-            }
-        } else if(clientSocket >= 0 && FD_ISSET(clientSocket, &rset)) {
-            // there is data to read
-            int bread = read(clientSocket, rdbuf, rdbufLen);
-            if(bread < 0) {
-                // error, socket is probably closed
-                close(clientSocket);
-                clientSocket = -2;
-            } else if(bread == 0) {
-                // Happens when the socket is closed
-                close(clientSocket);
-                clientSocket = -2;
+    bool SocketInterface::accept() {
+        struct sockaddr_un client_addr;
+        socklen_t client_addr_size = sizeof(client_addr);
+        int fd = accept4(serverSocket, (struct sockaddr*) &client_addr, &client_addr_size, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if(fd < 0) {
+            //TODO: This probably means we have to quit/restart the OTA application
+            debug << Debug::Mode::Err << "Failed to accept a client: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        std::unique_ptr<Connection> conn(new Connection(fd, nextConnection++));
+        if(nextConnection == 0) nextConnection = 1;
+        conn->packet = (socketType == SOCK_SEQPACKET);
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.u32 = conn->id;
+        if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            debug << Debug::Mode::Err << "Failed to watch client: " << strerror(errno) << std::endl;
+            close(fd);
+            return false;
+        }
+
+        debug << "Client " << conn->id << " connected, " << connections.size() + 1 << " connected now" << std::endl;
+        connections[conn->id] = std::move(conn);
+        return true;
+    }
+
+    SocketInterface::Connection *SocketInterface::find(uint32_t connection) const {
+        if(connection == 0) return current ? current : client;
+        auto it = connections.find(connection);
+        return (it == connections.end()) ? nullptr : it->second.get();
+    }
+
+    void SocketInterface::closeConnection(Connection &conn) {
+        if(conn.fd >= 0) {
+            if(epollFd >= 0) epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, NULL);
+            close(conn.fd);
+            conn.fd = -1;
+        }
+        conn.receivedFds.clear();
+        conn.outbound.clear();
+        conn.queued    = 0;
+        conn.wantWrite = false;
+        conn.closing   = true;
+    }
+
+    // Forget the connections that have closed, once nothing is reading from them.  A
+    //  client's one connection is kept, closed
+    void SocketInterface::reap() {
+        for(auto it = connections.begin(); it != connections.end(); ) {
+            if(it->second->closing && it->second.get() != client && it->second.get() != current) {
+                debug << "Client " << it->first << " disconnected" << std::endl;
+                it = connections.erase(it);
             } else {
-                ProcessData(rdbuf, bread);
+                ++it;
             }
-        } else {
         }
+    }
 
-        return true;
+    // read() that also picks up any file descriptors the other side passed.  The kernel
+    //  doesn't return data from after a passed descriptor in the same read, so a header
+    //  with FlagFd never gets parsed before its descriptor is here
+    int SocketInterface::receive(Connection &conn) {
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int) * maxFdsPerRead)];
+        } control;
+        struct iovec iov;
+        iov.iov_base = rdbuf.get();
+        iov.iov_len  = rdbufLen;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        int bread;
+        do {
+            bread = recvmsg(conn.fd, &msg, MSG_CMSG_CLOEXEC);
+        } while(bread < 0 && errno == EINTR);
+        if(bread < 0) return bread;
+
+        for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                conn.receivedFds.push_back(std::make_shared<Message::PassedFd>(fd));
+            }
+        }
+        if(msg.msg_flags & MSG_TRUNC) {
+            debug << Debug::Mode::Warn << "A packet larger than " << rdbufLen << " bytes was cut short" << std::endl;
+        }
+        if(msg.msg_flags & MSG_CTRUNC) {
+            debug << Debug::Mode::Warn << "Too many file descriptors passed at once, some were dropped" << std::endl;
+        }
+        return bread;
     }
 
     void SocketInterface::ProcessData(uint8_t *data, int dataLen) {
+        Connection *conn = find(0);
+        if(conn) processData(*conn, data, dataLen);
+    }
+
+    void SocketInterface::processData(Connection &conn, uint8_t *data, int dataLen) {
         int processed = 0;
-        while(processed < dataLen) {
+        while(processed < dataLen && !conn.closing) {
             int dRemaining = dataLen - processed;
 
-            switch(state) {
+            switch(conn.state) {
             case messageState::WaitingSync:
             {
-                if(Message::sync[syncAt] == data[processed]) syncAt++;
-                else syncAt = 0;
-                processed++;
-
-                if(syncAt == Message::SyncLength) {
-                    state = messageState::ReadingHeader;
-                    syncAt = 0;
-                    hbufPos = 0;
+                if(conn.packet) {
+                    // Every message starts a packet of its own, so the sync is either right
+                    //  at the start or this isn't a message
+                    if(processed != 0 || dRemaining < Message::SyncLength ||
+                       memcmp(data, Message::sync, Message::SyncLength) != 0) {
+                        debug << Debug::Mode::Warn << "Dropping a packet that isn't a message" << std::endl;
+                        processed = dataLen;
+                        break;
+                    }
+                    processed = Message::SyncLength;
+                    conn.syncAt = Message::SyncLength;
+                } else if(conn.syncAt == 0) {
+                    // Look for the whole sync at once rather than a byte at a time.  If it
+                    //  isn't here, the end of the data may be the start of one
+                    const uint8_t *found = (const uint8_t*)memmem(data + processed, dRemaining,
+                                                                  Message::sync, Message::SyncLength);
+                    if(found == nullptr) {
+                        int tail = std::min(dRemaining, (int)Message::SyncLength - 1);
+                        for(; tail > 0; tail--) {
+                            if(memcmp(data + dataLen - tail, Message::sync, tail) == 0) break;
+                        }
+                        conn.syncAt = tail;
+                        processed = dataLen;
+                        break;
+                    }
+                    processed = (found - data) + Message::SyncLength;
+                    conn.syncAt = Message::SyncLength;
+                } else {
+                    // Finishing a sync that started in the last read.  If this byte doesn't
+                    //  fit, a sync could still start part way through what we have seen
+                    uint8_t seen[Message::SyncLength];
+                    memcpy(seen, Message::sync, conn.syncAt);
+                    seen[conn.syncAt] = data[processed++];
+                    uint32_t have = conn.syncAt + 1;
+                    uint32_t match = have;
+                    for(; match > 0; match--) {
+                        if(memcmp(seen + have - match, Message::sync, match) == 0) break;
+                    }
+                    conn.syncAt = match;
+                }
+
+                if(conn.syncAt == Message::SyncLength) {
+                    conn.state = messageState::ReadingHeader;
+                    conn.syncAt = 0;
+                    conn.hbufPos = 0;
                 }
                 break;
             }
             case messageState::ReadingHeader:
             {
-                // Take 8 off of remaining to account for the sync we already read
-                int hRemaining = Message::Header::Size(Message::DefaultRev) - hbufPos - 8;
+                // The revision comes first and says how large the header is, so get it before
+                //  anything else.  Take 8 off to account for the sync we already read
+                int hLength = 2;
+                if(conn.hbufPos >= 2) {
+                    hLength = (int)Message::Header::Size(ntohs(*(uint16_t*)conn.hbuf)) - 8;
+                    if(hLength <= 2) {
+                        // A revision we don't know, so restart
+                        conn.hbufPos = 0;
+                        conn.state = messageState::WaitingSync;
+                        break;
+                    }
+                }
+                int hRemaining = hLength - conn.hbufPos;
                 int toCopy = std::min(hRemaining, dRemaining);
 
                 debug << "Reading header: " << hRemaining << ":" << toCopy << std::endl;
 
-                memcpy(hbuf + hbufPos, data + processed, toCopy);
-                hbufPos += toCopy;
+                memcpy(conn.hbuf + conn.hbufPos, data + processed, toCopy);
+                conn.hbufPos += toCopy;
                 processed += toCopy;
 
-                if(hbufPos >= Message::Header::Size(Message::DefaultRev) - 8) {
+                if(hLength > 2 && conn.hbufPos >= hLength) {
+                    // The message (and its payload buffer) is reused from one message to the next
                     try {
-                        message = Message(hbuf, false);
+                        conn.message.header = Message::Header(conn.hbuf, false);
                     } catch(...) {
                         // The header was invalid, so restart
-                        hbufPos = 0;
-                        state = messageState::WaitingSync;
+                        conn.hbufPos = 0;
+                        conn.state = messageState::WaitingSync;
                         break;
                     }
-                    debug << "Got header: " << message.header.pLen << ":" << std::endl;
-                    hbufPos = 0;
-                    state = messageState::ReadingPayload;
-                    if(message.header.pLen > 0) break;
+                    debug << "Got header: " << conn.message.header.pLen << ":" << std::endl;
+                    conn.message.connection = conn.id;
+                    conn.message.payload.clear();
+                    conn.payloadCrc = 0;
+                    conn.received   = 0;
+                    conn.sinkFailed = false;
+                    conn.message.fd.reset();
+                    conn.message.sink.reset();
+                    if(conn.message.header.flags & Message::Header::FlagFd) {
+                        if(conn.receivedFds.empty()) {
+                            debug << Debug::Mode::Warn << "Header says a file descriptor was passed, but none was" << std::endl;
+                        } else {
+                            conn.message.fd = conn.receivedFds.front();
+                            conn.receivedFds.pop_front();
+                        }
+                    }
+
+                    // The payload either goes to a sink as it comes in, or is collected here
+                    const Message::Header &h = conn.message.header;
+                    auto factory = sinks.find(((uint16_t)h.type << 8) | h.subType);
+                    if(factory != sinks.end() && h.pLen > 0) conn.message.sink = factory->second(conn.message);
+                    if(!conn.message.sink) conn.message.payload.reserve(h.pLen);
+                    conn.hbufPos = 0;
+                    conn.state = messageState::ReadingPayload;
+                    if(conn.message.header.pLen > 0) break;
                     // else we want to fall through to process the 0-length payload
                     //  if we don't we will end up waiting until there is data available on the socket
                 } else {
@@ -173,56 +412,306 @@ namespace iVeiOTA {
             }
             case messageState::ReadingPayload:
             {
-                int pRemaining = message.header.pLen - message.payload.size();
+                Message &message = conn.message;
+                int pRemaining = message.header.pLen - conn.received;
                 int toCopy = std::min(pRemaining, dRemaining);
                 debug << "Reading payload" << pRemaining << ":" << toCopy << std::endl;
-                for(int i = 0; i < toCopy; i++) message.payload.push_back(data[processed++]);
+                if(!message.sink) {
+                    message.payload.insert(message.payload.end(), data + processed, data + processed + toCopy);
+                } else if(!conn.sinkFailed && toCopy > 0) {
+                    conn.sinkFailed = !message.sink->Write(data + processed, toCopy);
+                }
+                // Checked as it comes in, while it is still in the cache
+                if(message.header.flags & Message::Header::FlagPayloadCrc) {
+                    conn.payloadCrc = Crc32c(data + processed, toCopy, conn.payloadCrc);
+                }
+                processed += toCopy;
+                conn.received += toCopy;
 
-                if(message.payload.size() == message.header.pLen) {
+                if(conn.received == message.header.pLen) {
                     // We have the full payload, so we can process the message
-                    callback(message);
-                    message = Message();
-                    state = messageState::WaitingSync;
+                    if((message.header.flags & Message::Header::FlagPayloadCrc) &&
+                       conn.payloadCrc != message.header.payloadCrc) {
+                        debug << Debug::Mode::Warn << "Dropping message with a bad payload checksum " << message.header.toString() << std::endl;
+                        // Whatever it was part of can't be put back together now
+                        conn.gathering = false;
+                        if(message.sink) message.sink->Abort();
+                    } else {
+                        deliver(conn);
+                    }
+                    // Keep the payload buffer for the next message, unless it was a big one
+                    message.fd.reset();
+                    message.sink.reset();
+                    if(message.payload.capacity() > (size_t)rdbufLen) std::vector<uint8_t>().swap(message.payload);
+                    else                                               message.payload.clear();
+                    conn.state = messageState::WaitingSync;
                 }
                 break;
             }
 
             } // End switch(state)
         }
+
+        // A header is never split over packets
+        if(conn.packet && conn.state == messageState::ReadingHeader) {
+            conn.hbufPos = 0;
+            conn.state = messageState::WaitingSync;
+        }
     }
 
-    bool SocketInterface::Send(const Message &m) {
-        if(clientSocket < 0) {
+    void SocketInterface::deliver(Connection &conn) {
+        // Anything sent from the callback goes back to this connection
+        Connection *previous = current;
+        current = &conn;
+
+        const Message::Header &h = conn.message.header;
+        if(h.Whole() || h.totalLen > Message::MaxPayload || conn.message.sink) {
+            callback(conn.message);
+        } else if(h.offset == 0) {
+            conn.partial = conn.message;
+            conn.partial.payload.reserve(h.totalLen);
+            conn.gathering = true;
+        } else if(conn.gathering && h.requestId == conn.partial.header.requestId && h.offset == conn.partial.payload.size()) {
+            conn.partial.payload.insert(conn.partial.payload.end(), conn.message.payload.begin(), conn.message.payload.end());
+        } else {
+            debug << Debug::Mode::Warn << "Dropping out of order fragment " << h.toString() << std::endl;
+            conn.gathering = false;
+        }
+
+        if(conn.gathering && !h.Whole() && (h.flags & Message::Header::FlagMore) == 0) {
+            // That was the last piece, so it's a whole message now
+            conn.gathering = false;
+            conn.partial.header.pLen   = conn.partial.payload.size();
+            conn.partial.header.offset = 0;
+            conn.partial.header.flags  = 0;
+            callback(conn.partial);
+            conn.partial = Message();
+        }
+
+        current = previous;
+    }
+
+    // Send a and then b in one go, as much as the socket will take without waiting.  If
+    //  passFd isn't -1 it goes along with the first byte.  Returns how much was sent, or -1
+    //  if the connection is broken.  A client that has gone away shows up as an error here
+    //  rather than as a SIGPIPE, so we know which connection it was.  On a packet socket a
+    //  and b go as one packet, or not at all
+    static ssize_t sendSome(int fd, const uint8_t *a, size_t aLen, const uint8_t *b, size_t bLen, int passFd = -1) {
+        size_t done = 0, total = aLen + bLen;
+        while(done < total) {
+            struct iovec iov[2];
+            int parts = 0;
+            if(done < aLen) {
+                iov[parts].iov_base = (void*)(a + done);
+                iov[parts].iov_len  = aLen - done;
+                parts++;
+            }
+            size_t bAt = (done > aLen) ? done - aLen : 0;
+            if(bAt < bLen) {
+                iov[parts].iov_base = (void*)(b + bAt);
+                iov[parts].iov_len  = bLen - bAt;
+                parts++;
+            }
+
+            union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+            } control;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov    = iov;
+            msg.msg_iovlen = parts;
+            if(passFd >= 0) {
+                memset(&control, 0, sizeof(control));
+                msg.msg_control    = control.buf;
+                msg.msg_controllen = sizeof(control.buf);
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type  = SCM_RIGHTS;
+                cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+            }
+
+            ssize_t wrote = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(wrote < 0) {
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return -1;
+            }
+            if(wrote > 0) passFd = -1;
+            done += wrote;
+        }
+        return done;
+    }
+
+    bool SocketInterface::write(Connection &conn, const uint8_t *header, size_t hLen,
+                                const uint8_t *payload, size_t len,
+                                const std::shared_ptr<Message::PassedFd> &fd) {
+        // Nothing can go ahead of what is already queued
+        size_t sent = 0;
+        if(conn.outbound.empty()) {
+            ssize_t wrote = sendSome(conn.fd, header, hLen, payload, len, fd ? fd->Get() : -1);
+            if(wrote < 0) return false;
+            sent = wrote;
+        }
+        if(sent == hLen + len) return true;
+
+        Connection::Outgoing out;
+        out.data.reserve(hLen + len - sent);
+        if(sent < hLen) out.data.insert(out.data.end(), header + sent, header + hLen);
+        size_t pAt = (sent > hLen) ? sent - hLen : 0;
+        out.data.insert(out.data.end(), payload + pAt, payload + len);
+        out.sent = 0;
+        if(sent == 0) out.fd = fd;
+
+        conn.queued += out.data.size();
+        conn.outbound.push_back(std::move(out));
+        watchWrites(conn, true);
+
+        // A client only has the server to talk to, so it waits for the server to catch up.
+        //  A server doesn't let one client that isn't reading hold up the rest
+        while(conn.queued > maxQueued) {
+            if(server) {
+                debug << Debug::Mode::Warn << "Client " << conn.id << " isn't reading what we send, dropping it" << std::endl;
+                return false;
+            }
+            struct pollfd pfd;
+            pfd.fd      = conn.fd;
+            pfd.events  = POLLOUT;
+            pfd.revents = 0;
+            if(poll(&pfd, 1, -1) < 0 && errno != EINTR) return false;
+            if(!flush(conn)) return false;
+        }
+        return true;
+    }
+
+    bool SocketInterface::flush(Connection &conn) {
+        while(!conn.outbound.empty()) {
+            Connection::Outgoing &out = conn.outbound.front();
+            int passFd = (out.fd && out.sent == 0) ? out.fd->Get() : -1;
+            ssize_t wrote = sendSome(conn.fd, out.data.data() + out.sent, out.data.size() - out.sent,
+                                     nullptr, 0, passFd);
+            if(wrote < 0) {
+                debug << Debug::Mode::Info << "Failed to send to client " << conn.id << ": " << strerror(errno) << std::endl;
+                closeConnection(conn);
+                return false;
+            }
+            out.sent    += wrote;
+            conn.queued -= wrote;
+            if(out.sent < out.data.size()) return true; // The socket is full again
+            conn.outbound.pop_front();
+        }
+        watchWrites(conn, false);
+        return true;
+    }
+
+    void SocketInterface::watchWrites(Connection &conn, bool want) {
+        if(conn.wantWrite == want) return;
+        conn.wantWrite = want;
+        rewatch(conn);
+    }
+
+    void SocketInterface::rewatch(Connection &conn) {
+        if(epollFd < 0 || conn.fd < 0) return;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events   = 0;
+        if(!conn.paused)   event.events |= EPOLLIN;
+        if(conn.wantWrite) event.events |= EPOLLOUT;
+        event.data.u32 = conn.id;
+        if(epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &event) < 0) {
+            debug << Debug::Mode::Err << "Failed to watch client " << conn.id << ": " << strerror(errno) << std::endl;
+        }
+    }
+
+    bool SocketInterface::Send(const Message &m, uint32_t connection) {
+        Connection *conn = find(connection);
+        if(conn == nullptr || conn->fd < 0) {
             return false;
         }
 
-        // Get the header as an array of bytes and its length
-        auto buf = m.header.ToByteArray();
-        int len = m.header.Size();
+        Message::Header header = m.header;
+        header.rev = conn->sendRev;
+        header.checksum   = 0;
+        header.payloadCrc = 0;
+        uint32_t checksums = conn->checksums & Message::Checksums(conn->sendRev);
+        uint64_t total = m.payload.size();
+        if(conn->sendRev == 1) {
+            // Revision 1 can't split a message up or say it passed a descriptor
+            if(total > Message::MaxPayload || m.fd) return false;
+        } else {
+            header.totalLen  = total;
+            header.requestId = conn->nextRequestId++;
+            if(conn->nextRequestId == 0) conn->nextRequestId = 1;
+        }
+
+        // Revision 1 messages are always one piece
+        uint64_t at = 0;
+        do {
+            uint64_t len = std::min<uint64_t>(total - at, Message::MaxPayload);
+            header.pLen   = len;
+            header.offset = at;
+            header.flags  = (at + len < total) ? Message::Header::FlagMore : 0;
+            std::shared_ptr<Message::PassedFd> passFd;
+            if(at == 0 && m.fd) {
+                header.flags |= Message::Header::FlagFd;
+                passFd = m.fd;
+            }
+            if(checksums & Message::ChecksumPayload) {
+                header.flags |= Message::Header::FlagPayloadCrc;
+                header.payloadCrc = Crc32c(m.payload.data() + at, len);
+            }
+
+            // Get the header as bytes, and send it and the payload together
+            uint8_t buf[Message::Header::MaxSize];
+            uint32_t hLen = header.Serialize(buf, (checksums & Message::ChecksumHeader) != 0);
 
-        // Sanity check
-        if(buf == nullptr || len <= 0) return false;
+            // Sanity check
+            if(hLen == 0) return false;
 
-        // If the other side has closed the socket on us these writes will
-        //  generate a SIGPIPE - broken pipe signal.
-        // The server handles that and will call CloseConnection so we don't
-        //  do anything about that here
-        
-        // Write the header data to the socket.  buf is a unique_ptr
-        int wrote = write(clientSocket, buf.get(), len);
+            // On a packet socket the header and as much of the payload as fits go in one
+            //  packet, and the rest of the payload follows in packets of its own
+            const uint8_t *payload = m.payload.data() + at;
+            uint64_t first = conn->packet ? std::min<uint64_t>(len, packetSize - hLen) : len;
+            bool sent = write(*conn, buf, hLen, payload, first, passFd);
+            for(uint64_t pAt = first; sent && pAt < len; pAt += packetSize) {
+                sent = write(*conn, nullptr, 0, payload + pAt, std::min<uint64_t>(packetSize, len - pAt), nullptr);
+            }
+            if(!sent) {
+                // The other side closed the socket on us
+                debug << Debug::Mode::Info << "Failed to send to client " << conn->id << ": " << strerror(errno) << std::endl;
+                closeConnection(*conn);
+                return false;
+            }
+            at += len;
+        } while(at < total);
+
+        return true;
+    }
+
+    void SocketInterface::SetRevision(uint16_t rev, uint32_t connection) {
+        Connection *conn = find(connection);
+        if(conn) conn->sendRev = rev;
+    }
 
-        // Then we have to write the payload data
-        int pLen = m.payload.size();
-        int wroteP = write(clientSocket, m.payload.data(), pLen);
+    void SocketInterface::SetPayloadSink(uint8_t type, uint8_t subType, const SinkFactory &factory) {
+        uint16_t key = ((uint16_t)type << 8) | subType;
+        if(factory) sinks[key] = factory;
+        else        sinks.erase(key);
+    }
 
-        return (wrote == len && wroteP == pLen);
+    void SocketInterface::SetChecksums(uint32_t checksums, uint32_t connection) {
+        Connection *conn = find(connection);
+        if(conn) conn->checksums = checksums;
+    }
+
+    uint16_t SocketInterface::Revision(uint32_t connection) const {
+        Connection *conn = find(connection);
+        return conn ? conn->sendRev : Message::DefaultRev;
     }
 
     void SocketInterface::Stop() {
-        if(clientSocket >= 0) {
-            close(clientSocket);
-            clientSocket = -1;
-        }
+        for(auto &conn : connections) closeConnection(*conn.second);
         if(serverSocket >= 0) {
             close(serverSocket);
             serverSocket = -1;
@@ -231,6 +720,7 @@ namespace iVeiOTA {
 
     SocketInterface::~SocketInterface() {
         Stop();
+        if(epollFd >= 0) close(epollFd);
     }
 
     bool SocketInterface::IsOpen() const {
@@ -242,13 +732,22 @@ namespace iVeiOTA {
     }
 
     bool SocketInterface::ClientConnected() const {
-        return clientSocket >= 0;
+        for(auto &conn : connections) {
+            if(conn.second->fd >= 0) return true;
+        }
+        return false;
     }
 
-  void SocketInterface::CloseConnection() {
-    if(clientSocket >= 0) {
-      close(clientSocket);
-      clientSocket = -1;
-    }
+  void SocketInterface::CloseConnection(uint32_t connection) {
+    Connection *conn = find(connection);
+    if(conn) closeConnection(*conn);
+    reap();
+  }
+
+  void SocketInterface::PauseReading(uint32_t connection, bool paused) {
+    Connection *conn = find(connection);
+    if(conn == nullptr || conn->closing || conn->paused == paused) return;
+    conn->paused = paused;
+    rewatch(*conn);
   }
 };
@@ -4,6 +4,9 @@
 #include <string>
 #include <cstdlib>
 #include <functional>
+#include <deque>
+#include <map>
+#include <memory>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/select.h>
@@ -22,14 +25,55 @@ class SocketInterface {
     public:
     typedef std::function< void (const Message &message) > OTAMessageCallback;
 
-    SocketInterface(OTAMessageCallback callback, bool server = false, 
-                    const std::string &name = IVEIOTA_DEFAULT_SOCK_NAME);
+    // A server takes any number of clients at once.  Every message handed to the callback
+    //  says which connection it came in on (Message::connection), and that is where the
+    //  response should be sent
+    // type is SOCK_STREAM or SOCK_SEQPACKET.  A packet socket keeps the messages apart, so
+    //  there is no sync to look for.  A client asking for packets falls back to a stream
+    //  if that is all the server takes
+    SocketInterface(OTAMessageCallback callback, bool server = false,
+                    const std::string &name = IVEIOTA_DEFAULT_SOCK_NAME,
+                    int type = IVEIOTA_DEFAULT_SOCK_TYPE);
 
-  bool Process();
+    // The socket type for a name in the config file ("stream" or "seqpacket"), -1 if unknown
+    static int SocketType(const std::string &name);
 
+    // Messages of type:subType with a payload are first shown (header only) to factory.  If
+    //  it returns a sink the payload goes to that as it arrives, and the message reaches
+    //  the callback with the sink and no payload.  Fragments that go to a sink are handed
+    //  over one at a time, not put back together.  Otherwise the payload is collected
+    typedef std::function<std::shared_ptr<Message::PayloadSink> (const Message &message)> SinkFactory;
+    void SetPayloadSink(uint8_t type, uint8_t subType, const SinkFactory &factory);
+
+  // Wait up to timeout ms (-1 for as long as it takes) for something to happen on any
+  //  connection, or a watched fd, and handle it
+  bool Process(int timeout = 1000);
+
+  // Have Process() call handler whenever fd is readable, so other threads can wake the
+  //  loop up (with an eventfd) instead of it polling them.  handler has to read fd
+  bool Watch(int fd, const std::function<void()> &handler);
+
+  // Parse data as if it came in on the client connection
   void ProcessData(uint8_t *data, int dataLen);
-  
-  bool Send(const Message &m);
+
+  // Send a message using the connection's protocol revision.  From revision 2 a payload
+  //  larger than MaxPayload is split into fragments, and the message's fd (if it has one)
+  //  is passed along with it.  connection 0 is the connection whose message is being
+  //  handled right now, or for a client, the server
+  // Send never waits.  Whatever the socket won't take now is queued and sent from Process()
+  //  as the other side reads it.  Returns false if the connection is gone, or has fallen
+  //  so far behind (maxQueued) that it was dropped
+  bool Send(const Message &m, uint32_t connection = 0);
+
+  // The protocol revision to send with on a connection.  Every new connection starts at
+  //  revision 1 until Initialize agrees on something else
+  void SetRevision(uint16_t rev, uint32_t connection = 0);
+  uint16_t Revision(uint32_t connection = 0) const;
+
+  // The checksums (Message::ChecksumHeader, ChecksumPayload) to add to what we send on a
+  //  connection, as agreed at Initialize.  Only those the revision has are added.  What
+  //  comes in is checked whenever it has a checksum
+  void SetChecksums(uint32_t checksums, uint32_t connection = 0);
 
   void Stop();
 
@@ -38,35 +82,108 @@ class SocketInterface {
   bool IsOpen() const;
 
   bool Listening() const;
-  
+
   bool ClientConnected() const;
-  void CloseConnection();
-  
+  // Close a connection (0 as for Send)
+  void CloseConnection(uint32_t connection = 0);
+
+  // Stop reading a connection until it is resumed, to hold a client back while what it
+  //  already sent is dealt with.  Its messages wait in the socket meanwhile, and once
+  //  that is full the client's sends wait.  Sending to it carries on as usual
+  void PauseReading(uint32_t connection, bool paused);
+
 protected:
   bool               server;          // Is this instance a server
   int                serverSocket;    // Socket for listening server
-  int                clientSocket;    // Socket for client communication 
   OTAMessageCallback callback;        // Function to call when a message is received
-  
+  int                socketType;      // SOCK_STREAM or SOCK_SEQPACKET
+
 private:
   enum class messageState {
     WaitingSync,
     ReadingHeader,
     ReadingPayload,
   };
-  messageState state;
-  
-  // Where are we in looking for the sync bytes
-  uint32_t syncAt;
-  
-  // TODO: maybe need to change this
-  constexpr static int rdbufLen = 1024*1024;
-  uint8_t              rdbuf[rdbufLen]; // Read up to 1M at a time from the socket
-  
-  uint16_t             hbufPos;   // Where we are in trying to read a full header
-  uint8_t              hbuf[128]; // large enough to accomadate a header message
-  
-  Message message;    // Message we construct as we are reading from the socket
+
+  // Everything we keep for one connected socket.  Each client is parsed on its own, so
+  //  a slow or half sent message from one doesn't hold up the others
+  struct Connection {
+    explicit Connection(int fd, uint32_t id);
+
+    int      fd;
+    uint32_t id;        // Never reused, unlike fd
+    bool     closing;   // Close once we are done with what we are reading
+
+    messageState state;
+    uint32_t syncAt;    // Where are we in looking for the sync bytes
+    uint16_t hbufPos;   // Where we are in trying to read a full header
+    uint8_t  hbuf[128]; // large enough to accomadate a header message
+    Message  message;   // Message we construct as we are reading from the socket
+
+    // Revision 2 fragments of a message that fits in MaxPayload are put back together before
+    //  the callback sees them.  Larger messages are handed over a fragment at a time
+    Message  partial;   // The message being put back together
+    bool     gathering; // True if partial holds the start of a message
+
+    // Descriptors passed to us that no header has claimed yet, oldest first
+    std::deque<std::shared_ptr<Message::PassedFd>> receivedFds;
+
+    uint16_t sendRev;       // Protocol revision we send with
+    uint32_t nextRequestId; // For fragmented messages we send
+    uint32_t checksums;     // Checksums we add to what we send
+    uint32_t payloadCrc;    // CRC32C of the payload read so far
+    uint32_t received;      // Bytes of the payload read so far, whether kept or sunk
+    bool     sinkFailed;    // The sink didn't want the rest of the payload
+
+    // What we have to send that the socket hasn't taken yet, oldest first
+    struct Outgoing {
+      std::vector<uint8_t> data;
+      size_t sent;
+      std::shared_ptr<Message::PassedFd> fd; // Goes with the first byte of data
+    };
+    std::deque<Outgoing> outbound;
+    uint64_t queued;        // Bytes in outbound not sent yet
+    bool     wantWrite;     // Waiting in epoll for the socket to be writable
+    bool     paused;        // Not reading from the socket for now (PauseReading)
+    bool     packet;        // A SOCK_SEQPACKET connection.  Each entry in outbound is a packet
+  };
+
+  void processData(Connection &conn, uint8_t *data, int dataLen);
+  void deliver(Connection &conn);
+  int receive(Connection &conn);
+  // Send header and payload, queueing what the socket won't take.  Returns false if the
+  //  connection has to be closed
+  bool write(Connection &conn, const uint8_t *header, size_t hLen,
+             const uint8_t *payload, size_t len, const std::shared_ptr<Message::PassedFd> &fd);
+  // Send what is queued, as much as the socket will take
+  bool flush(Connection &conn);
+  void watchWrites(Connection &conn, bool want);
+  // Tell epoll what we are waiting for on the connection now
+  void rewatch(Connection &conn);
+  bool accept();
+  void closeConnection(Connection &conn);
+  void reap();
+  // The connection an id (or 0) refers to, or nullptr
+  Connection *find(uint32_t connection) const;
+
+  int epollFd;
+  std::map<uint32_t, std::unique_ptr<Connection>> connections;
+  std::map<uint32_t, std::function<void()>> watched;   // Handlers for Watch()ed fds, by id
+  std::map<uint16_t, SinkFactory> sinks;               // By type << 8 | subType
+  uint32_t    nextConnection;  // Id for the next client
+  Connection *current;         // The connection whose message is being handled, if any
+  Connection *client;          // Our connection to the server if we are a client
+
+  constexpr static int maxFdsPerRead = 8;
+  constexpr static int maxEvents     = 32;
+  constexpr static int listenBacklog = 16;
+  constexpr static uint64_t maxQueued = 64 * 1024 * 1024; // Most we hold for a client not reading
+  constexpr static uint64_t packetSize = 64 * 1024;       // Largest packet we send on a packet socket
+
+  // Read up to 256K at a time from the socket.  Kept off the stack, since interfaces
+  //  often live there
+  constexpr static int rdbufLen = 256*1024;
+  std::unique_ptr<uint8_t[]> rdbuf;
 };
 };
 
@@ -7,11 +7,21 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <array>
+#include <algorithm>
+#include <climits>
+#include <cctype>
+#include <mutex>
 
+#include "iveiota.hh"
 #include "support.hh"
 #include "debug.hh"
 #include "config.hh"
+#include "ext_fs.hh"
+#include "hash.hh"
 
 namespace iVeiOTA {
   Partition GetPartition(const std::string &name) {
@@ -39,9 +49,18 @@ namespace iVeiOTA {
     else                 return HashAlgorithm::Unknown;
   }
   
-  std::string GetHashValue(HashAlgorithm hashType, const std::string &filePath) {
-    if(hashType == HashAlgorithm::None || hashType == HashAlgorithm::Unknown) return "";
-    
+  // Build the options for the copy engine from the config file
+  static CopyOptions configuredCopyOptions() {
+    CopyOptions options(GetCopyMethod(config.GetOption("copy_method", "auto")));
+    options.depth     = config.GetOptionInt("copy_depth", options.depth);
+    options.blockSize = config.GetOptionInt("copy_block_size", options.blockSize);
+    options.direct    = config.GetOptionInt("copy_direct", 0) != 0;
+    return options;
+  }
+
+  // The old way of hashing: run the program from hash_prog and pick the hash out of what
+  //  it prints
+  static std::string externalHashValue(HashAlgorithm hashType, const std::string &filePath) {
     // First we have to get the command to run
     std::string prog = config.GetHashAlgorithmProgram(hashType);
     std::string ret  = RunCommand(prog + " " + filePath);
@@ -55,7 +74,199 @@ namespace iVeiOTA {
     //  double spaces should be collapsed, but need to make sure
     std::vector<std::string> toks = Split(ret, " \t");
     if(toks.size() >= 2 && toks.size() < 4) return toks[0];
-    else return "";    
+    else return "";
+  }
+
+  // Hashes of files we have already read, so a resumed or retried update doesn't read a
+  //  staged chunk again.  A file is known by its device and inode, and the entry only
+  //  counts while the size, mtime and ctime are the same as when it was hashed.  Kept in
+  //  the cache directory as lines of dev:ino:algorithm:size:mtime:ctime:hash
+  class HashCache {
+  public:
+    static std::string Key(const struct stat &ss, HashAlgorithm hashType) {
+      return std::to_string(ss.st_dev) + ":" + std::to_string(ss.st_ino) + ":" + ToString(hashType);
+    }
+    static std::string Stamp(const struct stat &ss) {
+      return std::to_string(ss.st_size) + ":" +
+        std::to_string(ss.st_mtim.tv_sec * 1000000000ULL + ss.st_mtim.tv_nsec) + ":" +
+        std::to_string(ss.st_ctim.tv_sec * 1000000000ULL + ss.st_ctim.tv_nsec);
+    }
+
+    std::string Find(const std::string &key, const std::string &stamp) {
+      std::lock_guard<std::mutex> guard(lock);
+      load();
+      auto it = entries.find(key);
+      if(it == entries.end() || it->second.first != stamp) return "";
+      return it->second.second;
+    }
+
+    void Add(const std::string &key, const std::string &stamp, const std::string &hash) {
+      std::lock_guard<std::mutex> guard(lock);
+      load();
+      entries[key] = std::make_pair(stamp, hash);
+      // Lines are only appended, the last one for a file wins.  Once there are a lot more
+      //  lines than files, write out just the files
+      if(++lines > 2 * entries.size() + 64) {
+        compact();
+        return;
+      }
+      std::string line = key + ":" + stamp + ":" + hash + "\n";
+      int fd = open(path().c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+      if(fd < 0 || write(fd, line.data(), line.length()) != (ssize_t)line.length() || fdatasync(fd) != 0) {
+        debug << Debug::Mode::Warn << "Could not save the hash cache" << std::endl;
+      }
+      if(fd >= 0) close(fd);
+    }
+
+  private:
+    static std::string path() { return std::string(IVEIOTA_CACHE_LOCATION) + "/hash_cache"; }
+
+    // How long the hex hash is for an algorithm, by the name the key has for it
+    static size_t hashLength(const std::string &algo) {
+      if(algo == ToString(HashAlgorithm::MD5))    return 32;
+      if(algo == ToString(HashAlgorithm::SHA1))   return 40;
+      if(algo == ToString(HashAlgorithm::SHA256)) return 64;
+      if(algo == ToString(HashAlgorithm::SHA512)) return 128;
+      return 0;
+    }
+
+    void load() {
+      if(loaded) return;
+      loaded = true;
+      std::ifstream in(path());
+      std::string line;
+      bool bad = false;
+      while(std::getline(in, line)) {
+        lines++;
+        // A line cut short by a power cut can still have all its fields, so the hash has
+        //  to be whole too.  Otherwise a good file would fail its hash until the file changed
+        std::vector<std::string> toks = Split(line, ":");
+        if(toks.size() != 7 || toks[6].length() != hashLength(toks[2]) ||
+           toks[6].find_first_not_of("0123456789abcdef") != std::string::npos) {
+          bad = true;
+          continue;
+        }
+        entries[toks[0] + ":" + toks[1] + ":" + toks[2]] = std::make_pair(toks[3] + ":" + toks[4] + ":" + toks[5], toks[6]);
+      }
+      // Get rid of anything bad before more is appended after it
+      if(bad) compact();
+    }
+
+    // Write out just the files we know, to a new file that replaces the old one once it
+    //  is all on the disk, so a power cut leaves one or the other
+    void compact() {
+      std::string temp = path() + ".new";
+      int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if(fd < 0) {
+        debug << Debug::Mode::Warn << "Could not save the hash cache" << std::endl;
+        return;
+      }
+
+      std::string data;
+      for(const auto &entry : entries) data += entry.first + ":" + entry.second.first + ":" + entry.second.second + "\n";
+      bool ok = write(fd, data.data(), data.length()) == (ssize_t)data.length() && fsync(fd) == 0;
+      close(fd);
+      if(!ok || rename(temp.c_str(), path().c_str()) != 0) {
+        debug << Debug::Mode::Warn << "Could not save the hash cache" << std::endl;
+        unlink(temp.c_str());
+        return;
+      }
+      lines = entries.size();
+    }
+
+    std::mutex lock;
+    bool loaded = false;
+    size_t lines = 0;
+    std::map<std::string, std::pair<std::string, std::string>> entries;  // key -> stamp, hash
+  };
+  static HashCache hashCache;
+
+  static std::string hashValue(HashAlgorithm hashType, const std::string &filePath);
+
+  std::string GetHashValue(HashAlgorithm hashType, const std::string &filePath) {
+    if(hashType == HashAlgorithm::None || hashType == HashAlgorithm::Unknown) return "";
+
+    // Only regular files can be known again.  A pipe or device could give different data
+    //  every time
+    struct stat before;
+    bool cache = config.GetOptionInt("hash_cache", 1) != 0 &&
+      stat(filePath.c_str(), &before) == 0 && S_ISREG(before.st_mode);
+    std::string key, stamp;
+    if(cache) {
+      key   = HashCache::Key(before, hashType);
+      stamp = HashCache::Stamp(before);
+      std::string hash = hashCache.Find(key, stamp);
+      if(hash.length() > 0) {
+        debug << Debug::Mode::Info << "Hash of " << filePath << " is cached" << std::endl;
+        return hash;
+      }
+    }
+
+    std::string hash = hashValue(hashType, filePath);
+
+    // If the file changed while we read it, we don't know which version the hash is of
+    struct stat after;
+    if(cache && hash.length() > 0 && stat(filePath.c_str(), &after) == 0 &&
+       HashCache::Key(after, hashType) == key && HashCache::Stamp(after) == stamp) {
+      hashCache.Add(key, stamp, hash);
+    }
+    return hash;
+  }
+
+  static std::string hashValue(HashAlgorithm hashType, const std::string &filePath) {
+    std::string engine = config.GetOption("hash_engine", "native");
+    if(engine == "external") return externalHashValue(hashType, filePath);
+
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if(fd < 0) {
+      debug << "File did not exist to hash" << std::endl;
+      return "";
+    }
+    struct stat ss;
+    uint64_t size = (fstat(fd, &ss) == 0) ? ss.st_size : 0;
+
+    // Reads are kept in flight ahead of the hashing, so the two overlap
+    Hasher hasher(hashType, engine != "portable");
+    CopyStats stats;
+    uint64_t hashed = ReadData(fd, 0, 0, [&hasher](const uint8_t *data, uint64_t len) {
+        hasher.Update(data, len);
+        return 0;
+      }, configuredCopyOptions(), nullptr, &stats);
+    close(fd);
+
+    if(hashed != size) {
+      debug << Debug::Mode::Warn << "Only hashed " << hashed << " of " << size << " bytes of " << filePath << std::endl;
+      return "";
+    }
+    debug << Debug::Mode::Info << "Hashed " << filePath << " with " << ToString(hashType) << " (" <<
+      hasher.Engine() << ") in " << stats.seconds << "s" << std::endl;
+    return hasher.Final();
+  }
+
+  std::string GetHashValue(HashAlgorithm hashType, const std::string &path, uint64_t offset, uint64_t size) {
+    if(hashType == HashAlgorithm::None || hashType == HashAlgorithm::Unknown || size == 0) return "";
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+      debug << "Could not open " << path << " to hash" << std::endl;
+      return "";
+    }
+
+    Hasher hasher(hashType, config.GetOption("hash_engine", "native") != "portable");
+    CopyStats stats;
+    uint64_t hashed = ReadData(fd, offset, size, [&hasher](const uint8_t *data, uint64_t len) {
+        hasher.Update(data, len);
+        return 0;
+      }, configuredCopyOptions(), nullptr, &stats);
+    close(fd);
+
+    if(hashed != size) {
+      debug << Debug::Mode::Warn << "Only hashed " << hashed << " of " << size << " bytes of " << path << " at " << offset << std::endl;
+      return "";
+    }
+    debug << Debug::Mode::Info << "Hashed " << size << " bytes of " << path << " at " << offset << " with " <<
+      ToString(hashType) << " in " << stats.seconds << "s" << std::endl;
+    return hasher.Final();
   }
 
   std::string RunCommandWithRet(std::string command, int &ret) {
@@ -108,57 +319,260 @@ namespace iVeiOTA {
     return result;
   }
   
+  // Copy from the resume point (if any) to the end, stopping every resume->interval bytes
+  //  to sync the destination and checkpoint.  Returns how far into the source we got
+  // How much is copied between progress reports
+  static const uint64_t progressStep = 16 * 1024 * 1024;
+
+  static uint64_t checkpointedCopy(int otf, uint64_t offset, int inf, uint64_t len, Hasher *hasher,
+                                   const CopyResume *resume, volatile bool *cancel, CopyStats *stats) {
+    CopyOptions options = configuredCopyOptions();
+    if(hasher != nullptr) {
+      // Hash the data as the copy engine reads it, so the source is only read once
+      options.tap = [hasher](const uint8_t *data, uint64_t length) {
+        hasher->Update(data, length);
+        return 0;
+      };
+    }
+
+    uint64_t done = (resume != nullptr) ? resume->from.offset : 0;
+    uint64_t interval = (resume != nullptr) ? resume->interval : 0;
+    bool reporting = (resume != nullptr && resume->progress);
+    if(interval == 0 && !reporting) {
+      if(done > 0 && len == 0) return done;
+      return done + CopyData(otf, offset + done, inf, done, len - done, options, cancel, stats);
+    }
+
+    if(len == 0) {
+      struct stat ss;
+      if(fstat(inf, &ss) != 0) return done;
+      len = ss.st_size;
+    }
+    uint64_t nextCheckpoint = (interval > 0) ? done + interval : len;
+    while(done < len) {
+      // Copy in pieces small enough to report progress now and then
+      uint64_t step = std::min(nextCheckpoint, len) - done;
+      if(reporting) step = std::min(step, progressStep);
+      uint64_t copied = CopyData(otf, offset + done, inf, done, step, options, cancel, stats);
+      done += copied;
+      if(reporting) resume->progress(done);
+      if(copied != step || done == len) break;
+      if(done < nextCheckpoint) continue;
+      nextCheckpoint += interval;
+
+      // Only checkpoint what is really on the device
+      if(fdatasync(otf) != 0) {
+        debug << Debug::Mode::Warn << "Could not sync for a checkpoint: " << strerror(errno) << std::endl;
+        continue;
+      }
+      if(resume->checkpoint) {
+        CopyCheckpoint point;
+        point.offset = done;
+        if(hasher != nullptr) point.hashState = hasher->SaveState();
+        resume->checkpoint(point);
+      }
+    }
+    return done;
+  }
+
   uint64_t CopyFileData(const std::string &dest, const std::string &src,
                         uint64_t offset, uint64_t len,
-                        volatile bool *cancel) {
-    debug << Debug::Mode::Debug << "Made it here" << std::endl;
+                        volatile bool *cancel, CopyStats *stats, const CopyResume *resume) {
     uint64_t totalWritten = 0;
-    bool copyAll = (len == 0);
-    try {
-     debug << Debug::Mode::Debug << "Copying from " << src << " to " << dest << std::endl;
-      // TODO: This seems too easy.  Go back and double check all this
-      int inf = open(src.c_str(), O_RDONLY);
-      int otf = open(dest.c_str(), O_WRONLY);
-      debug << "Seeking" << std::endl;
-      int res = lseek(otf, offset, SEEK_SET);
-
-      debug << "Starting: " << inf << ":" << otf << ":" << res << std::endl;
-      if(inf < 0 || otf < 0 || res < 0) return 0;
-      
-      char buf[1024*1024];
-      uint64_t remaining = len;
-      int printCount = 0;
-      while((copyAll || remaining > 0) && 
-            (cancel != nullptr && !(*cancel))) {
-        uint64_t toRead = (uint64_t)1024*1024;
-        if(!copyAll) toRead = std::min(toRead, remaining);
-        
-        size_t bread = read(inf, buf, toRead);
-        size_t wrote = write(otf, buf, bread);
+    debug << Debug::Mode::Debug << "Copying from " << src << " to " << dest << std::endl;
 
-        if(wrote != bread) {
-          debug << "Wrote different value than read" << std::endl;
-          break;
-        }
-        
-        totalWritten += bread;
-        if(!copyAll) remaining -= bread;
-
-        if(bread != toRead || bread == 0) break;
-        if((printCount++ % 100) == 0) {
-          debug << "Copying " << totalWritten << std::endl;
-          printCount = 1;
-        }
-      } // end while
-      close(inf);
-      close(otf);
-    } catch(...) {
-      
+    int inf = open(src.c_str(), O_RDONLY);
+    int otf = open(dest.c_str(), O_WRONLY);
+    debug << "Starting: " << inf << ":" << otf << std::endl;
+    if(inf >= 0 && otf >= 0) {
+      // The copy engine picks the fastest way it can find to move the data
+      totalWritten = checkpointedCopy(otf, offset, inf, len, nullptr, resume, cancel, stats);
     }
+    if(inf >= 0) close(inf);
+    if(otf >= 0) close(otf);
+
     debug << "After: " << totalWritten << std::endl;
     return totalWritten;
   }
 
+  // Tell the destination that a range of it no longer holds anything useful.  For eMMC
+  //  a discard lets the device skip garbage collecting those blocks.  Returns false if
+  //  the device can't do it
+  static bool releaseRange(int fd, uint64_t offset, uint64_t len, bool zero) {
+    struct stat ss;
+    if(len == 0) return true;
+    if(fstat(fd, &ss) != 0) return false;
+
+    if(S_ISBLK(ss.st_mode)) {
+      uint64_t range[2] = {offset, len};
+      return ioctl(fd, zero ? BLKZEROOUT : BLKDISCARD, range) == 0;
+    } else {
+      // File backed stand-ins get a hole, which reads back as zeros either way
+      return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0;
+    }
+  }
+
+  bool InvalidateRange(int fd, uint64_t offset, uint64_t len) {
+    return releaseRange(fd, offset, len, true);
+  }
+
+  uint64_t ClonePartition(const std::string &dest, const std::string &src,
+                          volatile bool *cancel, CopyStats *stats) {
+    std::string ftype = config.GetFilesystemType(src);
+    bool sparse = config.GetOptionInt("clone_sparse", 1) != 0 &&
+      (ftype == "ext2" || ftype == "ext3" || ftype == "ext4");
+
+    // The alternate container usually holds the previous release, so most of it is
+    //  already right.  Comparing first means we only write the blocks that changed
+    bool compare = config.GetOptionInt("clone_compare", 0) != 0;
+    CopyOptions options = configuredCopyOptions();
+    if(compare) options.method = CopyMethod::Compare;
+
+    int inf = open(src.c_str(), O_RDONLY);
+    int otf = open(dest.c_str(), compare ? O_RDWR : O_WRONLY);
+    if(inf < 0 || otf < 0) {
+      debug << Debug::Mode::Err << "Could not open " << src << " or " << dest << " for cloning" << std::endl;
+      if(inf >= 0) close(inf);
+      if(otf >= 0) close(otf);
+      return 0;
+    }
+
+    // Small gaps between used ranges are cheaper to copy than to skip
+    std::vector<Extent> extents;
+    uint64_t fsBytes = 0;
+    if(sparse && !GetExtAllocatedExtents(inf, extents, fsBytes, 64 * 1024)) {
+      debug << Debug::Mode::Info << "Can't clone " << src << " sparsely, copying all of it" << std::endl;
+      sparse = false;
+    }
+    if(!sparse) {
+      // A zero length extent copies everything
+      extents.assign(1, Extent(0, 0));
+    }
+
+    // What to do with the ranges of the destination the filesystem doesn't use
+    //  skip    - Leave whatever was there
+    //  discard - Discard them (the default)
+    //  zero    - Make sure they read back as zero
+    std::string unused = config.GetOption("clone_unused", "discard");
+    bool release = sparse && (unused == "discard" || unused == "zero");
+    bool zero = (unused == "zero");
+
+    CopyStats total;
+    uint64_t copied = 0;
+    uint64_t at = 0;
+    bool complete = true;
+    for(const Extent &e : extents) {
+      if(cancel != nullptr && *cancel) {
+        complete = false;
+        break;
+      }
+
+      // Deal with the gap in front of this extent first
+      if(release && !releaseRange(otf, at, e.offset - at, zero)) {
+        debug << Debug::Mode::Warn << "Could not " << unused << " unused range of " << dest << ": " <<
+          strerror(errno) << std::endl;
+        release = false;
+      }
+      total.bytesSkipped += e.offset - at;
+
+      CopyStats one;
+      uint64_t wrote = CopyData(otf, e.offset, inf, e.offset, e.length, options, cancel, &one);
+      copied += wrote;
+      total.method         = one.method;
+      total.bytesRead     += one.bytesRead;
+      total.bytesWritten  += one.bytesWritten;
+      total.bytesCompared += one.bytesCompared;
+      total.seconds       += one.seconds;
+      if(e.length != 0 && wrote != e.length) {
+        complete = false;
+        break;
+      }
+      at = e.End();
+    }
+
+    if(sparse && complete && at < fsBytes) {
+      if(release) releaseRange(otf, at, fsBytes - at, zero);
+      total.bytesSkipped += fsBytes - at;
+    }
+    close(inf);
+    close(otf);
+
+    debug << Debug::Mode::Info << "Clone of " << src << " covered " << copied << " bytes, wrote " <<
+      total.bytesWritten << ", compared " << total.bytesCompared << " and skipped " << total.bytesSkipped << std::endl;
+    if(stats != nullptr) *stats = total;
+    return copied;
+  }
+
+  uint64_t CopyFileDataVerified(const std::string &dest, const std::string &src, uint64_t off, uint64_t size,
+                                HashAlgorithm algo, const std::string &expected,
+                                volatile bool *cancel, CopyStats *stats, const CopyResume *resume) {
+    int inf = open(src.c_str(), O_RDONLY);
+    int otf = open(dest.c_str(), O_WRONLY);
+    if(inf < 0 || otf < 0) {
+      debug << Debug::Mode::Err << "Could not open " << src << " or " << dest << " for a verified copy" << std::endl;
+      if(inf >= 0) close(inf);
+      if(otf >= 0) close(otf);
+      return 0;
+    }
+
+    Hasher hasher(algo, config.GetOption("hash_engine", "native") != "portable");
+    CopyResume fromStart;
+    if(resume != nullptr && resume->from.offset > 0 && !hasher.RestoreState(resume->from.hashState)) {
+      // Without the hash of what is already written we have to write it all again
+      debug << Debug::Mode::Warn << "Bad hash state in the checkpoint for " << src << ", starting over" << std::endl;
+      fromStart = *resume;
+      fromStart.from.offset = 0;
+      resume = &fromStart;
+    }
+    uint64_t written = checkpointedCopy(otf, off, inf, size, &hasher, resume, cancel, stats);
+    std::string hashValue = hasher.Final();
+
+    bool good = (written == size || size == 0) && hashValue == expected;
+    if(good) {
+      // Don't call it done until it is on the device
+      good = (fdatasync(otf) == 0);
+    }
+    if(!good) {
+      // Whatever we wrote can't be trusted, so make sure nothing mistakes it for the image
+      debug << Debug::Mode::Warn << "Verified copy of " << src << " failed (" << hashValue << "::" << expected <<
+        ", wrote " << written << " of " << size << ").  Invalidating " << dest << " at " << off << std::endl;
+      if(!releaseRange(otf, off, written, true)) {
+        debug << Debug::Mode::Err << "Could not invalidate " << dest << ": " << strerror(errno) << std::endl;
+      }
+      written = 0;
+    }
+
+    close(inf);
+    close(otf);
+    return written;
+  }
+
+  std::string GetPhysicalDevice(const std::string &dev) {
+    if(dev.empty() || dev == "none") return "";
+
+    // sysfs knows: a partition's directory is inside the directory of its disk
+    struct stat ss;
+    if(stat(dev.c_str(), &ss) == 0 && S_ISBLK(ss.st_mode)) {
+      std::string sys = "/sys/dev/block/" + std::to_string(major(ss.st_rdev)) + ":" +
+        std::to_string(minor(ss.st_rdev));
+      char real[PATH_MAX];
+      if(realpath(sys.c_str(), real) != nullptr) {
+        std::string path(real);
+        if(access((path + "/partition").c_str(), F_OK) == 0) path = path.substr(0, path.rfind('/'));
+        return path.substr(path.rfind('/') + 1);
+      }
+    }
+
+    // Otherwise go by the name: mmcblk1p3 -> mmcblk1, sda3 -> sda.  mtdblock0 is its own device
+    std::string name = dev.substr(dev.rfind('/') + 1);
+    size_t last = name.find_last_not_of("0123456789");
+    if(last != std::string::npos && last + 1 < name.length()) {
+      if(name[last] == 'p' && last > 0 && isdigit(name[last - 1])) return name.substr(0, last);
+      if(name.compare(0, 2, "sd") == 0) return name.substr(0, last + 1);
+    }
+    return name;
+  }
+
   bool IsDir(std::string dir_path) {
     struct stat ss;
 
@@ -171,6 +585,25 @@ namespace iVeiOTA {
     }
   }
 
+  bool ReadDescriptor(int fd, std::string &data, size_t max) {
+    data.clear();
+    char buf[4096];
+    bool seekable = true;
+    while(data.length() <= max) {
+      ssize_t got = seekable ? pread(fd, buf, sizeof(buf), data.length()) : read(fd, buf, sizeof(buf));
+      if(got < 0 && errno == EINTR) continue;
+      if(got < 0 && errno == ESPIPE && seekable && data.empty()) {
+        // A pipe or socket, so just read what comes
+        seekable = false;
+        continue;
+      }
+      if(got < 0) return false;
+      if(got == 0) break;
+      data.append(buf, got);
+    }
+    return true;
+  }
+
   int RemoveFile(const std::string &path) {
     debug << Debug::Mode::Debug << "Trying to remove " << path << std::endl;
     // Just try and remove it
@@ -6,6 +6,9 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <functional>
+
+#include "copy_engine.hh"
 
 namespace iVeiOTA {
   enum class Partition {
@@ -77,17 +80,70 @@ namespace iVeiOTA {
     default: return "<<Error>>";
     }
   }
+  // The hash of a file as lower case hex, "" if it couldn't be read.  Hashes of regular
+  //  files are remembered (option hash_cache) until the file changes
   std::string GetHashValue(HashAlgorithm hashType, const std::string &filePath);
+  // The hash of size bytes of a file or device at offset.  Always read, never cached
+  std::string GetHashValue(HashAlgorithm hashType, const std::string &path, uint64_t offset, uint64_t size);
   
   std::string RunCommand(std::string command);
   std::string RunCommandWithRet(std::string command, int &ret);
 
+  // Read everything in fd from its start (or from where it is, for a pipe), stopping once
+  //  more than max bytes have been read.  Returns false on a read error
+  bool ReadDescriptor(int fd, std::string &data, size_t max);
+
   int RemoveFile(const std::string &path);
   int RemoveAllFiles(const std::string &path, bool recursive);
 
+  // How far a checkpointed copy has got.  offset bytes from the start of the source are
+  //  synced to the destination, and hashState (from Hasher::SaveState) covers them.
+  //  hashState is empty if the copy isn't being hashed
+  struct CopyCheckpoint {
+    uint64_t offset;
+    std::string hashState;
+  };
+
+  // Lets a long copy be picked up where it left off.  The copy starts at from, and every
+  //  interval bytes the destination is synced and checkpoint is called so the caller can
+  //  remember how far it got.  An interval of 0 means no checkpoints.  progress, if set,
+  //  is told how many bytes are done every so often (every 16M or so)
+  struct CopyResume {
+    CopyCheckpoint from;
+    uint64_t interval;
+    std::function<void(const CopyCheckpoint&)> checkpoint;
+    std::function<void(uint64_t done)> progress;
+  };
+
+  // Copy size bytes (or the whole source if size is 0) from the start of src to dest at off.
+  //  stats, if given, reports how the copy was done.  With resume, the copy starts from
+  //  the checkpoint and the return counts the bytes copied before it too
   uint64_t CopyFileData(const std::string &dest, const std::string &src, uint64_t off, uint64_t size,
-                        volatile bool *cancel = 0);
+                        volatile bool *cancel = 0, CopyStats *stats = 0, const CopyResume *resume = 0);
+
+  // Copy an image like CopyFileData, hashing it with algo on the way through so the source
+  //  is only read once.  Only if every byte was written, the hash matches expected and the
+  //  data is synced is the copy good.  Otherwise the region written is invalidated and 0
+  //  is returned.  A resumed copy carries on from the checkpoint's hash state
+  uint64_t CopyFileDataVerified(const std::string &dest, const std::string &src, uint64_t off, uint64_t size,
+                                HashAlgorithm algo, const std::string &expected,
+                                volatile bool *cancel = 0, CopyStats *stats = 0,
+                                const CopyResume *resume = 0);
+
+  // Make sure nothing mistakes len bytes of fd at offset for good data.  They read back
+  //  as zeros afterwards.  Returns false if the device can't do it
+  bool InvalidateRange(int fd, uint64_t offset, uint64_t len);
+
+  // Clone an entire partition from src to dest.  ext filesystems are cloned sparsely
+  //  (only the blocks the filesystem uses) unless that is turned off in the config file
+  uint64_t ClonePartition(const std::string &dest, const std::string &src,
+                          volatile bool *cancel = 0, CopyStats *stats = 0);
   
+  // The whole device a partition lives on (mmcblk1 for /dev/block/mmcblk1p3), so writes to
+  //  the same flash part can be told apart from writes to another one.  Returns the name of dev
+  //  itself if it isn't a partition, and an empty string if there is no device (none)
+  std::string GetPhysicalDevice(const std::string &dev);
+
   //TODO: Consider replacing these with returns of unique_ptr if copying becomes too much
   std::vector<std::string> Split(std::string str, std::string delims);
   
@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <fstream>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "written_regions.hh"
+#include "debug.hh"
+
+namespace iVeiOTA {
+  // The log is lines of
+  //  w:device:offset:size:algorithm:hash  - the region was written
+  //  f:device:offset:size                 - the region was forgotten (size 0 for all of it,
+  //                                         and a device of * for every device)
+  // and the record is what replaying it gives.  A line cut off by a power cut is ignored
+  static std::string algorithmName(HashAlgorithm algo) {
+    std::string name = ToString(algo);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    return name;
+  }
+
+  WrittenRegions::WrittenRegions(const std::string &path) : path(path), lines(0) {
+    std::ifstream in(path);
+    std::string line;
+    while(std::getline(in, line)) {
+      lines++;
+      if(!apply(line)) debug << Debug::Mode::Warn << "Ignoring written region line: " << line << std::endl;
+    }
+
+    size_t regions = 0;
+    for(const auto &device : devices) regions += device.second.size();
+    debug << Debug::Mode::Info << "Know of " << regions << " written regions" << std::endl;
+    if(lines > 2 * regions + 64) compact();
+  }
+
+  bool WrittenRegions::apply(const std::string &line) {
+    std::vector<std::string> toks = Split(line, ":");
+    if(toks.size() == 4 && toks[0] == "f") {
+      forget(toks[1] == "*" ? "" : toks[1], strtoull(toks[2].c_str(), 0, 10), strtoull(toks[3].c_str(), 0, 10));
+      return true;
+    }
+    if(toks.size() == 6 && toks[0] == "w") {
+      Region region;
+      region.offset = strtoull(toks[2].c_str(), 0, 10);
+      region.size   = strtoull(toks[3].c_str(), 0, 10);
+      region.algo   = GetHashAlgorithm(toks[4]);
+      region.hash   = toks[5];
+      if(region.size == 0 || region.algo == HashAlgorithm::Unknown || region.algo == HashAlgorithm::None) return false;
+      forget(toks[1], region.offset, region.size);
+      devices[toks[1]].push_back(region);
+      return true;
+    }
+    return false;
+  }
+
+  void WrittenRegions::forget(const std::string &device, uint64_t offset, uint64_t size) {
+    if(device.empty()) {
+      devices.clear();
+      return;
+    }
+    auto it = devices.find(device);
+    if(it == devices.end()) return;
+    if(size == 0) {
+      devices.erase(it);
+      return;
+    }
+    std::vector<Region> &regions = it->second;
+    regions.erase(std::remove_if(regions.begin(), regions.end(), [offset, size](const Region &r) {
+          return r.offset < offset + size && offset < r.offset + r.size;
+        }), regions.end());
+  }
+
+  bool WrittenRegions::Holds(const std::string &device, uint64_t offset, uint64_t size,
+                             HashAlgorithm algo, const std::string &hash) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = devices.find(device);
+    if(it == devices.end()) return false;
+    for(const Region &region : it->second) {
+      if(region.offset == offset && region.size == size && region.algo == algo && region.hash == hash) return true;
+    }
+    return false;
+  }
+
+  void WrittenRegions::Record(const std::string &device, uint64_t offset, uint64_t size,
+                              HashAlgorithm algo, const std::string &hash) {
+    std::string line = "w:" + device + ":" + std::to_string(offset) + ":" + std::to_string(size) + ":" +
+      algorithmName(algo) + ":" + hash;
+    std::lock_guard<std::mutex> guard(lock);
+    if(!apply(line)) return;
+    log(line);
+  }
+
+  void WrittenRegions::Forget(const std::string &device, uint64_t offset, uint64_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    forget(device, offset, size);
+    log("f:" + (device.empty() ? std::string("*") : device) + ":" + std::to_string(offset) + ":" + std::to_string(size));
+  }
+
+  void WrittenRegions::log(const std::string &line) {
+    // Synced before going on, since whatever comes next may write over the region
+    std::string data = line + "\n";
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0 || write(fd, data.data(), data.length()) != (ssize_t)data.length() || fdatasync(fd) != 0) {
+      debug << Debug::Mode::Warn << "Failed to save written region: " << line << std::endl;
+      // If a forget didn't make it to the disk the record can't be trusted after a restart
+      if(fd >= 0) close(fd);
+      unlink(path.c_str());
+      return;
+    }
+    close(fd);
+    lines++;
+  }
+
+  void WrittenRegions::compact() {
+    std::string temp = path + ".new";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return;
+
+    std::string data;
+    size_t count = 0;
+    for(const auto &device : devices) {
+      for(const Region &region : device.second) {
+        data += "w:" + device.first + ":" + std::to_string(region.offset) + ":" + std::to_string(region.size) + ":" +
+          algorithmName(region.algo) + ":" + region.hash + "\n";
+        count++;
+      }
+    }
+    bool ok = write(fd, data.data(), data.length()) == (ssize_t)data.length() && fsync(fd) == 0;
+    close(fd);
+    if(!ok || rename(temp.c_str(), path.c_str()) != 0) {
+      unlink(temp.c_str());
+      return;
+    }
+    lines = count;
+  }
+};
@@ -0,0 +1,58 @@
+#ifndef __IVEIOTA_WRITTEN_REGIONS_HH
+#define __IVEIOTA_WRITTEN_REGIONS_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "support.hh"
+
+namespace iVeiOTA {
+  // A record of the image chunks that have been written to each device, by where they
+  //  went and the hash of what was written.  When a later update has a chunk with the same
+  //  hash in the same place, it is already there and doesn't need writing again.
+  //  Every change is synced to a log file before it returns, so a region is always
+  //  forgotten before anything writes over it.  Devices are known by their path, so the
+  //  record follows a partition whichever container it is in at the time
+  class WrittenRegions {
+  public:
+    explicit WrittenRegions(const std::string &path);
+
+    // True if size bytes of device at offset were last written with data that hashed to hash
+    bool Holds(const std::string &device, uint64_t offset, uint64_t size,
+               HashAlgorithm algo, const std::string &hash);
+
+    // Remember that the region now holds data with this hash
+    void Record(const std::string &device, uint64_t offset, uint64_t size,
+                HashAlgorithm algo, const std::string &hash);
+
+    // Forget anything that overlaps the region, before it is written.  A size of 0 forgets
+    //  the whole device, and an empty device forgets every device
+    void Forget(const std::string &device, uint64_t offset = 0, uint64_t size = 0);
+
+  private:
+    struct Region {
+      uint64_t offset;
+      uint64_t size;
+      HashAlgorithm algo;
+      std::string hash;
+    };
+
+    // Apply a line of the log to the record.  Returns false if it isn't one
+    bool apply(const std::string &line);
+    void forget(const std::string &device, uint64_t offset, uint64_t size);
+    // Add a line to the log and sync it
+    void log(const std::string &line);
+    // Write the log out again with only what is in the record now
+    void compact();
+
+    std::string path;
+    std::mutex lock;
+    size_t lines;  // In the log, to know when it's worth compacting
+    std::map<std::string, std::vector<Region>> devices;
+  };
+};
+
+#endif